@@ -13,10 +13,15 @@
   See LICENSE file for details.
 */
 
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "fastyz.h"
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #pragma GCC diagnostic push
@@ -34,6 +39,18 @@
 #define YAZ0_UNLIKELY(c) (c)
 #endif
 
+/*
+ * Force inlining of the compression loops so that their mode parameters
+ * become compile-time constants at each call site.
+ */
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 2))
+#define YAZ0_FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define YAZ0_FORCE_INLINE __forceinline
+#else
+#define YAZ0_FORCE_INLINE inline
+#endif
+
 /*
  * Enable 64-bit optimizations on supported architectures.
  * This allows reading/comparing 4 bytes at a time using native instructions.
@@ -49,6 +66,26 @@
 #include <stdint-gcc.h>
 #endif
 
+/*
+ * Multi-threaded modes can be compiled out with -DFASTYZ_NO_THREADS, in
+ * which case they run on the calling thread and produce the same output.
+ */
+#if defined(__MSDOS__) && !defined(FASTYZ_NO_THREADS)
+#define FASTYZ_NO_THREADS
+#endif
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#if !defined(FASTYZ_NO_THREADS)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+#endif
+
 /* ========================================================================
  * Internal Constants
  * ======================================================================== */
@@ -68,6 +105,9 @@
 /* Maximum back-reference distance */
 #define MAX_MATCH_DISTANCE YAZ0_MAX_MATCH_DISTANCE
 
+/* Largest supported match search alignment */
+#define MAX_ALIGNMENT 16
+
 /*
  * Hash table size configuration.
  *
@@ -234,7 +274,7 @@ static inline void writer_new_group(yaz0_writer_t* w)
  * Emit N literal bytes to the output.
  * Each literal byte sets the corresponding flag bit to 1.
  */
-static inline void writer_emit_literals(yaz0_writer_t* w, uint32_t count, const uint8_t* src)
+static YAZ0_FORCE_INLINE void writer_emit_literals(yaz0_writer_t* w, uint32_t count, const uint8_t* src)
 {
     if (YAZ0_UNLIKELY(count == 0))
         return;
@@ -303,7 +343,7 @@ static inline void writer_emit_literals(yaz0_writer_t* w, uint32_t count, const
  *
  * Distance is stored as (distance - 1), allowing distances 1-4096.
  */
-static inline void writer_emit_match(yaz0_writer_t* w, uint32_t len, uint32_t distance)
+static YAZ0_FORCE_INLINE void writer_emit_match(yaz0_writer_t* w, uint32_t len, uint32_t distance)
 {
     distance--;
     
@@ -358,201 +398,4054 @@ static inline void writer_emit_match(yaz0_writer_t* w, uint32_t len, uint32_t di
 }
 
 /* ========================================================================
- * Public API: Compression
+ * Timing and Threading Utilities
  * ======================================================================== */
 
-int yaz0_compress(const void* input, int length, void* output)
+/*
+ * Monotonic wall-clock time in seconds. Without the POSIX clocks (a system
+ * header included before the _POSIX_C_SOURCE request in a single
+ * translation unit build under strict ISO C) it falls back to the
+ * processor time of clock().
+ */
+static double time_now(void)
 {
-    const uint8_t* ip = (const uint8_t*)input;
-    const uint8_t* ip_start = ip;
-    const uint8_t* ip_bound = ip + length - 4;  /* Leave room for read_u32 */
-    const uint8_t* ip_limit = ip + length - 12 - 1;
-    uint8_t* op = (uint8_t*)output;
+#if defined(_WIN32)
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
 
-    /* Write the Yaz0 header */
-    op[0] = 'Y';
-    op[1] = 'a';
-    op[2] = 'z';
-    op[3] = '0';
-    op[4] = (length >> 24) & 0xFF;
-    op[5] = (length >> 16) & 0xFF;
-    op[6] = (length >>  8) & 0xFF;
-    op[7] = (length      ) & 0xFF;
-    
-    /* Reserved fields (alignment hint and padding) */
-    for (int i = 8; i < YAZ0_HEADER_SIZE; ++i)
-        op[i] = 0;
+#if !defined(FASTYZ_NO_THREADS)
 
-    /* Initialize writer state after the 16-byte header */
-    yaz0_writer_t w;
-    w.op = op + YAZ0_HEADER_SIZE;
-    writer_new_group(&w);
+/*
+ * Acquire/release accesses to 32-bit variables shared between threads.
+ */
+#if defined(_MSC_VER) && !defined(__clang__)
+#define atomic_load_acquire(p)     ((uint32_t)_InterlockedOr((volatile long*)(p), 0))
+#define atomic_store_release(p, v) ((void)_InterlockedExchange((volatile long*)(p), (long)(v)))
+#define atomic_fetch_inc(p)        ((uint32_t)_InterlockedIncrement((volatile long*)(p)) - 1)
+#define atomic_exchange(p, v)      ((uint32_t)_InterlockedExchange((volatile long*)(p), (long)(v)))
+#else
+#define atomic_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_fetch_inc(p)        __atomic_fetch_add((p), 1, __ATOMIC_ACQ_REL)
+#define atomic_exchange(p, v)      __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#endif
 
-    /* Initialize hash table for match finding */
-    uint32_t htab[HASH_SIZE] = { 0 };
+#if defined(_WIN32)
+typedef HANDLE yaz0_thread_t;
+#else
+typedef pthread_t yaz0_thread_t;
+#endif
 
-    /* Start with literal copy (first 2 bytes can't have back-references) */
-    const uint8_t* anchor = ip;
-    ip += (SHORT_FORM_MIN - 1);
+typedef void (*yaz0_thread_func_t)(void* arg);
 
-    /* Main compression loop */
-    while (YAZ0_LIKELY(ip < ip_limit))
-    {
-        const uint8_t* ref;
-        uint32_t distance, cmp, seq, hash;
+typedef struct
+{
+    yaz0_thread_func_t func;
+    void* arg;
+} yaz0_thread_start_t;
 
-        /* Find a potential match using the hash table */
-        do
-        {
-            seq = read_u32(ip) & 0xffffff;  /* Use 3 bytes for hashing, the minimum match length */
-            hash = compute_hash(seq);
-            ref = ip_start + htab[hash];
-            htab[hash] = ip - ip_start;
-            distance = ip - ref;
-            
-            /* Check if the match is valid (within distance and matching) */
-            cmp = YAZ0_LIKELY(distance < MAX_MATCH_DISTANCE) 
-                  ? read_u32(ref) & 0xffffff 
-                  : 0x1000000;
-            
-            if (YAZ0_UNLIKELY(ip >= ip_limit))
-                break;
-            ++ip;
-        } while (seq != cmp);
+#if defined(_WIN32)
+static DWORD WINAPI thread_entry(LPVOID param)
+{
+    yaz0_thread_start_t* start = (yaz0_thread_start_t*)param;
+    start->func(start->arg);
+    return 0;
+}
+#else
+static void* thread_entry(void* param)
+{
+    yaz0_thread_start_t* start = (yaz0_thread_start_t*)param;
+    start->func(start->arg);
+    return NULL;
+}
+#endif
 
-        if (YAZ0_UNLIKELY(ip >= ip_limit))
-            break;
-        --ip;
+/*
+ * Start a thread running func(arg). 'start' must stay alive until the
+ * thread has been joined. Returns false if the thread could not be created.
+ */
+static bool thread_create(yaz0_thread_t* thread, yaz0_thread_start_t* start)
+{
+#if defined(_WIN32)
+    *thread = CreateThread(NULL, 0, thread_entry, start, 0, NULL);
+    return *thread != NULL;
+#else
+    return pthread_create(thread, NULL, thread_entry, start) == 0;
+#endif
+}
 
-        /* Emit any pending literals before this match */
-        if (YAZ0_LIKELY(anchor < ip))
-            writer_emit_literals(&w, (uint32_t)(ip - anchor), anchor);
+static void thread_join(yaz0_thread_t thread)
+{
+#if defined(_WIN32)
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
 
-        /* Extend the match as far as possible */
-        uint32_t len = compare_match(ref + SHORT_FORM_MIN, ip + SHORT_FORM_MIN, ip_bound) + SHORT_FORM_MIN;
-        writer_emit_match(&w, len, distance);
+static void thread_yield(void)
+{
+#if defined(_WIN32)
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
 
-        /* Advance past the matched region */
-        ip += len;
-        anchor = ip;
+/*
+ * Spin lock for short critical sections, such as a progress callback
+ * shared by worker threads.
+ */
+static void spin_lock(uint32_t* lock)
+{
+    while (atomic_exchange(lock, 1))
+        thread_yield();
+}
 
-        /* Update hash table at the match boundary for future matches */
-        seq = read_u32(ip);
-        hash = compute_hash(seq & 0xFFFFFF);
-        htab[hash] = ip++ - ip_start;
-        seq >>= 8;
-        hash = compute_hash(seq);
-        htab[hash] = ip++ - ip_start;
+static void spin_unlock(uint32_t* lock)
+{
+    atomic_store_release(lock, 0);
+}
+
+#endif /* !FASTYZ_NO_THREADS */
+
+#if defined(FASTYZ_NO_THREADS)
+#define atomic_load_acquire(p)     (*(p))
+#define atomic_store_release(p, v) ((void)(*(p) = (v)))
+#define atomic_fetch_inc(p)        ((*(p))++)
+#define spin_lock(lock)            ((void)(lock))
+#define spin_unlock(lock)          ((void)(lock))
+#endif
+
+/* Upper bound on worker threads for batch operations */
+#define MAX_WORKERS 64
+
+/*
+ * Number of worker threads to use when the caller asks for 'threads'
+ * (<= 0 selects one per online processor).
+ */
+static int thread_count(int threads)
+{
+#if defined(FASTYZ_NO_THREADS)
+    (void)threads;
+    return 1;
+#else
+    if (threads <= 0)
+    {
+#if defined(_WIN32)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        threads = (int)info.dwNumberOfProcessors;
+#else
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
     }
 
-    /* Emit any remaining literals at the end of input */
-    uint32_t remaining = ip_start + length - anchor;
-    writer_emit_literals(&w, remaining, anchor);
+    if (threads < 1)
+        threads = 1;
+    return threads < MAX_WORKERS ? threads : MAX_WORKERS;
+#endif
+}
+
+/*
+ * Run worker(arg) on 'threads' threads, including the calling one, and wait
+ * for all of them. The workers share 'arg' and split the work themselves;
+ * if threads cannot be created, the calling thread does all of it.
+ */
+static void run_workers(void (*worker)(void* arg), void* arg, int threads)
+{
+#if !defined(FASTYZ_NO_THREADS)
+    yaz0_thread_t handles[MAX_WORKERS];
+    yaz0_thread_start_t start = { worker, arg };
+    int started = 0;
+
+    while (started < threads - 1 && thread_create(&handles[started], &start))
+        ++started;
+
+    worker(arg);
 
-    return (int)(w.op - (uint8_t*)output);
+    while (started > 0)
+        thread_join(handles[--started]);
+#else
+    (void)threads;
+    worker(arg);
+#endif
 }
 
 /* ========================================================================
- * Public API: Decompression
+ * Token Ring
  * ======================================================================== */
 
-int yaz0_decompress(const void* input, int length, void* output, int maxout)
+/*
+ * A token is a literal run followed by an optional match (len = 0 for none).
+ * The literal bytes themselves are not stored: the consumer reads them from
+ * the input, tracking its position from the token lengths.
+ */
+typedef struct
 {
-    /* Validate header magic */
-    if (length < YAZ0_HEADER_SIZE)
-        return 0;
+    uint32_t literals;
+    uint32_t len;
+    uint32_t distance;
+} yaz0_token_t;
 
-    /* Read decompressed size */
-    uint32_t decompressed_size = yaz0_get_decompressed_size(input);
-    if (decompressed_size == 0)
-        return 0;
+/* Ring capacity in tokens (power of two) and publication batch size */
+#define RING_SIZE  4096
+#define RING_MASK  (RING_SIZE - 1)
+#define RING_BATCH 64
 
-    /* Check output buffer is large enough */
-    if ((int)decompressed_size > maxout)
-        return 0;
+/* Busy-wait iterations before yielding the CPU while stalled */
+#define RING_SPINS 64
 
-    const uint8_t* src = (const uint8_t*)input;
-    const uint8_t* src_end = src + length;
-    uint8_t* dst = (uint8_t*)output;
-    uint8_t* dst_end = dst + maxout;
+/*
+ * Lock-free single-producer/single-consumer token ring.
+ *
+ * The producer (match finder) and consumer (writer) each keep a private
+ * cursor and publish it to the other side in batches, so the shared cache
+ * lines are touched once per RING_BATCH tokens rather than once per token.
+ */
+typedef struct
+{
+    yaz0_token_t* tokens;
 
-    /* Skip header */
-    src += YAZ0_HEADER_SIZE;
+    /* Producer-owned */
+    uint32_t head;           /* Next slot to fill */
+    uint32_t tail_cache;     /* Last consumer position seen by the producer */
+    uint32_t push_stalls;    /* Times the producer found the ring full */
+    double push_wait;        /* Seconds spent waiting for free slots */
+    uint8_t pad0[64];
 
-    /* Decompression loop */
-    uint8_t flag = 0;
-    int bits_remaining = 0;
+    /* Shared: written by the producer */
+    uint32_t published_head;
+    uint32_t finished;
+    uint8_t pad1[64];
 
-    while (dst < (uint8_t*)output + decompressed_size)
+    /* Shared: written by the consumer */
+    uint32_t published_tail;
+    uint8_t pad2[64];
+
+    /* Consumer-owned */
+    uint32_t pop_stalls;     /* Times the consumer found the ring empty */
+    double pop_wait;         /* Seconds spent waiting for tokens */
+} yaz0_ring_t;
+
+#if !defined(FASTYZ_NO_THREADS)
+
+/*
+ * Slow path of ring_push(): publish pending tokens and wait for room.
+ */
+static void ring_wait_space(yaz0_ring_t* ring)
+{
+    double start = time_now();
+
+    atomic_store_release(&ring->published_head, ring->head);
+    ++ring->push_stalls;
+
+    for (uint32_t spins = 0; ; ++spins)
     {
-        /* Read new flag byte when all bits are consumed */
-        if (bits_remaining == 0)
-        {
-            if (src >= src_end)
-                return 0;
-            flag = *src++;
-            bits_remaining = 8;
-        }
+        ring->tail_cache = atomic_load_acquire(&ring->published_tail);
+        if (ring->head - ring->tail_cache < RING_SIZE)
+            break;
+        if (spins >= RING_SPINS)
+            thread_yield();
+    }
 
-        if (flag & 0x80)
-        {
-            /* Flag bit = 1: literal byte */
-            if (src >= src_end || dst >= dst_end)
-                return 0;
-            *dst++ = *src++;
-        }
-        else
-        {
-            /* Flag bit = 0: match reference */
-            if (src + 2 > src_end)
-                return 0;
+    ring->push_wait += time_now() - start;
+}
 
-            uint8_t byte1 = *src++;
-            uint8_t byte2 = *src++;
+static YAZ0_FORCE_INLINE void ring_push(yaz0_ring_t* ring, uint32_t literals, uint32_t len, uint32_t distance)
+{
+    if (YAZ0_UNLIKELY(ring->head - ring->tail_cache == RING_SIZE))
+        ring_wait_space(ring);
 
-            /* Extract distance (always present in first 2 bytes) */
-            uint32_t distance = ((byte1 & 0x0F) << 8) | byte2;
-            distance++;  /* Stored as distance-1 */
+    yaz0_token_t* t = &ring->tokens[ring->head & RING_MASK];
+    t->literals = literals;
+    t->len = len;
+    t->distance = distance;
 
-            uint32_t len = byte1 >> 4;
-            if (len == 0)
+    if ((++ring->head & (RING_BATCH - 1)) == 0)
+        atomic_store_release(&ring->published_head, ring->head);
+}
+
+/*
+ * Publish the remaining tokens and signal the end of the stream.
+ */
+static void ring_finish(yaz0_ring_t* ring)
+{
+    atomic_store_release(&ring->published_head, ring->head);
+    atomic_store_release(&ring->finished, 1);
+}
+
+/*
+ * Serialize tokens from the ring until the producer finishes.
+ */
+static void ring_drain(yaz0_ring_t* ring, yaz0_writer_t* w, const uint8_t* ip)
+{
+    uint32_t tail = 0;
+
+    for (;;)
+    {
+        uint32_t head = atomic_load_acquire(&ring->published_head);
+
+        if (head == tail)
+        {
+            if (atomic_load_acquire(&ring->finished))
             {
-                /* Long form: length in third byte */
-                if (src >= src_end)
-                    return 0;
-                len = *src++;
-                len += LONG_FORM_MIN;
+                head = atomic_load_acquire(&ring->published_head);
+                if (head == tail)
+                    break;
             }
             else
             {
-                /* Short form: length in high nibble */
-                len += (SHORT_FORM_MIN - 1);
+                double start = time_now();
+                ++ring->pop_stalls;
+                for (uint32_t spins = 0; atomic_load_acquire(&ring->published_head) == tail &&
+                                         !atomic_load_acquire(&ring->finished); ++spins)
+                {
+                    if (spins >= RING_SPINS)
+                        thread_yield();
+                }
+                ring->pop_wait += time_now() - start;
+                continue;
             }
+        }
 
-            /* Validate back-reference */
-            if (dst - distance < (uint8_t*)output)
-                return 0;
-            if (dst + len > dst_end)
-                return 0;
+        for (; tail != head; ++tail)
+        {
+            const yaz0_token_t* t = &ring->tokens[tail & RING_MASK];
 
-            /* Copy from back-reference (byte-by-byte for overlapping copies) */
-            const uint8_t* ref = dst - distance;
-            for (uint32_t i = 0; i < len; ++i)
-                *dst++ = *ref++;
+            writer_emit_literals(w, t->literals, ip);
+            ip += t->literals;
+
+            if (t->len)
+            {
+                writer_emit_match(w, t->len, t->distance);
+                ip += t->len;
+            }
         }
 
-        flag <<= 1;
-        bits_remaining--;
+        atomic_store_release(&ring->published_tail, tail);
+    }
+}
+
+#else
+
+/* Without threads the ring is never used; keep the hot loops compiling */
+static YAZ0_FORCE_INLINE void ring_push(yaz0_ring_t* ring, uint32_t literals, uint32_t len, uint32_t distance)
+{
+    (void)ring;
+    (void)literals;
+    (void)len;
+    (void)distance;
+}
+
+#endif /* !FASTYZ_NO_THREADS */
+
+/*
+ * Emit a literal run followed by a match, either straight to the writer or,
+ * when 'ring' is set, to the encoder thread of a pipelined compression.
+ */
+static YAZ0_FORCE_INLINE void emit_token(yaz0_writer_t* w, yaz0_ring_t* ring, const uint8_t* literals,
+                                         uint32_t count, uint32_t len, uint32_t distance)
+{
+    if (ring)
+    {
+        ring_push(ring, count, len, distance);
+        return;
     }
 
-    return (int)(dst - (uint8_t*)output);
+    if (YAZ0_LIKELY(count))
+        writer_emit_literals(w, count, literals);
+    writer_emit_match(w, len, distance);
+}
+
+/*
+ * Emit a final literal run that is not followed by a match.
+ */
+static YAZ0_FORCE_INLINE void emit_literals(yaz0_writer_t* w, yaz0_ring_t* ring, const uint8_t* literals, uint32_t count)
+{
+    if (ring)
+        ring_push(ring, count, 0, 0);
+    else
+        writer_emit_literals(w, count, literals);
+}
+
+/* ========================================================================
+ * Compression Core
+ * ======================================================================== */
+
+/*
+ * Write the 16-byte Yaz0 header for a stream of 'length' decompressed bytes.
+ */
+static void write_header(uint8_t* op, uint32_t length)
+{
+    op[0] = 'Y';
+    op[1] = 'a';
+    op[2] = 'z';
+    op[3] = '0';
+    op[4] = (length >> 24) & 0xFF;
+    op[5] = (length >> 16) & 0xFF;
+    op[6] = (length >>  8) & 0xFF;
+    op[7] = (length      ) & 0xFF;
+
+    /* Reserved fields (alignment hint and padding) */
+    for (int i = 8; i < YAZ0_HEADER_SIZE; ++i)
+        op[i] = 0;
+}
+
+/*
+ * Decoder-friendly match selection (see yaz0_params_t::decode_speed).
+ *
+ * Every match token costs a decoder a flag branch and a copy loop, and
+ * overlapping matches (distance < length) force a byte-by-byte copy. The
+ * policy rejects short matches that would sit between literals, moves
+ * overlapping matches to a non-overlapping distance when the data allows
+ * it, and limits the number of match tokens per KiB of input.
+ */
+typedef struct
+{
+    uint32_t min_len;      /* Minimum length of a match that follows literals */
+    uint32_t max_matches;  /* Match tokens allowed per KiB of input (0 = unlimited) */
+    uint32_t block;        /* Current 1 KiB block of input */
+    uint32_t matches;      /* Match tokens spent in the current block */
+    uint32_t anchor;       /* Logical position just past the last accepted match */
+} yaz0_decode_policy_t;
+
+/* Policy settings for decode_speed levels 1-9 */
+static const uint8_t decode_policy_min_len[10] = { 3, 4, 4, 4, 5, 5, 5, 5, 6, 6 };
+static const uint8_t decode_policy_max_matches[10] = { 0, 0, 160, 128, 96, 80, 64, 56, 48, 32 };
+
+static void decode_policy_init(yaz0_decode_policy_t* policy, int decode_speed)
+{
+    policy->min_len = decode_policy_min_len[decode_speed];
+    policy->max_matches = decode_policy_max_matches[decode_speed];
+    policy->block = 0;
+    policy->matches = 0;
+    policy->anchor = 0;
+}
+
+/*
+ * Decide whether a match of 'len' bytes at 'ip' (logical position 'pos')
+ * should be emitted. May replace '*distance' with a non-overlapping
+ * distance that yields the same match. Returns false if the bytes should
+ * be left as literals.
+ *
+ * Pending literals are tracked by logical position rather than by the
+ * caller's range anchor, so splitting the input into ranges (progress
+ * chunks, fit attempts, the pipelined ring) selects the same matches as
+ * compressing it in one call.
+ */
+static bool decode_policy_accept(yaz0_decode_policy_t* policy, const uint8_t* base, uint32_t pos,
+                                 const uint8_t* ip, uint32_t len, uint32_t* distance)
+{
+    /* Short matches between literals cost more to decode than they save */
+    if (pos > policy->anchor && len < policy->min_len)
+        return false;
+
+    if (policy->max_matches)
+    {
+        uint32_t block = pos >> 10;
+        if (block != policy->block)
+        {
+            policy->block = block;
+            policy->matches = 0;
+        }
+
+        /* Once the budget is spent, only long matches are worth a token */
+        if (policy->matches >= policy->max_matches && len < LONG_FORM_MIN)
+            return false;
+        ++policy->matches;
+    }
+
+    /*
+     * A match with period 'distance' also occurs at every multiple of it, so
+     * the first multiple >= len gives the same match without overlap when
+     * the repeated pattern extends back far enough.
+     */
+    if (*distance < len)
+    {
+        uint32_t d = ((len + *distance - 1) / *distance) * *distance;
+        if (d <= MAX_MATCH_DISTANCE && d <= (uint32_t)(ip - base) &&
+            compare_match(ip - d, ip, ip + len) >= len)
+            *distance = d;
+    }
+
+    policy->anchor = pos + len;
+    return true;
+}
+
+/*
+ * Where the bytes around a compressed range live.
+ *
+ * The hash table stores logical positions in the input stream rather than
+ * pointers, so one table can be carried across ranges that live in
+ * different buffers (see compress_segments()). A window must contain at
+ * least min(pos, MAX_MATCH_DISTANCE) bytes of history before the first
+ * position it is used to compress, so that every hash table entry within
+ * match distance is addressable.
+ */
+typedef struct
+{
+    const uint8_t* base;   /* First addressable byte */
+    uint32_t base_pos;     /* Logical position of 'base' */
+    const uint8_t* limit;  /* End of addressable bytes; matches stop here */
+} yaz0_window_t;
+
+/*
+ * Logical position of a pointer into a window, computed relative to the
+ * window origin (the address logical position 0 would have). The origin is
+ * kept as an integer since it may lie outside the buffer.
+ */
+#define WINDOW_ORIGIN(win) ((uintptr_t)(win)->base - (win)->base_pos)
+#define WINDOW_POS(win, p) ((win)->base_pos + (uint32_t)((p) - (win)->base))
+
+/*
+ * A match of an earlier parse of the same data (e.g. the stream being
+ * transcoded), covering logical positions [pos, end) at 'distance'. The
+ * same distance is a candidate at every position the match covers.
+ */
+typedef struct
+{
+    uint32_t pos;
+    uint32_t end;
+    uint32_t distance;
+} yaz0_hint_t;
+
+typedef struct
+{
+    const yaz0_hint_t* items;  /* Hints ordered by position */
+    uint32_t count;
+    uint32_t next;             /* First hint that may cover the current position */
+} yaz0_hints_t;
+
+/*
+ * Match search settings for a range (see compress_select()).
+ */
+typedef struct
+{
+    uint32_t align;                /* Probe stride of the fast search (1 = every position) */
+    uint32_t phase;                /* Probe offset within the stride */
+    uint32_t depth;                /* Hash chain candidates per position; 0 = fast search */
+    uint32_t nice;                 /* Stop searching the chain at a match this long */
+    bool lazy;                     /* Defer a match by one byte if the next one is longer */
+    uint32_t* chain;               /* MAX_MATCH_DISTANCE chain links, used when depth > 0 */
+    yaz0_hints_t* hints;           /* Candidates from an earlier parse, or NULL */
+    yaz0_decode_policy_t* policy;  /* NULL unless decoder-friendly matching is enabled */
+} yaz0_search_t;
+
+/* Chain parser settings for levels 1-9 */
+static const uint16_t level_depth[10] = { 0, 2, 4, 8, 16, 32, 64, 128, 256, 1024 };
+static const uint16_t level_nice[10] = { 0, 16, 24, 32, 48, 64, 128, 192, MAX_LEN, MAX_LEN };
+
+/*
+ * Set up a search. 'chain' must hold MAX_MATCH_DISTANCE entries if level > 0.
+ */
+static void search_init(yaz0_search_t* s, uint32_t align, uint32_t phase, int level, uint32_t* chain,
+                        yaz0_decode_policy_t* policy)
+{
+    s->align = align;
+    s->phase = phase;
+    s->depth = level_depth[level];
+    s->nice = level_nice[level];
+    s->lazy = level >= 4;
+    s->chain = chain;
+    s->hints = NULL;
+    s->policy = policy;
+}
+
+/*
+ * Greedy byte-granular match search (the FastLZ strategy).
+ *
+ * Compresses positions [ip, ip_end) of the window. Every probed position is
+ * hashed and inserted into 'htab'. Matches may run past 'ip_end' up to the
+ * window limit; the return value is the position where the next range
+ * starts. 'policy' is NULL unless decoder-friendly matching is enabled.
+ */
+static YAZ0_FORCE_INLINE const uint8_t* compress_fast(yaz0_writer_t* w, yaz0_ring_t* ring, uint32_t* htab,
+                                                      const yaz0_window_t* win, const uint8_t* ip, const uint8_t* ip_end,
+                                                      yaz0_decode_policy_t* policy)
+{
+    const uintptr_t origin = WINDOW_ORIGIN(win);
+    const uint8_t* ip_bound = win->limit - 4;  /* Leave room for read_u32 */
+    const uint8_t* ip_limit = win->limit - ip > 12 + 1 ? win->limit - 12 - 1 : ip;
+
+    if (ip_end < ip_limit)
+        ip_limit = ip_end;
+
+    /* Start with literal copy (first 2 bytes can't have back-references) */
+    const uint8_t* anchor = ip;
+    if ((uint32_t)((uintptr_t)ip - origin) == 0)
+        ip += (SHORT_FORM_MIN - 1);
+
+    /* Main compression loop */
+    while (YAZ0_LIKELY(ip < ip_limit))
+    {
+        uint32_t distance, cmp, seq, hash, pos;
+
+        /* Find a potential match using the hash table */
+        do
+        {
+            seq = read_u32(ip) & 0xffffff;  /* Use 3 bytes for hashing, the minimum match length */
+            hash = compute_hash(seq);
+            pos = (uint32_t)((uintptr_t)ip - origin);
+            distance = pos - htab[hash];
+            htab[hash] = pos;
+            
+            /*
+             * Check if the match is valid (within distance and matching).
+             * Distance 0 can occur for a position inserted by the previous
+             * range; the unsigned wrap-around rejects it.
+             */
+            cmp = YAZ0_LIKELY(distance - 1 < MAX_MATCH_DISTANCE - 1) 
+                  ? read_u32(ip - distance) & 0xffffff 
+                  : 0x1000000;
+            
+            if (YAZ0_UNLIKELY(ip >= ip_limit))
+                break;
+            ++ip;
+        } while (seq != cmp);
+
+        if (YAZ0_UNLIKELY(ip >= ip_limit))
+            break;
+        --ip;
+
+        /* Extend the match as far as possible */
+        const uint8_t* ref = ip - distance;
+        uint32_t len = compare_match(ref + SHORT_FORM_MIN, ip + SHORT_FORM_MIN, ip_bound) + SHORT_FORM_MIN;
+
+        /* Leave rejected matches as literals and keep searching */
+        if (policy && !decode_policy_accept(policy, win->base, pos, ip, len, &distance))
+        {
+            ++ip;
+            continue;
+        }
+
+        /* Emit any pending literals followed by this match */
+        emit_token(w, ring, anchor, (uint32_t)(ip - anchor), len, distance);
+
+        /* Advance past the matched region */
+        ip += len;
+        anchor = ip;
+
+        /* Update hash table at the match boundary for future matches */
+        seq = read_u32(ip);
+        hash = compute_hash(seq & 0xFFFFFF);
+        htab[hash] = (uint32_t)((uintptr_t)ip - origin);
+        ++ip;
+        seq >>= 8;
+        hash = compute_hash(seq);
+        htab[hash] = (uint32_t)((uintptr_t)ip - origin);
+        ++ip;
+    }
+
+    /* Emit any remaining literals at the end of the range */
+    const uint8_t* stop = anchor > ip_end ? anchor : ip_end;
+    emit_literals(w, ring, anchor, (uint32_t)(stop - anchor));
+
+    return stop;
+}
+
+/*
+ * Aligned match search for arrays of fixed-size records.
+ *
+ * Only positions congruent to 'phase' modulo 'align' (a power of two) are
+ * hashed, inserted and probed, which cuts hash table work by a factor of
+ * 'align'. The parse itself stays byte-granular: a match found at an
+ * aligned position is extended backwards into the pending literals and
+ * forwards to its full length, so matches may start and end anywhere.
+ * Range semantics are those of compress_fast().
+ */
+static YAZ0_FORCE_INLINE const uint8_t* compress_aligned(yaz0_writer_t* w, yaz0_ring_t* ring, uint32_t* htab,
+                                                         const yaz0_window_t* win, const uint8_t* ip, const uint8_t* ip_end,
+                                                         const uint32_t align, uint32_t phase, yaz0_decode_policy_t* policy)
+{
+    const uint8_t* ip_bound = win->limit - 4;  /* Leave room for read_u32 */
+    const uint8_t* ip_limit = win->limit - ip > 12 + 1 ? win->limit - 12 - 1 : ip;
+
+    if (ip_end < ip_limit)
+        ip_limit = ip_end;
+
+    const uint8_t* anchor = ip;
+    uint32_t pos = WINDOW_POS(win, ip);
+
+    /* Start at the first aligned position (position 0 has no history) */
+    pos = phase + ((pos - phase + align - 1) & ~(align - 1));
+    if (pos == 0)
+        pos = align;
+    ip = win->base + (pos - win->base_pos);
+
+    while (YAZ0_LIKELY(ip < ip_limit))
+    {
+        const uint8_t* ref;
+        uint32_t distance, seq, hash;
+
+        /* Probe aligned positions until a verified match is found */
+        for (;;)
+        {
+            seq = read_u32(ip) & 0xffffff;
+            hash = compute_hash(seq);
+            pos = WINDOW_POS(win, ip);
+            distance = pos - htab[hash];
+            htab[hash] = pos;
+
+            if (distance - 1 < MAX_MATCH_DISTANCE - 1 && (read_u32(ip - distance) & 0xffffff) == seq)
+                break;
+
+            ip += align;
+            if (YAZ0_UNLIKELY(ip >= ip_limit))
+                goto done;
+        }
+
+        /* Extend the match backwards over pending literals */
+        const uint8_t* probe = ip;
+        ref = ip - distance;
+        while (ip > anchor && ref > win->base && ip[-1] == ref[-1])
+        {
+            --ip;
+            --ref;
+        }
+
+        uint32_t len = compare_match(ref + SHORT_FORM_MIN, ip + SHORT_FORM_MIN, ip_bound) + SHORT_FORM_MIN;
+
+        if (policy && !decode_policy_accept(policy, win->base, WINDOW_POS(win, ip), ip, len, &distance))
+        {
+            ip = probe + align;
+            continue;
+        }
+
+        emit_token(w, ring, anchor, (uint32_t)(ip - anchor), len, distance);
+
+        ip += len;
+        anchor = ip;
+
+        /* Resume probing at the next aligned position */
+        pos = WINDOW_POS(win, ip);
+        pos = phase + ((pos - phase + align - 1) & ~(align - 1));
+        ip = win->base + (pos - win->base_pos);
+    }
+
+done:
+    {
+        const uint8_t* stop = anchor > ip_end ? anchor : ip_end;
+        emit_literals(w, ring, anchor, (uint32_t)(stop - anchor));
+        return stop;
+    }
+}
+
+/*
+ * Insert position 'p' into the hash chains.
+ */
+static YAZ0_FORCE_INLINE void chain_insert(uint32_t* htab, uint32_t* chain, uintptr_t origin, const uint8_t* p)
+{
+    uint32_t pos = (uint32_t)((uintptr_t)p - origin);
+    uint32_t hash = compute_hash(read_u32(p) & 0xffffff);
+
+    chain[pos & (MAX_MATCH_DISTANCE - 1)] = htab[hash];
+    htab[hash] = pos;
+}
+
+/*
+ * Longest match at 'ip' among the hash chain candidates and the hint that
+ * covers it, comparing no further than 'bound'. Returns the length (0 if
+ * none) and sets '*distance'. Positions before 'ip' must be inserted.
+ */
+static YAZ0_FORCE_INLINE uint32_t chain_find(const uint32_t* htab, const yaz0_search_t* s, const yaz0_window_t* win,
+                                             const uint8_t* ip, const uint8_t* bound, uint32_t* distance)
+{
+    const uint32_t pos = WINDOW_POS(win, ip);
+    const uint32_t reach = (uint32_t)(ip - win->base);
+    uint32_t cand = htab[compute_hash(read_u32(ip) & 0xffffff)];
+    uint32_t best = 0;
+
+    if (bound > ip + MAX_LEN)
+        bound = ip + MAX_LEN;
+
+    for (uint32_t depth = s->depth; depth; --depth)
+    {
+        uint32_t d = pos - cand;
+        if (d - 1 >= MAX_MATCH_DISTANCE || d > reach)
+            break;
+
+        /* Check the byte that would make this candidate the best first */
+        const uint8_t* ref = ip - d;
+        if (ref[best] == ip[best] && (read_u32(ref) & 0xffffff) == (read_u32(ip) & 0xffffff))
+        {
+            uint32_t len = compare_match(ref, ip, bound);
+            if (len > best)
+            {
+                best = len;
+                *distance = d;
+                if (len >= s->nice)
+                    return best;
+            }
+        }
+
+        /* Links are overwritten after MAX_MATCH_DISTANCE positions; stop at stale ones */
+        uint32_t next = s->chain[cand & (MAX_MATCH_DISTANCE - 1)];
+        if (next >= cand)
+            break;
+        cand = next;
+    }
+
+    if (s->hints)
+    {
+        yaz0_hints_t* h = s->hints;
+        while (h->next < h->count && h->items[h->next].end <= pos)
+            ++h->next;
+
+        if (h->next < h->count && h->items[h->next].pos <= pos)
+        {
+            uint32_t d = h->items[h->next].distance;
+            if (d <= reach && (best == 0 || d != *distance))
+            {
+                uint32_t len = compare_match(ip - d, ip, bound);
+                if (len > best)
+                {
+                    best = len;
+                    *distance = d;
+                }
+            }
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Hash chain match search (levels 1-9).
+ *
+ * Every position is inserted into a chain of earlier positions with the
+ * same hash, and up to 'depth' of them are compared to find the longest
+ * match. With 'lazy', a match is deferred by one byte when the next
+ * position has a longer one. Range semantics are those of compress_fast().
+ */
+static const uint8_t* compress_chain(yaz0_writer_t* w, yaz0_ring_t* ring, uint32_t* htab,
+                                     const yaz0_window_t* win, const uint8_t* ip, const uint8_t* ip_end,
+                                     const yaz0_search_t* s)
+{
+    const uintptr_t origin = WINDOW_ORIGIN(win);
+    const uint8_t* ip_bound = win->limit - 4;  /* Leave room for read_u32 */
+    const uint8_t* ip_limit = win->limit - ip > 12 + 1 ? win->limit - 12 - 1 : ip;
+    const uint8_t* ins_limit = win->limit - ip > 3 ? win->limit - 3 : ip;
+    const uint8_t* ins = ip;  /* Next position to insert */
+    const uint8_t* anchor = ip;
+
+    if (ip_end < ip_limit)
+        ip_limit = ip_end;
+
+    while (ip < ip_limit)
+    {
+        uint32_t distance = 0;
+        uint32_t len = chain_find(htab, s, win, ip, ip_bound, &distance);
+
+        if (len < SHORT_FORM_MIN)
+        {
+            chain_insert(htab, s->chain, origin, ins++);
+            ++ip;
+            continue;
+        }
+
+        /* Prefer a longer match starting at the next byte */
+        while (s->lazy && ip + 1 < ip_limit && len < s->nice)
+        {
+            uint32_t next_distance = 0;
+            if (ins <= ip)
+                chain_insert(htab, s->chain, origin, ins++);
+            uint32_t next_len = chain_find(htab, s, win, ip + 1, ip_bound, &next_distance);
+            if (next_len <= len)
+                break;
+            ++ip;
+            len = next_len;
+            distance = next_distance;
+        }
+
+        if (s->policy && !decode_policy_accept(s->policy, win->base, WINDOW_POS(win, ip), ip, len, &distance))
+        {
+            if (ins <= ip)
+                chain_insert(htab, s->chain, origin, ins++);
+            ++ip;
+            continue;
+        }
+
+        emit_token(w, ring, anchor, (uint32_t)(ip - anchor), len, distance);
+
+        ip += len;
+        anchor = ip;
+
+        while (ins < ip && ins < ins_limit)
+            chain_insert(htab, s->chain, origin, ins++);
+    }
+
+    const uint8_t* stop = anchor > ip_end ? anchor : ip_end;
+    emit_literals(w, ring, anchor, (uint32_t)(stop - anchor));
+
+    /* Later ranges search from 'stop' and expect everything before it inserted */
+    while (ins < stop && ins < ins_limit)
+        chain_insert(htab, s->chain, origin, ins++);
+
+    return stop;
+}
+
+/*
+ * Insert positions [from, to) of the window into the hash table without
+ * emitting anything, so that later ranges can match against them. Only
+ * positions that the selected match search would probe are inserted.
+ * 'to' must leave at least 3 readable bytes before the window limit.
+ */
+static void compress_prime(uint32_t* htab, const yaz0_window_t* win, const uint8_t* from, const uint8_t* to,
+                           const yaz0_search_t* s)
+{
+    uint32_t pos = WINDOW_POS(win, from);
+
+    if (s->depth)
+    {
+        for (const uint8_t* p = from; p < to; ++p)
+            chain_insert(htab, s->chain, WINDOW_ORIGIN(win), p);
+        return;
+    }
+
+    pos = s->phase + ((pos - s->phase + s->align - 1) & ~(s->align - 1));
+    for (const uint8_t* p = win->base + (pos - win->base_pos); p < to; p += s->align)
+        htab[compute_hash(read_u32(p) & 0xffffff)] = WINDOW_POS(win, p);
+}
+
+/*
+ * Prepare the hash chains for a chain search starting at 'ip' after a fast
+ * search, which does not maintain the links: re-insert the reachable
+ * history.
+ */
+static void chain_rebuild(uint32_t* htab, const yaz0_window_t* win, const uint8_t* ip, const yaz0_search_t* s)
+{
+    if (ip > win->base && win->limit - ip >= 3)
+    {
+        const uint8_t* from = ip - win->base > MAX_MATCH_DISTANCE ? ip - MAX_MATCH_DISTANCE : win->base;
+        compress_prime(htab, win, from, ip, s);
+    }
+}
+
+/*
+ * Run the match search selected by the parameters over a range, emitting
+ * tokens to 'w' or, when 'ring' is set, to the encoder thread.
+ */
+static YAZ0_FORCE_INLINE const uint8_t* compress_select(yaz0_writer_t* w, yaz0_ring_t* ring, uint32_t* htab,
+                                                        const yaz0_window_t* win, const uint8_t* ip, const uint8_t* ip_end,
+                                                        const yaz0_search_t* s)
+{
+    if (s->depth)
+        return compress_chain(w, ring, htab, win, ip, ip_end, s);
+
+    /* Specialize the probe loop for each supported stride */
+    switch (s->align)
+    {
+    case 1:  return compress_fast(w, ring, htab, win, ip, ip_end, s->policy);
+    case 2:  return compress_aligned(w, ring, htab, win, ip, ip_end, 2, s->phase, s->policy);
+    case 4:  return compress_aligned(w, ring, htab, win, ip, ip_end, 4, s->phase, s->policy);
+    case 8:  return compress_aligned(w, ring, htab, win, ip, ip_end, 8, s->phase, s->policy);
+    default: return compress_aligned(w, ring, htab, win, ip, ip_end, 16, s->phase, s->policy);
+    }
+}
+
+static const uint8_t* compress_range(yaz0_writer_t* w, uint32_t* htab, const yaz0_window_t* win,
+                                     const uint8_t* ip, const uint8_t* ip_end, const yaz0_search_t* s)
+{
+    return compress_select(w, NULL, htab, win, ip, ip_end, s);
+}
+
+/*
+ * Bounded chunks, for callers that stage output in a fixed-size buffer
+ * (fixed-capacity compression, exact size counting).
+ */
+
+/* Input bytes compressed between capacity checks */
+#define DESTSIZE_CHUNK 16384
+
+/* Input past the end of a chunk that its last match may cover (plus the read_u32 margin) */
+#define DESTSIZE_REACH (MAX_LEN + 4)
+
+/* Worst-case output of one chunk */
+#define DESTSIZE_WORST FASTYZ_BOUND(DESTSIZE_CHUNK + DESTSIZE_REACH)
+
+/*
+ * Compress the next chunk of the window. Matches stop DESTSIZE_REACH bytes
+ * past the chunk instead of at the window limit, so that a long run cannot
+ * make one chunk emit more than DESTSIZE_WORST bytes.
+ */
+static const uint8_t* compress_chunk(yaz0_writer_t* w, uint32_t* htab, const yaz0_window_t* win, const uint8_t* ip,
+                                     const yaz0_search_t* s)
+{
+    const uint8_t* ip_end = win->limit - ip > DESTSIZE_CHUNK ? ip + DESTSIZE_CHUNK : win->limit;
+    yaz0_window_t chunk = *win;
+
+    if (win->limit - ip_end > DESTSIZE_REACH)
+        chunk.limit = ip_end + DESTSIZE_REACH;
+    return compress_range(w, htab, &chunk, ip, ip_end, s);
+}
+
+/* ========================================================================
+ * Segmented Compression
+ * ======================================================================== */
+
+/*
+ * A contiguous piece of the logical input stream.
+ */
+typedef struct
+{
+    const uint8_t* data;
+    uint32_t size;
+} yaz0_segment_t;
+
+/* Bytes compressed per stitched piece */
+#define STITCH_SIZE 8192
+
+/* Bytes past the end of a piece that matches may still extend into */
+#define STITCH_OVERLAP 256
+
+/*
+ * Copy 'size' bytes of the logical stream starting at 'pos' into 'dest'.
+ */
+static void gather_segments(uint8_t* dest, const yaz0_segment_t* segs, uint32_t pos, uint32_t size)
+{
+    while (pos >= segs->size)
+    {
+        pos -= segs->size;
+        ++segs;
+    }
+
+    while (size)
+    {
+        uint32_t n = segs->size - pos;
+        if (n > size)
+            n = size;
+
+        memcpy(dest, segs->data + pos, n);
+        dest += n;
+        size -= n;
+        pos = 0;
+        ++segs;
+    }
+}
+
+/*
+ * Compress the logical concatenation of 'count' segments as one stream.
+ *
+ * The first 'skip' bytes are history only (e.g. a preset dictionary): they
+ * are inserted into the hash table but not emitted. Long runs inside one
+ * segment are compressed in place; the bytes around segment boundaries are
+ * copied together with their history into a small scratch buffer, so
+ * matches may cross boundaries without copying the whole input.
+ */
+static void compress_segments(yaz0_writer_t* w, uint32_t* htab, const yaz0_segment_t* segs, int count, uint32_t skip,
+                              const yaz0_search_t* search)
+{
+    uint8_t scratch[MAX_MATCH_DISTANCE + STITCH_SIZE + STITCH_OVERLAP];
+    uint32_t total = 0;
+
+    for (int i = 0; i < count; ++i)
+        total += segs[i].size;
+
+    uint32_t pos = skip;
+    uint32_t seg_pos = 0;
+    int s = 0;
+    bool primed = skip == 0;
+
+    while (pos < total)
+    {
+        while (pos >= seg_pos + segs[s].size)
+            seg_pos += segs[s++].size;
+
+        uint32_t off = pos - seg_pos;
+        uint32_t hist = pos < MAX_MATCH_DISTANCE ? pos : MAX_MATCH_DISTANCE;
+        uint32_t seg_end = seg_pos + segs[s].size;
+        yaz0_window_t win;
+        const uint8_t* ip;
+        const uint8_t* ip_end;
+
+        if (off >= hist && seg_end - pos > STITCH_SIZE)
+        {
+            /* The history is in this segment too: compress in place */
+            win.base = segs[s].data + off - hist;
+            win.base_pos = pos - hist;
+            win.limit = segs[s].data + segs[s].size;
+            ip = segs[s].data + off;
+            ip_end = seg_end < total ? win.limit - STITCH_OVERLAP : win.limit;
+        }
+        else
+        {
+            /* Stitch history and the next piece together in the scratch buffer */
+            uint32_t n = total - pos < STITCH_SIZE ? total - pos : STITCH_SIZE;
+            uint32_t extra = total - pos - n < STITCH_OVERLAP ? total - pos - n : STITCH_OVERLAP;
+
+            gather_segments(scratch, segs, pos - hist, hist + n + extra);
+            win.base = scratch;
+            win.base_pos = pos - hist;
+            win.limit = scratch + hist + n + extra;
+            ip = scratch + hist;
+            ip_end = ip + n;
+        }
+
+        if (!primed)
+        {
+            /* Insert the history-only bytes that precede the first range */
+            compress_prime(htab, &win, win.base, ip, search);
+            primed = true;
+        }
+
+        pos += (uint32_t)(compress_range(w, htab, &win, ip, ip_end, search) - ip);
+    }
+}
+
+/* ========================================================================
+ * Progress Reporting
+ * ======================================================================== */
+
+/*
+ * Progress state of one operation (see yaz0_progress_t).
+ */
+typedef struct
+{
+    const yaz0_progress_t* progress;
+    size_t interval;  /* Bytes between reports */
+    size_t next;      /* Position of the next report */
+} yaz0_reporter_t;
+
+static void reporter_init(yaz0_reporter_t* r, const yaz0_progress_t* progress)
+{
+    r->progress = progress;
+    r->interval = progress->interval ? progress->interval : YAZ0_PROGRESS_INTERVAL;
+    r->next = r->interval;
+}
+
+/*
+ * Invoke the callback if 'pos' has reached the next report position, or
+ * unconditionally when 'done'. Returns false if the callback cancelled.
+ */
+static bool reporter_update(yaz0_reporter_t* r, size_t pos, size_t consumed, size_t produced, bool done)
+{
+    if (pos < r->next && !done)
+        return true;
+
+    r->next = pos + r->interval;
+    return r->progress->callback(r->progress->user, consumed, produced) == 0;
+}
+
+/*
+ * Compress the whole window with one search in chunks of the reporting
+ * interval, reporting after each. Returns false if the callback cancelled.
+ */
+static bool compress_reported(yaz0_writer_t* w, uint32_t* htab, const yaz0_window_t* win, const yaz0_search_t* s,
+                              const uint8_t* op, yaz0_reporter_t* r)
+{
+    const uint8_t* ip = win->base;
+
+    while (ip < win->limit)
+    {
+        const uint8_t* ip_end = (size_t)(win->limit - ip) > r->interval ? ip + r->interval : win->limit;
+
+        ip = compress_range(w, htab, win, ip, ip_end, s);
+        if (!reporter_update(r, (size_t)(ip - win->base), (size_t)(ip - win->base), (size_t)(w->op - op),
+                             ip >= win->limit))
+            return false;
+    }
+
+    return true;
+}
+
+/* ========================================================================
+ * Adaptive Strategy
+ * ======================================================================== */
+
+/* Input bytes compressed with one strategy */
+#define ADAPT_REGION 65536
+
+/* Bytes sampled from the middle of a region to classify it */
+#define ADAPT_SAMPLE 4096
+
+typedef enum
+{
+    REGION_GENERIC,
+    REGION_INCOMPRESSIBLE,  /* Few repeated byte sequences */
+    REGION_RUNS,            /* Mostly runs of equal bytes (e.g. padding) */
+    REGION_STRUCTURED       /* Arrays of fixed-size records */
+} yaz0_region_kind_t;
+
+/*
+ * Classify the region [p, p + size) starting at logical position 'pos'.
+ * For structured regions, '*align' and '*phase' receive the record stride
+ * and the probe offset relative to logical position 0.
+ */
+static yaz0_region_kind_t classify_region(const uint8_t* p, uint32_t size, uint32_t pos, uint32_t* align,
+                                          uint32_t* phase)
+{
+    uint32_t n = size < ADAPT_SAMPLE ? size : ADAPT_SAMPLE;
+    uint32_t off = (size - n) / 2;
+    const uint8_t* sample = p + off;
+
+    if (n < 4 * MAX_ALIGNMENT)
+        return REGION_GENERIC;
+
+    /* Runs: most bytes equal their predecessor */
+    uint32_t repeats = 0;
+    for (uint32_t i = 1; i < n; ++i)
+        repeats += sample[i] == sample[i - 1];
+    if (repeats > n / 2)
+        return REGION_RUNS;
+
+    /* Match density: bytes covered by a quick greedy search of the sample */
+    uint16_t table[1 << 12] = { 0 };
+    uint32_t matched = 0;
+    for (uint32_t i = 1; i + 8 <= n; )
+    {
+        uint32_t seq = read_u32(sample + i) & 0xffffff;
+        uint32_t hash = compute_hash(seq) >> (HASH_LOG - 12);
+        uint32_t ref = table[hash];
+        table[hash] = (uint16_t)i;
+
+        if ((read_u32(sample + ref) & 0xffffff) == seq)
+        {
+            uint32_t len = compare_match(sample + ref + SHORT_FORM_MIN, sample + i + SHORT_FORM_MIN, sample + n) +
+                           SHORT_FORM_MIN;
+            matched += len;
+            i += len;
+        }
+        else
+        {
+            ++i;
+        }
+    }
+    if (matched < n / 16)
+        return REGION_INCOMPRESSIBLE;
+
+    int detected_phase;
+    *align = (uint32_t)yaz0_detect_alignment(sample, (int)n, &detected_phase);
+    if (*align == 1)
+        return REGION_GENERIC;
+
+    *phase = (pos + off + (uint32_t)detected_phase) & (*align - 1);
+    return REGION_STRUCTURED;
+}
+
+/*
+ * Compress the whole window region by region, picking the match search for
+ * each region from its classification. 'base' is the search used for
+ * generic regions; the others derive from it, keeping its decode policy.
+ * All regions share 'htab' and emit to one stream. With a reporter 'r',
+ * progress is reported between regions relative to the output start 'op';
+ * returns false if the callback cancelled.
+ */
+static bool compress_adaptive(yaz0_writer_t* w, yaz0_ring_t* ring, uint32_t* htab, const yaz0_window_t* win,
+                              const yaz0_search_t* base, const uint8_t* op, yaz0_reporter_t* r)
+{
+    const uint8_t* ip = win->base;
+    bool chained = false;
+
+    while (ip < win->limit)
+    {
+        uint32_t size = win->limit - ip > ADAPT_REGION ? ADAPT_REGION : (uint32_t)(win->limit - ip);
+        uint32_t align = 1, phase = 0;
+        yaz0_search_t s = *base;
+
+        switch (classify_region(ip, size, WINDOW_POS(win, ip), &align, &phase))
+        {
+        case REGION_INCOMPRESSIBLE:
+            /* Probe sparsely; only repeats of earlier data are worth finding */
+            s.depth = 0;
+            s.align = MAX_ALIGNMENT;
+            s.phase = 0;
+            break;
+        case REGION_RUNS:
+            /* Runs are found at distance 1 by the greedy search */
+            s.depth = 0;
+            break;
+        case REGION_STRUCTURED:
+            if (!s.depth)
+            {
+                s.align = align;
+                s.phase = phase;
+            }
+            break;
+        default:
+            break;
+        }
+
+        if (s.depth && !chained)
+            chain_rebuild(htab, win, ip, &s);
+        chained = s.depth != 0;
+
+        ip = compress_select(w, ring, htab, win, ip, ip + size, &s);
+
+        if (r && !reporter_update(r, (size_t)(ip - win->base), (size_t)(ip - win->base), (size_t)(w->op - op),
+                                  ip >= win->limit))
+            return false;
+    }
+
+    return true;
+}
+
+/* ========================================================================
+ * Public API: Compression
+ * ======================================================================== */
+
+/*
+ * Greedy compression of a whole input (yaz0_compress()). Positions are
+ * 32-bit, so any length up to YAZ0_MAX_INPUT_SIZE works. 'htab' must be
+ * zeroed.
+ */
+static size_t compress_default(const uint8_t* ip, uint32_t length, uint8_t* op, uint32_t* htab)
+{
+    /* Write the Yaz0 header */
+    write_header(op, length);
+
+    /* Initialize writer state after the 16-byte header */
+    yaz0_writer_t w;
+    w.op = op + YAZ0_HEADER_SIZE;
+    writer_new_group(&w);
+
+    yaz0_window_t win = { ip, 0, ip + length };
+
+    compress_fast(&w, NULL, htab, &win, ip, win.limit, NULL);
+
+    return (size_t)(w.op - op);
+}
+
+FASTYZ_API int yaz0_compress(const void* input, int length, void* output)
+{
+    /* Initialize hash table for match finding */
+    uint32_t htab[HASH_SIZE] = { 0 };
+
+    return (int)compress_default((const uint8_t*)input, (uint32_t)length, (uint8_t*)output, htab);
+}
+
+FASTYZ_API size_t yaz0_compress64(const void* input, size_t length, void* output)
+{
+    if (length > YAZ0_MAX_INPUT_SIZE)
+        return 0;
+
+    uint32_t htab[HASH_SIZE] = { 0 };
+    return compress_default((const uint8_t*)input, (uint32_t)length, (uint8_t*)output, htab);
+}
+
+FASTYZ_API void yaz0_params_init(yaz0_params_t* params)
+{
+    params->alignment = 1;
+    params->alignment_phase = 0;
+    params->decode_speed = 0;
+    params->level = 0;
+    params->strategy = YAZ0_STRATEGY_FIXED;
+}
+
+/*
+ * Validate parameters and resolve automatic settings for an input.
+ * Returns false if the parameters are invalid.
+ */
+static bool resolve_params(const yaz0_params_t* params, const void* input, size_t length, uint32_t* align, uint32_t* phase)
+{
+    *align = (uint32_t)params->alignment;
+    *phase = (uint32_t)params->alignment_phase;
+
+    if (params->level < 0 || params->level > 9)
+        return false;
+    if (params->strategy != YAZ0_STRATEGY_FIXED && params->strategy != YAZ0_STRATEGY_ADAPTIVE)
+        return false;
+
+    /*
+     * The chain parser visits every position, and adaptive mode picks the
+     * alignment per region; the alignment parameters do not apply.
+     */
+    if (params->level > 0 || params->strategy == YAZ0_STRATEGY_ADAPTIVE)
+    {
+        *align = 1;
+        *phase = 0;
+    }
+
+    if (*align == 0)
+    {
+        /* Detection samples the input; the first 2 GiB are representative enough */
+        int detected_phase;
+        int sampled = length < INT32_MAX ? (int)length : INT32_MAX;
+        *align = (uint32_t)yaz0_detect_alignment(input, sampled, &detected_phase);
+        *phase = (uint32_t)detected_phase;
+    }
+
+    /* Alignment must be a power of two no larger than MAX_ALIGNMENT */
+    if (*align > MAX_ALIGNMENT || (*align & (*align - 1)) != 0 || *phase >= *align)
+        return false;
+    if (params->decode_speed < 0 || params->decode_speed > 9)
+        return false;
+
+    return true;
+}
+
+/*
+ * Compress a whole input with explicit parameters (yaz0_compress_ex()),
+ * using the zeroed hash table 'htab' and a MAX_MATCH_DISTANCE entry 'chain',
+ * reporting to 'progress' if it is not NULL. Returns 0 if the parameters
+ * are invalid or the callback cancelled.
+ */
+static size_t compress_params(const uint8_t* ip, uint32_t length, uint8_t* op, const yaz0_params_t* params,
+                              uint32_t* htab, uint32_t* chain, const yaz0_progress_t* progress)
+{
+    uint32_t align, phase;
+
+    if (!resolve_params(params, ip, length, &align, &phase))
+        return 0;
+
+    if (align == 1 && params->decode_speed == 0 && params->level == 0 && params->strategy == YAZ0_STRATEGY_FIXED &&
+        !progress)
+        return compress_default(ip, length, op, htab);
+
+    write_header(op, length);
+
+    yaz0_writer_t w;
+    w.op = op + YAZ0_HEADER_SIZE;
+    writer_new_group(&w);
+
+    yaz0_decode_policy_t policy;
+    yaz0_decode_policy_t* pp = NULL;
+    if (params->decode_speed)
+    {
+        decode_policy_init(&policy, params->decode_speed);
+        pp = &policy;
+    }
+
+    yaz0_window_t win = { ip, 0, ip + length };
+    yaz0_search_t search;
+    search_init(&search, align, phase, params->level, chain, pp);
+
+    if (progress)
+    {
+        yaz0_reporter_t r;
+        reporter_init(&r, progress);
+
+        bool finished = params->strategy == YAZ0_STRATEGY_ADAPTIVE
+                      ? compress_adaptive(&w, NULL, htab, &win, &search, op, &r)
+                      : compress_reported(&w, htab, &win, &search, op, &r);
+        if (!finished)
+            return 0;
+    }
+    else if (params->strategy == YAZ0_STRATEGY_ADAPTIVE)
+        compress_adaptive(&w, NULL, htab, &win, &search, NULL, NULL);
+    else
+        compress_range(&w, htab, &win, ip, win.limit, &search);
+
+    return (size_t)(w.op - op);
+}
+
+FASTYZ_API int yaz0_compress_ex(const void* input, int length, void* output, const yaz0_params_t* params)
+{
+    uint32_t htab[HASH_SIZE] = { 0 };
+    uint32_t chain[MAX_MATCH_DISTANCE];
+
+    return (int)compress_params((const uint8_t*)input, (uint32_t)length, (uint8_t*)output, params, htab, chain, NULL);
+}
+
+FASTYZ_API size_t yaz0_compress_ex64(const void* input, size_t length, void* output, const yaz0_params_t* params)
+{
+    if (length > YAZ0_MAX_INPUT_SIZE)
+        return 0;
+
+    uint32_t htab[HASH_SIZE] = { 0 };
+    uint32_t chain[MAX_MATCH_DISTANCE];
+    return compress_params((const uint8_t*)input, (uint32_t)length, (uint8_t*)output, params, htab, chain, NULL);
+}
+
+FASTYZ_API size_t yaz0_compress_progress(const void* input, size_t length, void* output, const yaz0_params_t* params,
+                                         const yaz0_progress_t* progress)
+{
+    yaz0_params_t defaults;
+
+    if (length > YAZ0_MAX_INPUT_SIZE)
+        return 0;
+
+    if (!params)
+    {
+        yaz0_params_init(&defaults);
+        params = &defaults;
+    }
+    if (progress && !progress->callback)
+        progress = NULL;
+
+    uint32_t htab[HASH_SIZE] = { 0 };
+    uint32_t chain[MAX_MATCH_DISTANCE];
+    return compress_params((const uint8_t*)input, (uint32_t)length, (uint8_t*)output, params, htab, chain, progress);
+}
+
+/*
+ * Compression context: the match tables of compress_params(), kept off the
+ * stack and reused across calls.
+ */
+struct yaz0_cctx
+{
+    uint32_t htab[HASH_SIZE];
+    uint32_t chain[MAX_MATCH_DISTANCE];
+    yaz0_allocator_t allocator;  /* free == NULL for caller-provided workspaces */
+    yaz0_progress_t progress;    /* callback == NULL for no reporting */
+};
+
+/* Alignment of contexts placed in caller-provided workspaces */
+#define CCTX_ALIGN 64
+
+static void* default_alloc(void* user, size_t size)
+{
+    (void)user;
+    return malloc(size);
+}
+
+static void default_free(void* user, void* ptr)
+{
+    (void)user;
+    free(ptr);
+}
+
+/*
+ * Per-call buffers whose size depends on the input. The _cctx functions
+ * take them from the context's allocator (see cctx_allocator()); NULL
+ * stands for malloc()/free().
+ */
+static void* mem_alloc(const yaz0_allocator_t* allocator, size_t size)
+{
+    return allocator ? allocator->alloc(allocator->user, size) : malloc(size);
+}
+
+static void mem_free(const yaz0_allocator_t* allocator, void* ptr)
+{
+    if (!ptr)
+        return;
+    if (allocator)
+        allocator->free(allocator->user, ptr);
+    else
+        free(ptr);
+}
+
+/* Contexts in caller-provided workspaces have no allocator and use malloc() */
+static const yaz0_allocator_t* cctx_allocator(const yaz0_cctx_t* cctx)
+{
+    return cctx->allocator.free ? &cctx->allocator : NULL;
+}
+
+FASTYZ_API size_t yaz0_cctx_workspace_size(void)
+{
+    return sizeof(yaz0_cctx_t) + CCTX_ALIGN - 1;
+}
+
+FASTYZ_API yaz0_cctx_t* yaz0_cctx_create(const yaz0_allocator_t* allocator)
+{
+    yaz0_allocator_t a = { default_alloc, default_free, NULL };
+    if (allocator)
+        a = *allocator;
+    if (!a.alloc || !a.free)
+        return NULL;
+
+    yaz0_cctx_t* cctx = (yaz0_cctx_t*)a.alloc(a.user, sizeof(yaz0_cctx_t));
+    if (cctx)
+    {
+        cctx->allocator = a;
+        yaz0_cctx_set_progress(cctx, NULL);
+    }
+    return cctx;
+}
+
+FASTYZ_API yaz0_cctx_t* yaz0_cctx_init(void* workspace, size_t size)
+{
+    uintptr_t p = ((uintptr_t)workspace + CCTX_ALIGN - 1) & ~(uintptr_t)(CCTX_ALIGN - 1);
+
+    if (!workspace || size < yaz0_cctx_workspace_size())
+        return NULL;
+
+    yaz0_cctx_t* cctx = (yaz0_cctx_t*)p;
+    cctx->allocator.alloc = NULL;
+    cctx->allocator.free = NULL;
+    cctx->allocator.user = NULL;
+    yaz0_cctx_set_progress(cctx, NULL);
+    return cctx;
+}
+
+FASTYZ_API void yaz0_cctx_set_progress(yaz0_cctx_t* cctx, const yaz0_progress_t* progress)
+{
+    if (progress)
+    {
+        cctx->progress = *progress;
+    }
+    else
+    {
+        cctx->progress.callback = NULL;
+        cctx->progress.user = NULL;
+        cctx->progress.interval = 0;
+    }
+}
+
+FASTYZ_API void yaz0_cctx_free(yaz0_cctx_t* cctx)
+{
+    if (cctx && cctx->allocator.free)
+        cctx->allocator.free(cctx->allocator.user, cctx);
+}
+
+FASTYZ_API size_t yaz0_compress_cctx(yaz0_cctx_t* cctx, const void* input, size_t length, void* output,
+                                     const yaz0_params_t* params)
+{
+    yaz0_params_t defaults;
+
+    if (length > YAZ0_MAX_INPUT_SIZE)
+        return 0;
+
+    if (!params)
+    {
+        yaz0_params_init(&defaults);
+        params = &defaults;
+    }
+
+    memset(cctx->htab, 0, sizeof(cctx->htab));
+    return compress_params((const uint8_t*)input, (uint32_t)length, (uint8_t*)output, params, cctx->htab, cctx->chain,
+                           cctx->progress.callback ? &cctx->progress : NULL);
+}
+
+#if !defined(FASTYZ_NO_THREADS)
+
+typedef struct
+{
+    yaz0_ring_t* ring;
+    yaz0_writer_t* w;
+    const uint8_t* input;
+    double seconds;
+} yaz0_encoder_job_t;
+
+static void encoder_thread(void* arg)
+{
+    yaz0_encoder_job_t* job = (yaz0_encoder_job_t*)arg;
+    double start = time_now();
+
+    ring_drain(job->ring, job->w, job->input);
+
+    job->seconds = time_now() - start;
+}
+
+#endif /* !FASTYZ_NO_THREADS */
+
+FASTYZ_API int yaz0_compress_pipelined(const void* input, int length, void* output, const yaz0_params_t* params,
+                                       yaz0_pipeline_stats_t* stats)
+{
+    double start = time_now();
+    uint32_t align, phase;
+
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
+
+    if (!resolve_params(params, input, length, &align, &phase))
+        return 0;
+
+#if defined(FASTYZ_NO_THREADS)
+    int size = yaz0_compress_ex(input, length, output, params);
+
+    if (stats)
+    {
+        stats->total_seconds = time_now() - start;
+        stats->search_seconds = stats->total_seconds;
+    }
+
+    return size;
+#else
+    const uint8_t* ip = (const uint8_t*)input;
+    uint8_t* op = (uint8_t*)output;
+    write_header(op, (uint32_t)length);
+
+    yaz0_writer_t w;
+    w.op = op + YAZ0_HEADER_SIZE;
+    writer_new_group(&w);
+
+    yaz0_token_t tokens[RING_SIZE];
+    yaz0_ring_t ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.tokens = tokens;
+
+    /* The calling thread searches for matches; a second thread encodes */
+    yaz0_encoder_job_t job = { &ring, &w, ip, 0.0 };
+    yaz0_thread_start_t thread_start = { encoder_thread, &job };
+    yaz0_thread_t thread;
+
+    if (!thread_create(&thread, &thread_start))
+        return yaz0_compress_ex(input, length, output, params);
+
+    yaz0_decode_policy_t policy;
+    yaz0_decode_policy_t* pp = NULL;
+    if (params->decode_speed)
+    {
+        decode_policy_init(&policy, params->decode_speed);
+        pp = &policy;
+    }
+
+    uint32_t htab[HASH_SIZE] = { 0 };
+    uint32_t chain[MAX_MATCH_DISTANCE];
+    yaz0_window_t win = { ip, 0, ip + length };
+    yaz0_search_t search;
+    search_init(&search, align, phase, params->level, chain, pp);
+
+    double search_start = time_now();
+    if (params->strategy == YAZ0_STRATEGY_ADAPTIVE)
+        compress_adaptive(NULL, &ring, htab, &win, &search, NULL, NULL);
+    else
+        compress_select(NULL, &ring, htab, &win, ip, win.limit, &search);
+    ring_finish(&ring);
+    double search_seconds = time_now() - search_start;
+
+    thread_join(thread);
+
+    if (stats)
+    {
+        stats->total_seconds = time_now() - start;
+        stats->search_seconds = search_seconds - ring.push_wait;
+        stats->encode_seconds = job.seconds - ring.pop_wait;
+        stats->search_wait_seconds = ring.push_wait;
+        stats->encode_wait_seconds = ring.pop_wait;
+        stats->tokens = ring.head;
+        stats->search_stalls = ring.push_stalls;
+        stats->encode_stalls = ring.pop_stalls;
+    }
+
+    return (int)(w.op - op);
+#endif
+}
+
+/* Bytes compressed between throughput measurements */
+#define BUDGET_CHUNK 16384
+
+/*
+ * Effort steps of budgeted compression: a sparse probe of every 16th
+ * position, the fast search, then chain levels 1-9.
+ */
+#define BUDGET_EFFORTS 11
+
+FASTYZ_API int yaz0_compress_budget(const void* input, int length, void* output, const yaz0_params_t* params, double seconds)
+{
+    const double deadline = time_now() + seconds;
+    const uint8_t* ip = (const uint8_t*)input;
+    uint32_t align, phase;
+
+    if (!resolve_params(params, input, 0, &align, &phase))
+        return 0;
+
+    uint8_t* op = (uint8_t*)output;
+    write_header(op, (uint32_t)length);
+
+    yaz0_writer_t w;
+    w.op = op + YAZ0_HEADER_SIZE;
+    writer_new_group(&w);
+
+    yaz0_decode_policy_t policy;
+    yaz0_decode_policy_t* pp = NULL;
+    if (params->decode_speed)
+    {
+        decode_policy_init(&policy, params->decode_speed);
+        pp = &policy;
+    }
+
+    uint32_t htab[HASH_SIZE] = { 0 };
+    uint32_t chain[MAX_MATCH_DISTANCE];
+    yaz0_window_t win = { ip, 0, ip + length };
+
+    /* Measured seconds per input byte of each effort step; 0 = not yet run */
+    double cost[BUDGET_EFFORTS] = { 0 };
+    int effort = 1;
+    bool chained = false;
+
+    while (ip < win.limit)
+    {
+        double now = time_now();
+        double left = deadline - now;
+
+        /* Out of time: store the rest, which always finishes */
+        if (left <= 0)
+        {
+            emit_literals(&w, NULL, ip, (uint32_t)(win.limit - ip));
+            break;
+        }
+
+        /*
+         * Drop effort while the measured cost would miss the deadline, and
+         * raise it once the current step has been measured with twice the
+         * time needed to spare, unless the next step is known to be too slow.
+         */
+        double allowed = left / (double)(win.limit - ip);
+        while (effort > 0 && cost[effort] > allowed)
+            --effort;
+        if (effort + 1 < BUDGET_EFFORTS && cost[effort] > 0 && cost[effort] * 2 < allowed &&
+            cost[effort + 1] < allowed)
+            ++effort;
+
+        yaz0_search_t s;
+        search_init(&s, effort ? 1 : MAX_ALIGNMENT, 0, effort > 1 ? effort - 1 : 0, chain, pp);
+
+        if (s.depth && !chained)
+            chain_rebuild(htab, &win, ip, &s);
+        chained = s.depth != 0;
+
+        const uint8_t* ip_end = win.limit - ip > BUDGET_CHUNK ? ip + BUDGET_CHUNK : win.limit;
+        const uint8_t* stop = compress_range(&w, htab, &win, ip, ip_end, &s);
+
+        /*
+         * A change in cost is mostly a change in the data, which affects all
+         * steps alike: rescale the earlier measurements of the other steps.
+         */
+        double measured = (time_now() - now) / (double)(stop - ip);
+        if (cost[effort] > 0)
+        {
+            double scale = measured / cost[effort];
+            for (int i = 0; i < BUDGET_EFFORTS; ++i)
+                cost[i] *= scale;
+        }
+        cost[effort] = measured;
+        ip = stop;
+    }
+
+    return (int)(w.op - op);
+}
+
+/* Input bytes compressed between size checks of yaz0_compress_fit() */
+#define FIT_CHUNK 65536
+
+/* Windows sampled by yaz0_compress_fit() to estimate the size at each level */
+#define FIT_SAMPLES 4
+
+/* Bytes per sampled window of the size estimators */
+#define SAMPLE_SIZE 8192
+
+/*
+ * Compress with one search setting into 'op', giving up as soon as the
+ * output exceeds 'target' bytes. Returns the output size and sets
+ * '*consumed' to the input bytes it covers (less than 'length' if the
+ * attempt was abandoned). 'op' must hold FASTYZ_BOUND(length) bytes.
+ */
+static uint32_t compress_bounded(const uint8_t* ip, uint32_t length, uint8_t* op, uint32_t target, uint32_t* htab,
+                                 const yaz0_search_t* s, uint32_t* consumed)
+{
+    write_header(op, length);
+
+    yaz0_writer_t w;
+    w.op = op + YAZ0_HEADER_SIZE;
+    writer_new_group(&w);
+
+    memset(htab, 0, HASH_SIZE * sizeof(uint32_t));
+    yaz0_window_t win = { ip, 0, ip + length };
+
+    while (ip < win.limit && (uint32_t)(w.op - op) <= target)
+    {
+        const uint8_t* ip_end = win.limit - ip > FIT_CHUNK ? ip + FIT_CHUNK : win.limit;
+        ip = compress_range(&w, htab, &win, ip, ip_end, s);
+    }
+
+    *consumed = (uint32_t)(ip - win.base);
+    return (uint32_t)(w.op - op);
+}
+
+/*
+ * Compressed size of SAMPLE_SIZE bytes at 'p' with the search 's', with
+ * the MAX_MATCH_DISTANCE bytes before them as history. 'scratch' must hold
+ * FASTYZ_BOUND(SAMPLE_SIZE) bytes.
+ */
+static uint32_t estimate_sample(const uint8_t* p, uint8_t* scratch, uint32_t* htab, const yaz0_search_t* s)
+{
+    yaz0_writer_t w;
+    w.op = scratch;
+    writer_new_group(&w);
+
+    memset(htab, 0, HASH_SIZE * sizeof(uint32_t));
+    yaz0_window_t win = { p - MAX_MATCH_DISTANCE, 0, p + SAMPLE_SIZE };
+
+    compress_prime(htab, &win, win.base, p, s);
+    compress_range(&w, htab, &win, p, win.limit, s);
+
+    return (uint32_t)(w.op - scratch);
+}
+
+/*
+ * Compressed sizes (without header) of 'count' windows spread evenly over
+ * an input of at least MAX_MATCH_DISTANCE + SAMPLE_SIZE bytes. Window
+ * offsets are multiples of MAX_ALIGNMENT, so aligned searches keep their
+ * probe phase.
+ */
+static void sample_sizes(const uint8_t* ip, uint32_t length, uint32_t count, const yaz0_search_t* s,
+                         uint32_t* htab, uint8_t* scratch, uint32_t* sizes)
+{
+    uint32_t stride = (length - MAX_MATCH_DISTANCE - SAMPLE_SIZE) / count;
+
+    for (uint32_t n = 0; n < count; ++n)
+    {
+        uint32_t off = MAX_MATCH_DISTANCE + ((n * stride) & ~(uint32_t)(MAX_ALIGNMENT - 1));
+        sizes[n] = estimate_sample(ip + off, scratch, htab, s);
+    }
+}
+
+FASTYZ_API int yaz0_compress_fit(const void* input, int length, void* output, int target, const yaz0_params_t* params,
+                                 int* level)
+{
+    const uint8_t* ip = (const uint8_t*)input;
+    uint8_t* op = (uint8_t*)output;
+    uint32_t align, phase;
+
+    if (level)
+        *level = -1;
+    if (length < 0 || target < YAZ0_HEADER_SIZE || params->level < 0 || params->level > 9)
+        return 0;
+
+    /* Resolve the level 0 alignment once; higher levels search every position */
+    yaz0_params_t fast = *params;
+    fast.level = 0;
+    if (!resolve_params(&fast, input, length, &align, &phase))
+        return 0;
+
+    /* Reset before every sampling pass and attempt */
+    yaz0_decode_policy_t policy;
+    yaz0_decode_policy_t* pp = params->decode_speed ? &policy : NULL;
+
+    uint32_t htab[HASH_SIZE];
+    uint32_t chain[MAX_MATCH_DISTANCE];
+    yaz0_search_t s;
+    const uint64_t slack = (uint64_t)target / 16;
+
+    /*
+     * For larger inputs, estimate the size at every level from a few
+     * sampled windows, and fail at once if even level 9 is clearly too
+     * large.
+     */
+    double estimate[10] = { 0 };
+    bool estimated = (uint32_t)length >= FIT_SAMPLES * (MAX_MATCH_DISTANCE + SAMPLE_SIZE) * 4;
+
+    if (estimated)
+    {
+        uint8_t scratch[FASTYZ_BOUND(SAMPLE_SIZE)];
+
+        for (int l = params->level; l <= 9; ++l)
+        {
+            uint32_t sizes[FIT_SAMPLES];
+            uint32_t sampled = 0;
+
+            if (pp)
+                decode_policy_init(pp, params->decode_speed);
+            search_init(&s, l ? 1 : align, l ? 0 : phase, l, chain, pp);
+            sample_sizes(ip, (uint32_t)length, FIT_SAMPLES, &s, htab, scratch, sizes);
+            for (uint32_t n = 0; n < FIT_SAMPLES; ++n)
+                sampled += sizes[n];
+            estimate[l] = (double)sampled * (double)length / (FIT_SAMPLES * SAMPLE_SIZE);
+        }
+
+        if (estimate[9] > (double)(target + 2 * slack))
+            return 0;
+    }
+
+    /*
+     * Escalate from the requested level. Once the first attempt has
+     * calibrated the estimates against the real size, skip levels that are
+     * not expected to fit or to improve on the level that just failed; level
+     * 9 is still tried unless it is not expected to fit either.
+     */
+    double scale = 1.0;
+
+    for (int l = params->level; l <= 9; )
+    {
+        uint32_t consumed;
+
+        /* Each attempt starts with a fresh match budget, as yaz0_compress_ex() does */
+        if (pp)
+            decode_policy_init(pp, params->decode_speed);
+        search_init(&s, l ? 1 : align, l ? 0 : phase, l, chain, pp);
+        uint32_t size = compress_bounded(ip, (uint32_t)length, op, (uint32_t)target, htab, &s, &consumed);
+
+        if (size <= (uint32_t)target)
+        {
+            if (level)
+                *level = l;
+            return (int)size;
+        }
+
+        if (!estimated)
+        {
+            ++l;
+            continue;
+        }
+
+        /* Project the full size of an abandoned attempt from the part done */
+        if (l == params->level && consumed)
+            scale = (double)size * (double)length / (double)consumed / estimate[l];
+
+        int next = l + 1;
+        while (next < 9 && (estimate[next] * scale > (double)(target + slack) || estimate[next] >= estimate[l]))
+            ++next;
+        if (next == 9 && estimate[9] * scale > (double)(target + slack))
+            break;
+        l = next;
+    }
+
+    return 0;
+}
+
+/* Sampled windows of yaz0_estimate_size(): about 1/32 of the input, within these limits */
+#define ESTIMATE_MIN_SAMPLES 8
+#define ESTIMATE_MAX_SAMPLES 64
+
+/* Allowance per window for tokens cut at its edges, in compressed bytes */
+#define ESTIMATE_EDGE 32
+
+/*
+ * Square root by Newton iteration (avoids a libm dependency).
+ */
+static double square_root(double x)
+{
+    if (x <= 0)
+        return 0;
+
+    double r = x > 1 ? x : 1;
+    for (int i = 0; i < 64; ++i)
+    {
+        double next = 0.5 * (r + x / r);
+        if (next >= r)
+            break;
+        r = next;
+    }
+    return r;
+}
+
+/*
+ * Exact compressed size of a whole input (including the header), counted
+ * through the 'scratch' buffer one chunk at a time. 'scratch' must hold
+ * COUNT_SCRATCH bytes: a chunk's worst case after the open flag group.
+ */
+#define COUNT_SCRATCH (DESTSIZE_WORST + 32)
+
+static uint32_t compress_count(const uint8_t* ip, uint32_t length, const yaz0_search_t* s, uint32_t* htab,
+                               uint8_t* scratch)
+{
+    yaz0_writer_t w;
+    w.op = scratch;
+    writer_new_group(&w);
+
+    memset(htab, 0, HASH_SIZE * sizeof(uint32_t));
+    yaz0_window_t win = { ip, 0, ip + length };
+    uint32_t size = YAZ0_HEADER_SIZE;
+
+    while (ip < win.limit)
+    {
+        ip = compress_chunk(&w, htab, &win, ip, s);
+
+        /* Count the complete flag groups and keep the open one */
+        uint32_t ready = (uint32_t)(w.flagp - scratch);
+        size += ready;
+        memmove(scratch, w.flagp, (size_t)(w.op - w.flagp));
+        w.op -= ready;
+        w.flagp = scratch;
+    }
+
+    return size + (uint32_t)(w.op - scratch);
+}
+
+FASTYZ_API int yaz0_estimate_size(const void* input, int length, int level, yaz0_estimate_t* estimate)
+{
+    const uint8_t* ip = (const uint8_t*)input;
+    yaz0_estimate_t e;
+
+    if (length < 0 || level < 0 || level > 9)
+        return 0;
+
+    /* Also large enough for sample_sizes(), which needs FASTYZ_BOUND(SAMPLE_SIZE) */
+    uint8_t scratch[COUNT_SCRATCH];
+    uint32_t htab[HASH_SIZE];
+    uint32_t chain[MAX_MATCH_DISTANCE];
+    yaz0_search_t s;
+    search_init(&s, 1, 0, level, chain, NULL);
+
+    uint32_t count = (uint32_t)length / (SAMPLE_SIZE * 32);
+    if (count < ESTIMATE_MIN_SAMPLES)
+        count = ESTIMATE_MIN_SAMPLES;
+    if (count > ESTIMATE_MAX_SAMPLES)
+        count = ESTIMATE_MAX_SAMPLES;
+
+    if ((uint64_t)count * (MAX_MATCH_DISTANCE + SAMPLE_SIZE) * 2 > (uint64_t)length)
+    {
+        /* Sampling would not be much cheaper than compressing: be exact */
+        e.size = (int)compress_count(ip, (uint32_t)length, &s, htab, scratch);
+        e.low = e.size;
+        e.high = e.size;
+    }
+    else
+    {
+        uint32_t sizes[ESTIMATE_MAX_SAMPLES];
+        sample_sizes(ip, (uint32_t)length, count, &s, htab, scratch, sizes);
+
+        /* Mean and variance of the per-window ratio */
+        double sum = 0, sum_sq = 0;
+        for (uint32_t n = 0; n < count; ++n)
+        {
+            double ratio = (double)sizes[n] / SAMPLE_SIZE;
+            sum += ratio;
+            sum_sq += ratio * ratio;
+        }
+        double mean = sum / count;
+        double variance = (sum_sq - sum * mean) / (count - 1);
+
+        /*
+         * Two standard errors of the mean ratio, with the finite population
+         * correction for the share of the input that was sampled, plus the
+         * edge allowance: windows cut matches and runs that the whole input
+         * would encode as one token.
+         */
+        double sampled = (double)count * SAMPLE_SIZE / (double)length;
+        double margin = 2 * square_root(variance / count * (1 - sampled)) + (double)ESTIMATE_EDGE / SAMPLE_SIZE;
+        double bound = (double)FASTYZ_BOUND((uint32_t)length);
+
+        double size = YAZ0_HEADER_SIZE + mean * length;
+        double low = YAZ0_HEADER_SIZE + (mean - margin) * length;
+        double high = YAZ0_HEADER_SIZE + (mean + margin) * length;
+
+        e.size = (int)(size < bound ? size : bound);
+        e.low = (int)(low > YAZ0_HEADER_SIZE ? low : YAZ0_HEADER_SIZE);
+        e.high = (int)(high < bound ? high : bound);
+    }
+
+    /* Saving less than 1/32 of the input is not worth a compressed copy */
+    e.incompressible = e.size >= length - length / 32;
+
+    if (estimate)
+        *estimate = e;
+    return e.size;
+}
+
+FASTYZ_API int yaz0_compress_dict(const void* input, int length, void* output, const void* dict, int dict_size)
+{
+    uint8_t* op = (uint8_t*)output;
+
+    /* Only the last MAX_MATCH_DISTANCE bytes of a dictionary are reachable */
+    if (dict_size > MAX_MATCH_DISTANCE)
+    {
+        dict = (const uint8_t*)dict + dict_size - MAX_MATCH_DISTANCE;
+        dict_size = MAX_MATCH_DISTANCE;
+    }
+    if (dict_size < 0)
+        return 0;
+
+    write_header(op, (uint32_t)length);
+
+    yaz0_writer_t w;
+    w.op = op + YAZ0_HEADER_SIZE;
+    writer_new_group(&w);
+
+    uint32_t htab[HASH_SIZE] = { 0 };
+    yaz0_segment_t segs[2] = {
+        { (const uint8_t*)dict, (uint32_t)dict_size },
+        { (const uint8_t*)input, (uint32_t)length }
+    };
+
+    yaz0_search_t search;
+    search_init(&search, 1, 0, 0, NULL, NULL);
+
+    compress_segments(&w, htab, segs, 2, (uint32_t)dict_size, &search);
+
+    return (int)(w.op - op);
+}
+
+/*
+ * yaz0_compressv() with a zeroed match table and the allocator of the
+ * segment list.
+ */
+static int compressv_with(const yaz0_allocator_t* allocator, uint32_t* htab, const struct iovec* iov, int iovcnt,
+                          void* output)
+{
+    uint8_t* op = (uint8_t*)output;
+    size_t total = 0;
+
+    if (iovcnt < 0)
+        return 0;
+
+    for (int i = 0; i < iovcnt; ++i)
+    {
+        total += iov[i].iov_len;
+        if (iov[i].iov_len > INT32_MAX || total > INT32_MAX)
+            return 0;
+    }
+
+    yaz0_segment_t* segs = (yaz0_segment_t*)mem_alloc(allocator, (size_t)(iovcnt ? iovcnt : 1) * sizeof(yaz0_segment_t));
+    if (!segs)
+        return 0;
+
+    for (int i = 0; i < iovcnt; ++i)
+    {
+        segs[i].data = (const uint8_t*)iov[i].iov_base;
+        segs[i].size = (uint32_t)iov[i].iov_len;
+    }
+
+    write_header(op, (uint32_t)total);
+
+    yaz0_writer_t w;
+    w.op = op + YAZ0_HEADER_SIZE;
+    writer_new_group(&w);
+
+    yaz0_search_t search;
+    search_init(&search, 1, 0, 0, NULL, NULL);
+
+    compress_segments(&w, htab, segs, iovcnt, 0, &search);
+
+    mem_free(allocator, segs);
+    return (int)(w.op - op);
+}
+
+FASTYZ_API int yaz0_compressv(const struct iovec* iov, int iovcnt, void* output)
+{
+    uint32_t htab[HASH_SIZE] = { 0 };
+    return compressv_with(NULL, htab, iov, iovcnt, output);
+}
+
+FASTYZ_API int yaz0_compressv_cctx(yaz0_cctx_t* cctx, const struct iovec* iov, int iovcnt, void* output)
+{
+    memset(cctx->htab, 0, sizeof(cctx->htab));
+    return compressv_with(cctx_allocator(cctx), cctx->htab, iov, iovcnt, output);
+}
+
+FASTYZ_API int yaz0_detect_alignment(const void* input, int length, int* phase)
+{
+    /* Sample up to 8 windows of 4 KiB spread evenly over the input */
+    enum { WINDOW = 4096, NUM_WINDOWS = 8 };
+
+    const uint8_t* ip = (const uint8_t*)input;
+    uint32_t score[MAX_ALIGNMENT + 1] = { 0 };
+    uint32_t samples = 0;
+
+    if (phase)
+        *phase = 0;
+
+    if (length < 4 * MAX_ALIGNMENT)
+        return 1;
+
+    uint32_t window = (uint32_t)length < WINDOW ? (uint32_t)length : WINDOW;
+    uint32_t stride = ((uint32_t)length - window) / NUM_WINDOWS;
+    uint32_t num_windows = stride ? NUM_WINDOWS : 1;
+
+    for (uint32_t n = 0; n < num_windows; ++n)
+    {
+        const uint8_t* p = ip + n * stride;
+
+        /* Autocorrelation: count bytes equal to the byte 'lag' positions back */
+        for (uint32_t i = MAX_ALIGNMENT; i < window; ++i)
+        {
+            score[1]  += p[i] == p[i - 1];
+            score[2]  += p[i] == p[i - 2];
+            score[4]  += p[i] == p[i - 4];
+            score[8]  += p[i] == p[i - 8];
+            score[16] += p[i] == p[i - 16];
+        }
+        samples += window - MAX_ALIGNMENT;
+    }
+
+    uint32_t best = 2;
+    for (uint32_t lag = 4; lag <= MAX_ALIGNMENT; lag <<= 1)
+    {
+        if (score[lag] > score[best])
+            best = lag;
+    }
+
+    /*
+     * Record structure shows up as a correlation peak that is clearly above
+     * both the byte-level (lag 1) correlation and the noise floor.
+     */
+    if (score[best] < samples / 8 || (uint64_t)score[best] * 4 < (uint64_t)score[1] * 5)
+        return 1;
+
+    /* Prefer the smallest stride that captures most of the peak */
+    uint32_t align = best;
+    for (uint32_t lag = 2; lag < best; lag <<= 1)
+    {
+        if ((uint64_t)score[lag] * 10 >= (uint64_t)score[best] * 9)
+        {
+            align = lag;
+            break;
+        }
+    }
+
+    if (!phase)
+        return (int)align;
+
+    /*
+     * Pick the record offset where matches pay off most: run a trial aligned
+     * match search for every phase over the sampled windows and keep the one
+     * with the largest estimated saving (matched bytes minus token cost).
+     */
+    uint32_t best_saving = 0;
+    for (uint32_t r = 0; r < align; ++r)
+    {
+        uint32_t saving = 0;
+
+        for (uint32_t n = 0; n < num_windows; ++n)
+        {
+            const uint8_t* p = ip + n * stride;
+            uint16_t table[1 << 12] = { 0 };
+            uint32_t anchor = 0;
+
+            /* compare_match() reads 4 bytes past SHORT_FORM_MIN before checking its limit */
+            for (uint32_t i = r ? r : align; i + SHORT_FORM_MIN + 4 <= window; )
+            {
+                uint32_t seq = read_u32(p + i) & 0xffffff;
+                uint32_t hash = compute_hash(seq) >> (HASH_LOG - 12);
+                uint32_t ref = table[hash];
+                table[hash] = (uint16_t)i;
+
+                if (ref < i && (read_u32(p + ref) & 0xffffff) == seq)
+                {
+                    uint32_t start = i;
+                    while (start > anchor && ref > 0 && p[start - 1] == p[ref - 1])
+                    {
+                        --start;
+                        --ref;
+                    }
+
+                    uint32_t len = compare_match(p + ref + SHORT_FORM_MIN, p + start + SHORT_FORM_MIN, p + window) + SHORT_FORM_MIN;
+                    saving += len - (SHORT_FORM_MIN - 1);
+                    anchor = start + len;
+                    i = r + ((anchor - r + align - 1) & ~(align - 1));
+                }
+                else
+                {
+                    i += align;
+                }
+            }
+        }
+
+        if (saving > best_saving)
+        {
+            best_saving = saving;
+            *phase = (int)r;
+        }
+    }
+
+    return (int)align;
+}
+
+/* ========================================================================
+ * Dictionary Training
+ * ======================================================================== */
+
+/* Length of the substrings (d-mers) whose frequency is counted */
+#define TRAIN_DMER 6
+
+/* Frequency table size (2^TRAIN_HASH_LOG entries) */
+#define TRAIN_HASH_LOG 20
+
+static uint32_t train_hash(const uint8_t* p)
+{
+    uint64_t v = (uint64_t)read_u32(p) | ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40);
+    return (uint32_t)((v * 0x9E3779B97F4A7C15ULL) >> (64 - TRAIN_HASH_LOG));
+}
+
+/*
+ * Build a dictionary from segments of 'segment_size' bytes.
+ *
+ * The samples are split into one epoch per dictionary segment. In each
+ * epoch the segment whose d-mers occur in the most samples is selected,
+ * then the frequencies of its d-mers are cleared so later segments cover
+ * different content. The best segments are placed last, closest to the
+ * data, where they stay within match distance the longest.
+ */
+static int train_segments(uint8_t* dict, int dict_capacity, const uint8_t* samples, uint32_t total,
+                          uint32_t* freq, uint32_t segment_size)
+{
+    typedef struct { uint32_t pos; uint32_t score; } candidate_t;
+
+    uint32_t num_segments = (uint32_t)dict_capacity / segment_size;
+    candidate_t chosen[MAX_MATCH_DISTANCE / 16];
+    uint32_t num_chosen = 0;
+
+    if (num_segments == 0 || total < segment_size)
+        return 0;
+
+    uint32_t epoch_size = total / num_segments;
+    if (epoch_size < segment_size)
+        epoch_size = segment_size;
+
+    for (uint32_t epoch = 0; epoch + segment_size <= total && num_chosen < num_segments; epoch += epoch_size)
+    {
+        uint32_t end = epoch + epoch_size < total ? epoch + epoch_size : total;
+        uint32_t dmers = segment_size - TRAIN_DMER + 1;
+        candidate_t best = { 0, 0 };
+        uint32_t score = 0;
+
+        if (end - epoch < segment_size)
+            break;
+
+        /* Slide a segment over the epoch, keeping a running score */
+        for (uint32_t i = epoch; i + TRAIN_DMER <= end; ++i)
+        {
+            score += freq[train_hash(samples + i)];
+            if (i >= epoch + dmers)
+                score -= freq[train_hash(samples + i - dmers)];
+
+            if (i + 1 >= epoch + dmers && score > best.score)
+            {
+                best.pos = i + 1 - dmers;
+                best.score = score;
+            }
+        }
+
+        if (best.score == 0)
+            continue;
+
+        for (uint32_t i = 0; i < dmers; ++i)
+            freq[train_hash(samples + best.pos + i)] = 0;
+
+        chosen[num_chosen++] = best;
+    }
+
+    /* Order by ascending score so the best segments end up last */
+    for (uint32_t i = 1; i < num_chosen; ++i)
+    {
+        candidate_t c = chosen[i];
+        uint32_t j = i;
+        for (; j > 0 && chosen[j - 1].score > c.score; --j)
+            chosen[j] = chosen[j - 1];
+        chosen[j] = c;
+    }
+
+    for (uint32_t i = 0; i < num_chosen; ++i)
+        memcpy(dict + i * segment_size, samples + chosen[i].pos, segment_size);
+
+    return (int)(num_chosen * segment_size);
+}
+
+static int train_dict_with(const yaz0_allocator_t* allocator, void* dict, int dict_capacity, const void* samples,
+                           const int* sample_sizes, int num_samples)
+{
+    /* Segment sizes tried; the one that compresses the samples best wins */
+    static const uint32_t segment_sizes[] = { 16, 32, 64, 128, 256 };
+
+    const uint8_t* data = (const uint8_t*)samples;
+    uint32_t total = 0;
+    uint32_t max_sample = 0;
+    int best_size = 0;
+
+    if (dict_capacity > MAX_MATCH_DISTANCE)
+        dict_capacity = MAX_MATCH_DISTANCE;
+    if (dict_capacity <= 0 || num_samples <= 0)
+        return 0;
+
+    for (int i = 0; i < num_samples; ++i)
+    {
+        if (sample_sizes[i] < 0)
+            return 0;
+        total += (uint32_t)sample_sizes[i];
+        if ((uint32_t)sample_sizes[i] > max_sample)
+            max_sample = (uint32_t)sample_sizes[i];
+    }
+
+    uint32_t* counts = (uint32_t*)mem_alloc(allocator, sizeof(uint32_t) << TRAIN_HASH_LOG);
+    uint32_t* last_sample = (uint32_t*)mem_alloc(allocator, sizeof(uint32_t) << TRAIN_HASH_LOG);
+    uint32_t* freq = (uint32_t*)mem_alloc(allocator, sizeof(uint32_t) << TRAIN_HASH_LOG);
+    uint8_t* candidate = (uint8_t*)mem_alloc(allocator, MAX_MATCH_DISTANCE);
+    uint8_t* scratch = (uint8_t*)mem_alloc(allocator, FASTYZ_BOUND(max_sample));
+    uint64_t best_total = UINT64_MAX;
+
+    if (!counts || !last_sample || !freq || !candidate || !scratch)
+        goto cleanup;
+
+    /* Count, for every d-mer, the number of samples that contain it */
+    memset(counts, 0, sizeof(uint32_t) << TRAIN_HASH_LOG);
+    memset(last_sample, 0, sizeof(uint32_t) << TRAIN_HASH_LOG);
+    const uint8_t* p = data;
+    for (int i = 0; i < num_samples; ++i)
+    {
+        for (int j = 0; j + TRAIN_DMER <= sample_sizes[i]; ++j)
+        {
+            uint32_t h = train_hash(p + j);
+            if (last_sample[h] != (uint32_t)i + 1)
+            {
+                last_sample[h] = (uint32_t)i + 1;
+                ++counts[h];
+            }
+        }
+        p += sample_sizes[i];
+    }
+
+    /* D-mers that occur in a single sample gain nothing from a dictionary */
+    for (uint32_t h = 0; h < (1u << TRAIN_HASH_LOG); ++h)
+    {
+        if (counts[h] < 2)
+            counts[h] = 0;
+    }
+
+    for (size_t k = 0; k < sizeof(segment_sizes) / sizeof(segment_sizes[0]); ++k)
+    {
+        memcpy(freq, counts, sizeof(uint32_t) << TRAIN_HASH_LOG);
+        int size = train_segments(candidate, dict_capacity, data, total, freq, segment_sizes[k]);
+        if (size == 0)
+            continue;
+
+        /* Measure the candidate on the samples themselves */
+        uint64_t compressed = 0;
+        p = data;
+        for (int i = 0; i < num_samples; ++i)
+        {
+            compressed += (uint64_t)yaz0_compress_dict(p, sample_sizes[i], scratch, candidate, size);
+            p += sample_sizes[i];
+        }
+
+        if (compressed < best_total)
+        {
+            best_total = compressed;
+            best_size = size;
+            memcpy(dict, candidate, (size_t)size);
+        }
+    }
+
+cleanup:
+    mem_free(allocator, counts);
+    mem_free(allocator, last_sample);
+    mem_free(allocator, freq);
+    mem_free(allocator, candidate);
+    mem_free(allocator, scratch);
+    return best_size;
+}
+
+FASTYZ_API int yaz0_train_dict(void* dict, int dict_capacity, const void* samples, const int* sample_sizes, int num_samples)
+{
+    return train_dict_with(NULL, dict, dict_capacity, samples, sample_sizes, num_samples);
+}
+
+FASTYZ_API int yaz0_train_dict_cctx(yaz0_cctx_t* cctx, void* dict, int dict_capacity, const void* samples,
+                                    const int* sample_sizes, int num_samples)
+{
+    return train_dict_with(cctx_allocator(cctx), dict, dict_capacity, samples, sample_sizes, num_samples);
+}
+
+/* ========================================================================
+ * Public API: Decompression
+ * ======================================================================== */
+
+/*
+ * Decompression loop. 'hist' optionally points to 'hist_size' bytes that
+ * logically precede the output (a preset dictionary); back-references that
+ * reach before the start of the output are resolved from it. 'progress' is
+ * checked at flag bytes; callers without one pass a constant NULL, which
+ * compiles the checks out.
+ */
+static YAZ0_FORCE_INLINE size_t decompress_core(const void* input, size_t length, void* output, size_t maxout,
+                                                const uint8_t* hist, uint32_t hist_size, const yaz0_progress_t* progress)
+{
+    /* Validate header magic */
+    if (length < YAZ0_HEADER_SIZE)
+        return 0;
+
+    /* Read decompressed size */
+    uint32_t decompressed_size = yaz0_get_decompressed_size(input);
+    if (decompressed_size == 0)
+        return 0;
+
+    /* Check output buffer is large enough */
+    if (decompressed_size > maxout)
+        return 0;
+
+    const uint8_t* src = (const uint8_t*)input;
+    const uint8_t* src_end = src + length;
+    uint8_t* dst = (uint8_t*)output;
+    uint8_t* dst_end = dst + maxout;
+
+    /* Skip header */
+    src += YAZ0_HEADER_SIZE;
+
+    yaz0_reporter_t reporter;
+    if (progress)
+        reporter_init(&reporter, progress);
+
+    /* Decompression loop */
+    uint8_t flag = 0;
+    int bits_remaining = 0;
+
+    while (dst < (uint8_t*)output + decompressed_size)
+    {
+        /* Read new flag byte when all bits are consumed */
+        if (bits_remaining == 0)
+        {
+            if (progress && !reporter_update(&reporter, (size_t)(dst - (uint8_t*)output), (size_t)(src - (const uint8_t*)input),
+                                             (size_t)(dst - (uint8_t*)output), false))
+                return 0;
+            if (src >= src_end)
+                return 0;
+            flag = *src++;
+            bits_remaining = 8;
+        }
+
+        if (flag & 0x80)
+        {
+            /* Flag bit = 1: literal byte */
+            if (src >= src_end || dst >= dst_end)
+                return 0;
+            *dst++ = *src++;
+        }
+        else
+        {
+            /* Flag bit = 0: match reference */
+            if (src + 2 > src_end)
+                return 0;
+
+            uint8_t byte1 = *src++;
+            uint8_t byte2 = *src++;
+
+            /* Extract distance (always present in first 2 bytes) */
+            uint32_t distance = ((byte1 & 0x0F) << 8) | byte2;
+            distance++;  /* Stored as distance-1 */
+
+            uint32_t len = byte1 >> 4;
+            if (len == 0)
+            {
+                /* Long form: length in third byte */
+                if (src >= src_end)
+                    return 0;
+                len = *src++;
+                len += LONG_FORM_MIN;
+            }
+            else
+            {
+                /* Short form: length in high nibble */
+                len += (SHORT_FORM_MIN - 1);
+            }
+
+            /* Validate back-reference */
+            if (dst + len > dst_end)
+                return 0;
+            if (YAZ0_UNLIKELY(distance > (uint32_t)(dst - (uint8_t*)output)))
+            {
+                uint32_t back = distance - (uint32_t)(dst - (uint8_t*)output);
+                if (!hist || back > hist_size)
+                    return 0;
+
+                /* Copy the part that lies in the dictionary */
+                const uint8_t* ref = hist + hist_size - back;
+                uint32_t n = back < len ? back : len;
+                for (uint32_t i = 0; i < n; ++i)
+                    *dst++ = *ref++;
+
+                /* The rest continues at the start of the output */
+                ref = (uint8_t*)output;
+                for (uint32_t i = n; i < len; ++i)
+                    *dst++ = *ref++;
+
+                flag <<= 1;
+                bits_remaining--;
+                continue;
+            }
+
+            /* Copy from back-reference (byte-by-byte for overlapping copies) */
+            const uint8_t* ref = dst - distance;
+            if (distance >= len)
+            {
+                memcpy(dst, ref, len);
+                dst += len;
+            }
+            else
+            {
+                for (uint32_t i = 0; i < len; ++i)
+                    *dst++ = *ref++;
+            }
+        }
+
+        flag <<= 1;
+        bits_remaining--;
+    }
+
+    if (progress && !reporter_update(&reporter, (size_t)(dst - (uint8_t*)output), (size_t)(src - (const uint8_t*)input),
+                                     (size_t)(dst - (uint8_t*)output), true))
+        return 0;
+
+    return (size_t)(dst - (uint8_t*)output);
+}
+
+FASTYZ_API int yaz0_decompress(const void* input, int length, void* output, int maxout)
+{
+    if (length < 0 || maxout < 0)
+        return 0;
+
+    return (int)decompress_core(input, (size_t)length, output, (size_t)maxout, NULL, 0, NULL);
+}
+
+FASTYZ_API size_t yaz0_decompress64(const void* input, size_t length, void* output, size_t maxout)
+{
+    return decompress_core(input, length, output, maxout, NULL, 0, NULL);
+}
+
+FASTYZ_API size_t yaz0_decompress_progress(const void* input, size_t length, void* output, size_t maxout,
+                                           const yaz0_progress_t* progress)
+{
+    if (!progress || !progress->callback)
+        return yaz0_decompress64(input, length, output, maxout);
+
+    return decompress_core(input, length, output, maxout, NULL, 0, progress);
+}
+
+FASTYZ_API int yaz0_decompress_dict(const void* input, int length, void* output, int maxout, const void* dict, int dict_size)
+{
+    if (length < 0 || maxout < 0 || dict_size < 0)
+        return 0;
+
+    return (int)decompress_core(input, (size_t)length, output, (size_t)maxout, (const uint8_t*)dict, (uint32_t)dict_size, NULL);
+}
+
+/*
+ * Position in a list of destination buffers (see yaz0_decompressv()).
+ */
+typedef struct
+{
+    const struct iovec* iov;
+    int index;     /* Current buffer */
+    int count;     /* Number of buffers */
+    uint8_t* p;    /* Next byte of the current buffer */
+    uint8_t* end;  /* End of the current buffer */
+} yaz0_cursor_t;
+
+/*
+ * Move to the start of the next non-empty buffer. Returns false if there
+ * is none.
+ */
+static bool cursor_advance(yaz0_cursor_t* c)
+{
+    do
+    {
+        if (++c->index >= c->count)
+            return false;
+    } while (c->iov[c->index].iov_len == 0);
+
+    c->p = (uint8_t*)c->iov[c->index].iov_base;
+    c->end = c->p + c->iov[c->index].iov_len;
+    return true;
+}
+
+/*
+ * Move 'back' bytes towards the start of the first buffer. Returns false
+ * if that would leave the first buffer.
+ */
+static bool cursor_rewind(yaz0_cursor_t* c, uint32_t back)
+{
+    for (;;)
+    {
+        uint8_t* base = (uint8_t*)c->iov[c->index].iov_base;
+        if ((size_t)(c->p - base) >= back)
+            break;
+
+        back -= (uint32_t)(c->p - base);
+        do
+        {
+            if (--c->index < 0)
+                return false;
+        } while (c->iov[c->index].iov_len == 0);
+
+        c->end = (uint8_t*)c->iov[c->index].iov_base + c->iov[c->index].iov_len;
+        c->p = c->end;
+    }
+
+    c->p -= back;
+    return true;
+}
+
+FASTYZ_API int yaz0_decompressv(const void* input, int length, const struct iovec* iov, int iovcnt)
+{
+    if (length < YAZ0_HEADER_SIZE || iovcnt <= 0)
+        return 0;
+
+    uint32_t decompressed_size = yaz0_get_decompressed_size(input);
+    if (decompressed_size == 0)
+        return 0;
+
+    /* The buffers must hold the whole output */
+    size_t capacity = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        capacity += iov[i].iov_len;
+    if (capacity < decompressed_size)
+        return 0;
+
+    const uint8_t* src = (const uint8_t*)input + YAZ0_HEADER_SIZE;
+    const uint8_t* src_end = (const uint8_t*)input + length;
+    yaz0_cursor_t dst = { iov, -1, iovcnt, NULL, NULL };
+    uint32_t pos = 0;
+    uint8_t flag = 0;
+    int bits_remaining = 0;
+
+    cursor_advance(&dst);
+
+    while (pos < decompressed_size)
+    {
+        if (bits_remaining == 0)
+        {
+            if (src >= src_end)
+                return 0;
+            flag = *src++;
+            bits_remaining = 8;
+        }
+
+        if (flag & 0x80)
+        {
+            if (src >= src_end || (dst.p == dst.end && !cursor_advance(&dst)))
+                return 0;
+            *dst.p++ = *src++;
+            ++pos;
+        }
+        else
+        {
+            if (src + 2 > src_end)
+                return 0;
+
+            uint8_t byte1 = *src++;
+            uint8_t byte2 = *src++;
+            uint32_t distance = (((byte1 & 0x0F) << 8) | byte2) + 1;
+            uint32_t len = byte1 >> 4;
+
+            if (len == 0)
+            {
+                if (src >= src_end)
+                    return 0;
+                len = *src++ + LONG_FORM_MIN;
+            }
+            else
+            {
+                len += SHORT_FORM_MIN - 1;
+            }
+
+            if (distance > pos || len > capacity - pos)
+                return 0;
+
+            uint8_t* base = (uint8_t*)iov[dst.index].iov_base;
+            if (YAZ0_LIKELY(distance <= (size_t)(dst.p - base) && len <= (size_t)(dst.end - dst.p)))
+            {
+                /* Source and destination within the current buffer */
+                const uint8_t* ref = dst.p - distance;
+                if (distance >= len)
+                {
+                    memcpy(dst.p, ref, len);
+                    dst.p += len;
+                }
+                else
+                {
+                    for (uint32_t i = 0; i < len; ++i)
+                        *dst.p++ = *ref++;
+                }
+            }
+            else
+            {
+                /* Follow the source and the destination across buffer boundaries */
+                yaz0_cursor_t ref = dst;
+                if (!cursor_rewind(&ref, distance))
+                    return 0;
+
+                for (uint32_t i = 0; i < len; ++i)
+                {
+                    if (ref.p == ref.end)
+                        cursor_advance(&ref);
+                    if (dst.p == dst.end)
+                        cursor_advance(&dst);
+                    *dst.p++ = *ref.p++;
+                }
+            }
+
+            pos += len;
+        }
+
+        flag <<= 1;
+        bits_remaining--;
+    }
+
+    return (int)pos;
+}
+
+/* ========================================================================
+ * Incremental Recompression
+ * ======================================================================== */
+
+/*
+ * Sequential reader over the tokens of an existing Yaz0 stream.
+ *
+ * 'mask' is the flag bit of the next token; 0 means the next token starts
+ * a new flag group. Literals are reported with distance 0.
+ */
+typedef struct
+{
+    const uint8_t* ip;      /* Next compressed byte */
+    const uint8_t* ip_end;  /* End of the compressed stream */
+    uint32_t pos;           /* Decompressed position of the next token */
+    uint32_t size;          /* Decompressed size of the stream */
+    uint8_t flags;          /* Current flag byte */
+    uint8_t mask;           /* Flag bit of the next token */
+} yaz0_reader_t;
+
+/*
+ * Read the next token. Returns false at the end of the stream or if the
+ * token is malformed (truncated, or reaching outside the decompressed data).
+ */
+static YAZ0_FORCE_INLINE bool reader_next(yaz0_reader_t* r, uint32_t* len, uint32_t* distance)
+{
+    if (r->pos >= r->size)
+        return false;
+
+    if (r->mask == 0)
+    {
+        if (r->ip >= r->ip_end)
+            return false;
+        r->flags = *r->ip++;
+        r->mask = 0x80;
+    }
+
+    if (r->flags & r->mask)
+    {
+        if (r->ip >= r->ip_end)
+            return false;
+        ++r->ip;
+        *len = 1;
+        *distance = 0;
+    }
+    else
+    {
+        if (r->ip_end - r->ip < 2)
+            return false;
+
+        uint32_t n = r->ip[0] >> 4;
+        *distance = (((uint32_t)(r->ip[0] & 0x0F) << 8) | r->ip[1]) + 1;
+        r->ip += 2;
+
+        if (n == 0)
+        {
+            if (r->ip >= r->ip_end)
+                return false;
+            n = *r->ip++ + LONG_FORM_MIN;
+        }
+        else
+        {
+            n += SHORT_FORM_MIN - 1;
+        }
+
+        if (*distance > r->pos || n > r->size - r->pos)
+            return false;
+        *len = n;
+    }
+
+    r->pos += *len;
+    r->mask >>= 1;
+    return true;
+}
+
+/*
+ * Skip one complete flag group (8 tokens) if it ends at or before decompressed
+ * position 'limit' (which must not exceed the stream size). The reader must
+ * be at the start of a group. Returns false, leaving the reader unchanged,
+ * if the group does not fit or is malformed.
+ */
+static YAZ0_FORCE_INLINE bool reader_skip_group(yaz0_reader_t* r, uint32_t limit)
+{
+    const uint8_t* ip = r->ip;
+    uint32_t pos = r->pos;
+    uint32_t bad = 0;
+
+    /* A group is at most 1 + 8 * 3 bytes; shorter tails go token by token */
+    if (r->ip_end - ip < 1 + 8 * 3)
+        return false;
+
+    uint32_t flags = *ip++;
+
+    for (int i = 0; i < 8; ++i, flags <<= 1)
+    {
+        if (flags & 0x80)
+        {
+            ++ip;
+            ++pos;
+            continue;
+        }
+
+        uint32_t n = ip[0] >> 4;
+        uint32_t distance = (((uint32_t)(ip[0] & 0x0F) << 8) | ip[1]) + 1;
+        if (n == 0)
+        {
+            n = ip[2] + LONG_FORM_MIN;
+            ip += 3;
+        }
+        else
+        {
+            n += SHORT_FORM_MIN - 1;
+            ip += 2;
+        }
+
+        bad |= distance > pos;
+        pos += n;
+    }
+
+    if (bad || pos > limit)
+        return false;
+
+    r->ip = ip;
+    r->pos = pos;
+    return true;
+}
+
+/*
+ * Advance the reader to the first token boundary at or after 'target'.
+ */
+static void reader_seek(yaz0_reader_t* r, uint32_t target)
+{
+    uint32_t len, distance;
+
+    while (r->mask != 0 && r->pos < target && reader_next(r, &len, &distance))
+        ;
+    while (r->pos < target && reader_skip_group(r, target))
+        ;
+    while (r->pos < target && reader_next(r, &len, &distance))
+        ;
+}
+
+/*
+ * Re-emit tokens of the old stream up to (at most) decompressed position
+ * 'limit'. 'src' holds the old input, where literal bytes are read from.
+ *
+ * Each token uses one flag bit in both streams, so whole flag groups can
+ * be copied byte for byte once the writer and the reader sit at the same
+ * bit of their groups. Until then, matches of 6 bytes or more are split in
+ * two (same distance) to shift the writer one bit closer.
+ */
+static void copy_tokens(yaz0_writer_t* w, yaz0_reader_t* r, const uint8_t* src, uint32_t limit)
+{
+    while (r->pos < limit)
+    {
+        uint32_t rbit = r->mask ? 7 - (uint32_t)__builtin_ctz(r->mask) : 0;
+        uint32_t wbit = 7 - (uint32_t)__builtin_ctz(w->mask);
+
+        if (rbit == 0 && wbit == 0)
+        {
+            const uint8_t* start = r->ip;
+            while (reader_skip_group(r, limit))
+                ;
+
+            if (r->ip != start)
+            {
+                /* The copied groups bring their own flag bytes */
+                size_t bytes = (size_t)(r->ip - start);
+                memcpy(w->flagp, start, bytes);
+                w->op = w->flagp + bytes;
+                writer_new_group(w);
+                continue;
+            }
+        }
+
+        yaz0_reader_t next = *r;
+        uint32_t len, distance;
+
+        if (!reader_next(&next, &len, &distance) || next.pos > limit)
+            break;
+
+        if (distance == 0)
+        {
+            writer_emit_literals(w, 1, src + r->pos);
+        }
+        else if (rbit != wbit && len >= 2 * SHORT_FORM_MIN)
+        {
+            writer_emit_match(w, SHORT_FORM_MIN, distance);
+            writer_emit_match(w, len - SHORT_FORM_MIN, distance);
+        }
+        else
+        {
+            writer_emit_match(w, len, distance);
+        }
+
+        *r = next;
+    }
+}
+
+/*
+ * A run of new input that also occurs in the old input, 'delta' bytes later.
+ */
+typedef struct
+{
+    uint32_t start;
+    uint32_t end;
+    int32_t delta;
+} yaz0_region_t;
+
+/* Granularity of the unchanged-run search */
+#define REGION_BLOCK 1024
+
+/* Shortest unchanged run worth copying tokens from; the first 4 KiB only serve as history */
+#define MIN_REGION (MAX_MATCH_DISTANCE + REGION_BLOCK)
+
+/*
+ * Length of the common prefix of p and q, at most n bytes.
+ */
+static uint32_t common_length(const uint8_t* p, const uint8_t* q, uint32_t n)
+{
+    uint32_t i = 0;
+
+    while (n - i >= 64 && memcmp(p + i, q + i, 64) == 0)
+        i += 64;
+    while (i < n && p[i] == q[i])
+        ++i;
+
+    return i;
+}
+
+/*
+ * Append the runs of at least MIN_REGION bytes where new[p] == old[p + delta].
+ * Such a run always covers a whole aligned block, so only blocks are probed.
+ */
+static bool find_regions(yaz0_region_t** regions, uint32_t* count, uint32_t* capacity,
+                         const uint8_t* old_ip, uint32_t old_size, const uint8_t* new_ip, uint32_t new_size, int32_t delta)
+{
+    const uint8_t* ref = old_ip + delta;
+    uint32_t lo = delta < 0 ? (uint32_t)-delta : 0;
+    uint32_t end = (int64_t)old_size - delta < (int64_t)new_size ? (uint32_t)((int64_t)old_size - delta) : new_size;
+    uint32_t p = (lo + REGION_BLOCK - 1) & ~(uint32_t)(REGION_BLOCK - 1);
+
+    while (end >= REGION_BLOCK && p <= end - REGION_BLOCK)
+    {
+        if (memcmp(ref + p, new_ip + p, REGION_BLOCK) != 0)
+        {
+            p += REGION_BLOCK;
+            continue;
+        }
+
+        uint32_t start = p;
+        while (start > lo && ref[start - 1] == new_ip[start - 1])
+            --start;
+        uint32_t stop = p + REGION_BLOCK + common_length(ref + p + REGION_BLOCK, new_ip + p + REGION_BLOCK,
+                                                         end - p - REGION_BLOCK);
+
+        if (stop - start >= MIN_REGION)
+        {
+            if (*count == *capacity)
+            {
+                uint32_t grown = *capacity ? *capacity * 2 : 16;
+                yaz0_region_t* r = (yaz0_region_t*)realloc(*regions, grown * sizeof(yaz0_region_t));
+                if (!r)
+                    return false;
+                *regions = r;
+                *capacity = grown;
+            }
+
+            yaz0_region_t* r = &(*regions)[(*count)++];
+            r->start = start;
+            r->end = stop;
+            r->delta = delta;
+        }
+
+        /* The byte at 'stop' differs; resume at the next block after it */
+        p = (stop + REGION_BLOCK) & ~(uint32_t)(REGION_BLOCK - 1);
+        lo = stop;
+    }
+
+    return true;
+}
+
+/*
+ * Compress new positions [start, end) with the regular match search. The
+ * hash table keeps positions in the new input, so entries left by earlier
+ * spans stay valid; the history just before 'start' is inserted first.
+ */
+static void compress_span(yaz0_writer_t* w, uint32_t* htab, const uint8_t* ip, uint32_t size, uint32_t start, uint32_t end)
+{
+    yaz0_window_t win = { ip, 0, ip + end };
+    uint32_t hist = start < MAX_MATCH_DISTANCE ? start : MAX_MATCH_DISTANCE;
+    uint32_t prime_end = size >= 3 && start > size - 3 ? size - 3 : start;
+
+    yaz0_search_t search;
+    search_init(&search, 1, 0, 0, NULL, NULL);
+
+    if (start - hist < prime_end)
+        compress_prime(htab, &win, ip + start - hist, ip + prime_end, &search);
+
+    compress_range(w, htab, &win, ip + start, ip + end, &search);
+}
+
+FASTYZ_API int yaz0_recompress_incremental(const void* old_input, int old_length, const void* old_compressed, int old_compressed_length,
+                                           const void* new_input, int new_length, void* output)
+{
+    const uint8_t* old_ip = (const uint8_t*)old_input;
+    const uint8_t* new_ip = (const uint8_t*)new_input;
+    const uint8_t* stream = (const uint8_t*)old_compressed;
+    uint8_t* op = (uint8_t*)output;
+    uint32_t old_size = (uint32_t)old_length;
+    uint32_t new_size = (uint32_t)new_length;
+    yaz0_region_t* regions = NULL;
+    uint32_t num_regions = 0, capacity = 0;
+
+    if (old_length < 0 || new_length < 0 || old_compressed_length < YAZ0_HEADER_SIZE)
+        return 0;
+    if (!yaz0_is_valid(stream) || yaz0_get_decompressed_size(stream) != old_size)
+        return 0;
+
+    /*
+     * Unchanged runs are searched at the same offset (in-place edits) and at
+     * the offset that lines up the ends of the inputs (an insertion or
+     * deletion). Overlaps between the two are trimmed while copying.
+     */
+    bool found = find_regions(&regions, &num_regions, &capacity, old_ip, old_size, new_ip, new_size, 0);
+    if (found && old_size != new_size)
+        found = find_regions(&regions, &num_regions, &capacity, old_ip, old_size, new_ip, new_size,
+                             (int32_t)(old_size - new_size));
+    if (!found)
+        num_regions = 0;  /* Out of memory: compress everything */
+
+    for (uint32_t i = 1; i < num_regions; ++i)
+    {
+        yaz0_region_t r = regions[i];
+        uint32_t j = i;
+        for (; j > 0 && regions[j - 1].start > r.start; --j)
+            regions[j] = regions[j - 1];
+        regions[j] = r;
+    }
+
+    write_header(op, new_size);
+
+    yaz0_writer_t w;
+    w.op = op + YAZ0_HEADER_SIZE;
+    writer_new_group(&w);
+
+    uint32_t htab[HASH_SIZE] = { 0 };
+    const yaz0_reader_t stream_start = { stream + YAZ0_HEADER_SIZE, stream + old_compressed_length, 0, old_size, 0, 0 };
+    yaz0_reader_t r = stream_start;
+    uint32_t done = 0;
+
+    for (uint32_t i = 0; i < num_regions; ++i)
+    {
+        const yaz0_region_t* rg = &regions[i];
+        uint32_t start = rg->start > done ? rg->start : done;
+        uint32_t old_start = start + rg->delta;
+        uint32_t old_end = rg->end + rg->delta;
+
+        /*
+         * Copied matches must not reach before the unchanged run, except at
+         * the very start of the old stream where there is nothing before it.
+         */
+        if (old_start != 0)
+            old_start += MAX_MATCH_DISTANCE;
+        if (start >= rg->end || old_start >= old_end)
+            continue;
+
+        /* Regions are visited in new-input order; rewind if the old stream went backwards */
+        if (old_start < r.pos)
+            r = stream_start;
+        reader_seek(&r, old_start);
+        if (r.pos < old_start || r.pos >= old_end)
+            continue;
+
+        uint32_t copy_start = r.pos - rg->delta;
+        if (copy_start > done)
+            compress_span(&w, htab, new_ip, new_size, done, copy_start);
+
+        copy_tokens(&w, &r, old_ip, old_end);
+        done = r.pos - rg->delta;
+    }
+
+    if (done < new_size)
+        compress_span(&w, htab, new_ip, new_size, done, new_size);
+
+    free(regions);
+    return (int)(w.op - op);
+}
+
+/* ========================================================================
+ * Content Keys
+ * ======================================================================== */
+
+/*
+ * 128-bit content hash for cache keys: four 64-bit multiply-rotate lanes
+ * over 32-byte stripes (the xxHash64 round), finalized twice with
+ * different lane mixes. Words are read little-endian so that keys are the
+ * same on every host.
+ */
+#define KEY_PRIME1 0x9E3779B185EBCA87ull
+#define KEY_PRIME2 0xC2B2AE3D27D4EB4Full
+#define KEY_PRIME3 0x165667B19E3779F9ull
+#define KEY_PRIME4 0x85EBCA77C2B2AE63ull
+#define KEY_PRIME5 0x27D4EB2F165667C5ull
+
+static YAZ0_FORCE_INLINE uint64_t read_u64_le(const uint8_t* p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static YAZ0_FORCE_INLINE uint64_t rotl64(uint64_t v, int bits)
+{
+    return (v << bits) | (v >> (64 - bits));
+}
+
+static YAZ0_FORCE_INLINE uint64_t key_round(uint64_t acc, uint64_t input)
+{
+    return rotl64(acc + input * KEY_PRIME2, 31) * KEY_PRIME1;
+}
+
+static uint64_t key_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= KEY_PRIME2;
+    h ^= h >> 29;
+    h *= KEY_PRIME3;
+    return h ^ (h >> 32);
+}
+
+static void content_hash(uint64_t hash[2], const uint8_t* p, size_t length, uint64_t seed)
+{
+    uint64_t v0 = seed + KEY_PRIME1 + KEY_PRIME2;
+    uint64_t v1 = seed + KEY_PRIME2;
+    uint64_t v2 = seed;
+    uint64_t v3 = seed - KEY_PRIME1;
+    size_t left = length;
+
+    for (; left >= 32; p += 32, left -= 32)
+    {
+        v0 = key_round(v0, read_u64_le(p));
+        v1 = key_round(v1, read_u64_le(p + 8));
+        v2 = key_round(v2, read_u64_le(p + 16));
+        v3 = key_round(v3, read_u64_le(p + 24));
+    }
+
+    /* Tail: the remaining whole words, then the last 0-7 bytes */
+    for (; left >= 8; p += 8, left -= 8)
+        v0 = key_round(v0, read_u64_le(p));
+
+    uint64_t last = 0;
+    for (size_t i = 0; i < left; ++i)
+        last |= (uint64_t)p[i] << (8 * i);
+    v1 = key_round(v1, last ^ KEY_PRIME5);
+
+    uint64_t n = (uint64_t)length;
+    hash[0] = key_avalanche((rotl64(v0, 1) + rotl64(v1, 7) + rotl64(v2, 12) + rotl64(v3, 18)) ^ (n * KEY_PRIME5));
+    hash[1] = key_avalanche((v0 * KEY_PRIME3) ^ rotl64(v1, 23) ^ (v2 * KEY_PRIME4) ^ rotl64(v3, 41) ^ (n + KEY_PRIME1));
+}
+
+FASTYZ_API void yaz0_cache_key(yaz0_cache_key_t* key, int operation, const void* input, size_t length,
+                               const yaz0_params_t* params)
+{
+    /*
+     * Everything that decides the output besides the input: the library
+     * version, the match table size it was built with, the operation and
+     * every parameter. Hashed into the seed of the content hash.
+     */
+    uint32_t fields[8] = {
+        0x4B5A5946u,  /* "FYZK" */
+        FASTYZ_VERSION, HASH_LOG, (uint32_t)operation,
+        (uint32_t)params->alignment, (uint32_t)params->alignment_phase,
+        (uint32_t)params->decode_speed, ((uint32_t)params->level << 8) | (uint32_t)params->strategy
+    };
+    uint8_t header[sizeof(fields)];
+    uint64_t seed[2], hash[2];
+
+    for (int i = 0; i < 8; ++i)
+        for (int b = 0; b < 4; ++b)
+            header[i * 4 + b] = (uint8_t)(fields[i] >> (8 * b));
+
+    content_hash(seed, header, sizeof(header), 0);
+    content_hash(hash, (const uint8_t*)input, length, seed[0] ^ seed[1]);
+
+    for (int b = 0; b < 8; ++b)
+    {
+        key->bytes[b] = (uint8_t)(hash[0] >> (8 * b));
+        key->bytes[8 + b] = (uint8_t)(hash[1] >> (8 * b));
+    }
+}
+
+/* ========================================================================
+ * Transcoding
+ * ======================================================================== */
+
+/* Decompressed bytes re-encoded per step */
+#define TRANSCODE_CHUNK 65536
+
+/* Bytes decoded past a step so that matches can extend across it */
+#define TRANSCODE_OVERLAP 256
+
+/* Most bytes decoded ahead of the re-encoding position */
+#define TRANSCODE_SPAN (TRANSCODE_CHUNK + TRANSCODE_OVERLAP + MAX_LEN)
+
+/*
+ * Decode tokens from 'r' into the window until it reaches logical position
+ * 'target' or the end of the stream, recording every match as a hint.
+ * Returns false if the stream is malformed.
+ */
+static bool transcode_fill(yaz0_reader_t* r, uint8_t* window, uint32_t base_pos, uint32_t* filled,
+                           yaz0_hint_t* hints, uint32_t* num_hints, uint32_t target)
+{
+    uint32_t len, distance;
+
+    while (base_pos + *filled < target && r->pos < r->size)
+    {
+        uint32_t pos = r->pos;
+        if (!reader_next(r, &len, &distance))
+            return false;
+
+        uint8_t* dst = window + *filled;
+        if (distance == 0)
+        {
+            *dst = r->ip[-1];
+        }
+        else
+        {
+            /* The window holds MAX_MATCH_DISTANCE bytes of history, so 'ref' is in it */
+            const uint8_t* ref = dst - distance;
+            for (uint32_t i = 0; i < len; ++i)
+                dst[i] = ref[i];
+
+            yaz0_hint_t* h = &hints[(*num_hints)++];
+            h->pos = pos;
+            h->end = pos + len;
+            h->distance = distance;
+        }
+        *filled += len;
+    }
+
+    return true;
+}
+
+/*
+ * yaz0_recompress() with the given match tables and the allocator of the
+ * window and staging buffers.
+ */
+static int recompress_with(const yaz0_allocator_t* allocator, uint32_t* htab, uint32_t* chain, const void* input,
+                           int length, void* output, int maxout, const yaz0_params_t* params)
+{
+    const uint8_t* src = (const uint8_t*)input;
+    uint8_t* op = (uint8_t*)output;
+    yaz0_params_t resolved = *params;
+    uint32_t align, phase;
+    int result = 0;
+
+    if (length < YAZ0_HEADER_SIZE || maxout < length || !yaz0_is_valid(src))
+        return 0;
+
+    /* Transcoding always runs the chain parser, which needs no input scan */
+    if (resolved.level < 1)
+        resolved.level = 1;
+    if (!resolve_params(&resolved, NULL, 0, &align, &phase))
+        return 0;
+
+    uint32_t size = yaz0_get_decompressed_size(src);
+    uint8_t* window = (uint8_t*)mem_alloc(allocator, MAX_MATCH_DISTANCE + TRANSCODE_SPAN);
+    yaz0_hint_t* hints = (yaz0_hint_t*)mem_alloc(allocator, (TRANSCODE_SPAN / SHORT_FORM_MIN + 2) * sizeof(yaz0_hint_t));
+    uint8_t* stage = (uint8_t*)mem_alloc(allocator, FASTYZ_BOUND(TRANSCODE_SPAN) + 32);
+    if (!window || !hints || !stage)
+        goto cleanup;
+
+    yaz0_decode_policy_t policy;
+    yaz0_decode_policy_t* pp = NULL;
+    if (resolved.decode_speed)
+    {
+        decode_policy_init(&policy, resolved.decode_speed);
+        pp = &policy;
+    }
+
+    memset(htab, 0, HASH_SIZE * sizeof(uint32_t));
+    yaz0_search_t search;
+    search_init(&search, align, phase, resolved.level, chain, pp);
+
+    /*
+     * The stream is decoded one chunk at a time into a window that keeps
+     * MAX_MATCH_DISTANCE bytes of history, and each chunk is re-encoded
+     * with the old matches as extra candidates. Tokens are staged in a small
+     * buffer; complete flag groups move to the output after every chunk.
+     */
+    yaz0_reader_t r = { src + YAZ0_HEADER_SIZE, src + length, 0, size, 0, 0 };
+    yaz0_writer_t w;
+    w.op = stage;
+    writer_new_group(&w);
+
+    size_t out = YAZ0_HEADER_SIZE;
+    uint32_t base_pos = 0, filled = 0, num_hints = 0, pos = 0;
+    bool smaller = true;
+
+    while (pos < size)
+    {
+        if (!transcode_fill(&r, window, base_pos, &filled, hints, &num_hints, pos + TRANSCODE_CHUNK + TRANSCODE_OVERLAP))
+            goto cleanup;
+
+        yaz0_window_t win = { window, base_pos, window + filled };
+        const uint8_t* ip = window + (pos - base_pos);
+        const uint8_t* ip_end = r.pos < size ? win.limit - TRANSCODE_OVERLAP : win.limit;
+        yaz0_hints_t h = { hints, num_hints, 0 };
+
+        search.hints = &h;
+        pos = WINDOW_POS(&win, compress_range(&w, htab, &win, ip, ip_end, &search));
+
+        /* Give up as soon as the result can no longer be smaller */
+        size_t ready = (size_t)(w.flagp - stage);
+        if (out + ready >= (size_t)length)
+        {
+            smaller = false;
+            break;
+        }
+
+        memcpy(op + out, stage, ready);
+        out += ready;
+        memmove(stage, w.flagp, (size_t)(w.op - w.flagp));
+        w.op -= ready;
+        w.flagp = stage;
+
+        /* Slide the window, keeping the history and the bytes decoded past 'pos' */
+        uint32_t keep = pos > MAX_MATCH_DISTANCE ? pos - MAX_MATCH_DISTANCE : 0;
+        if (keep > base_pos)
+        {
+            memmove(window, window + (keep - base_pos), filled - (keep - base_pos));
+            filled -= keep - base_pos;
+            base_pos = keep;
+        }
+
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < num_hints; ++i)
+        {
+            if (hints[i].end > pos)
+                hints[kept++] = hints[i];
+        }
+        num_hints = kept;
+    }
+
+    if (smaller && out + (size_t)(w.op - stage) < (size_t)length)
+    {
+        memcpy(op + out, stage, (size_t)(w.op - stage));
+        out += (size_t)(w.op - stage);
+        write_header(op, size);
+        result = (int)out;
+    }
+    else
+    {
+        /* Never return a larger stream than the input */
+        memcpy(op, src, (size_t)length);
+        result = length;
+    }
+
+cleanup:
+    mem_free(allocator, window);
+    mem_free(allocator, hints);
+    mem_free(allocator, stage);
+    return result;
+}
+
+FASTYZ_API int yaz0_recompress(const void* input, int length, void* output, int maxout, const yaz0_params_t* params)
+{
+    uint32_t htab[HASH_SIZE];
+    uint32_t chain[MAX_MATCH_DISTANCE];
+    return recompress_with(NULL, htab, chain, input, length, output, maxout, params);
+}
+
+FASTYZ_API int yaz0_recompress_cctx(yaz0_cctx_t* cctx, const void* input, int length, void* output, int maxout,
+                                    const yaz0_params_t* params)
+{
+    return recompress_with(cctx_allocator(cctx), cctx->htab, cctx->chain, input, length, output, maxout, params);
+}
+
+typedef struct
+{
+    yaz0_recompress_job_t* jobs;
+    uint32_t count;
+    const yaz0_params_t* params;
+    const yaz0_allocator_t* allocator;  /* NULL for malloc() */
+    const yaz0_cache_t* cache;          /* NULL for no cache */
+    yaz0_cache_key_t* keys;             /* Key of each job; NULL without a cache */
+    uint32_t* leader;                   /* Job whose result each job copies; NULL if none */
+    uint32_t next;
+    uint32_t cancelled;
+    yaz0_reporter_t* reporter;          /* NULL for no reporting */
+    uint32_t lock;                      /* Guards the fields below and the callback */
+    uint32_t done;
+    size_t consumed;
+    size_t produced;
+} yaz0_batch_t;
+
+/*
+ * Add a finished job to the batch totals and report them.
+ */
+static void batch_report(yaz0_batch_t* batch, const yaz0_recompress_job_t* job)
+{
+    spin_lock(&batch->lock);
+
+    batch->consumed += (size_t)job->length;
+    batch->produced += (size_t)job->result;
+    ++batch->done;
+
+    if (!atomic_load_acquire(&batch->cancelled) &&
+        !reporter_update(batch->reporter, batch->consumed, batch->consumed, batch->produced,
+                         batch->done == batch->count))
+        atomic_store_release(&batch->cancelled, 1);
+
+    spin_unlock(&batch->lock);
+}
+
+/*
+ * Re-encode one job, or copy its output from the cache. A cached output
+ * is used only if it fits and records the same decompressed size.
+ */
+static int batch_run(yaz0_batch_t* batch, uint32_t i)
+{
+    yaz0_recompress_job_t* job = &batch->jobs[i];
+    const yaz0_cache_t* cache = batch->keys ? batch->cache : NULL;
+
+    if (cache && cache->lookup && job->length >= YAZ0_HEADER_SIZE && yaz0_is_valid(job->input))
+    {
+        size_t size = cache->lookup(cache->user, &batch->keys[i], job->output, (size_t)job->length);
+        if (size >= YAZ0_HEADER_SIZE && size <= (size_t)job->length && yaz0_is_valid(job->output) &&
+            yaz0_get_decompressed_size(job->output) == yaz0_get_decompressed_size(job->input))
+            return (int)size;
+    }
+
+    uint32_t htab[HASH_SIZE];
+    uint32_t chain[MAX_MATCH_DISTANCE];
+    int result = recompress_with(batch->allocator, htab, chain, job->input, job->length, job->output, job->length,
+                                 batch->params);
+    if (result > 0 && cache && cache->store)
+        cache->store(cache->user, &batch->keys[i], job->output, (size_t)result);
+    return result;
+}
+
+static void recompress_worker(void* arg)
+{
+    yaz0_batch_t* batch = (yaz0_batch_t*)arg;
+
+    for (uint32_t i; (i = atomic_fetch_inc(&batch->next)) < batch->count; )
+    {
+        yaz0_recompress_job_t* job = &batch->jobs[i];
+
+        /* Duplicates copy their leader's result after the workers finish */
+        if (batch->leader && batch->leader[i] != i)
+            continue;
+
+        if (atomic_load_acquire(&batch->cancelled))
+        {
+            job->result = 0;
+            continue;
+        }
+
+        job->result = batch_run(batch, i);
+        if (batch->reporter)
+            batch_report(batch, job);
+    }
+}
+
+typedef struct
+{
+    yaz0_cache_key_t key;
+    uint32_t index;
+} yaz0_keyed_job_t;
+
+static int compare_keyed_jobs(const void* a, const void* b)
+{
+    const yaz0_keyed_job_t* x = (const yaz0_keyed_job_t*)a;
+    const yaz0_keyed_job_t* y = (const yaz0_keyed_job_t*)b;
+    int order = memcmp(x->key.bytes, y->key.bytes, YAZ0_CACHE_KEY_SIZE);
+
+    if (order)
+        return order;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/*
+ * Key every job and point each duplicate input (same key and bytes) at the
+ * first job with that input, which is the only one re-encoded. Returns
+ * false if out of memory, leaving the batch without keys.
+ */
+static bool batch_dedup(yaz0_batch_t* batch)
+{
+    uint32_t count = batch->count;
+    yaz0_keyed_job_t* sorted = (yaz0_keyed_job_t*)mem_alloc(batch->allocator, count * sizeof(yaz0_keyed_job_t));
+    yaz0_cache_key_t* keys = (yaz0_cache_key_t*)mem_alloc(batch->allocator, count * sizeof(yaz0_cache_key_t));
+    uint32_t* leader = (uint32_t*)mem_alloc(batch->allocator, count * sizeof(uint32_t));
+
+    if (!sorted || !keys || !leader)
+    {
+        mem_free(batch->allocator, sorted);
+        mem_free(batch->allocator, keys);
+        mem_free(batch->allocator, leader);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const yaz0_recompress_job_t* job = &batch->jobs[i];
+
+        if (job->length > 0)
+            yaz0_cache_key(&keys[i], YAZ0_CACHE_RECOMPRESS, job->input, (size_t)job->length, batch->params);
+        else
+            memset(&keys[i], 0, sizeof(keys[i]));
+        sorted[i].key = keys[i];
+        sorted[i].index = i;
+        leader[i] = i;
+    }
+
+    qsort(sorted, count, sizeof(yaz0_keyed_job_t), compare_keyed_jobs);
+
+    for (uint32_t i = 0, first = 0; i < count; ++i)
+    {
+        if (memcmp(sorted[i].key.bytes, sorted[first].key.bytes, YAZ0_CACHE_KEY_SIZE) != 0)
+            first = i;
+        if (i == first)
+            continue;
+
+        const yaz0_recompress_job_t* a = &batch->jobs[sorted[first].index];
+        const yaz0_recompress_job_t* b = &batch->jobs[sorted[i].index];
+        if (a->length > 0 && a->length == b->length && memcmp(a->input, b->input, (size_t)a->length) == 0)
+            leader[sorted[i].index] = sorted[first].index;
+    }
+
+    mem_free(batch->allocator, sorted);
+    batch->keys = keys;
+    batch->leader = leader;
+    return true;
+}
+
+FASTYZ_API void yaz0_recompress_batch(yaz0_recompress_job_t* jobs, int count, const yaz0_params_t* params, int threads)
+{
+    yaz0_recompress_batch_progress(jobs, count, params, threads, NULL);
+}
+
+FASTYZ_API int yaz0_recompress_batch_progress(yaz0_recompress_job_t* jobs, int count, const yaz0_params_t* params,
+                                              int threads, const yaz0_progress_t* progress)
+{
+    return yaz0_recompress_batch_cached(jobs, count, params, threads, progress, NULL, NULL);
+}
+
+FASTYZ_API int yaz0_recompress_batch_cached(yaz0_recompress_job_t* jobs, int count, const yaz0_params_t* params,
+                                            int threads, const yaz0_progress_t* progress, const yaz0_cache_t* cache,
+                                            const yaz0_allocator_t* allocator)
+{
+    yaz0_batch_t batch = { jobs, count > 0 ? (uint32_t)count : 0, params, allocator, cache, NULL, NULL, 0, 0, NULL, 0,
+                           0, 0, 0 };
+    yaz0_reporter_t reporter;
+
+    if (progress && progress->callback)
+    {
+        reporter_init(&reporter, progress);
+        batch.reporter = &reporter;
+    }
+
+    threads = thread_count(threads);
+    if (threads > count)
+        threads = count;
+
+    /* A lone job without a cache has nothing to key */
+    if (batch.count > 1 || cache)
+        batch_dedup(&batch);
+
+    run_workers(recompress_worker, &batch, threads);
+
+    if (batch.leader)
+    {
+        for (uint32_t i = 0; i < batch.count; ++i)
+        {
+            yaz0_recompress_job_t* job = &jobs[i];
+            const yaz0_recompress_job_t* first = &jobs[batch.leader[i]];
+
+            if (first == job)
+                continue;
+
+            job->result = first->result;
+            if (job->result > 0)
+                memcpy(job->output, first->output, (size_t)job->result);
+            if (batch.reporter)
+                batch_report(&batch, job);
+        }
+    }
+
+    mem_free(allocator, batch.keys);
+    mem_free(allocator, batch.leader);
+    return batch.cancelled != 0;
+}
+
+/* ========================================================================
+ * Token Streams
+ * ======================================================================== */
+
+FASTYZ_API int yaz0_parse_tokens(const void* input, int length, yaz0_tokens_t* tokens)
+{
+    const uint8_t* src = (const uint8_t*)input;
+
+    if (length < YAZ0_HEADER_SIZE || !yaz0_is_valid(input))
+        return 0;
+
+    uint32_t size = yaz0_get_decompressed_size(input);
+    if (size == 0)
+        return 0;
+
+    yaz0_reader_t r = { src + YAZ0_HEADER_SIZE, src + length, 0, size, 0, 0 };
+    uint32_t capacity = tokens->capacity > 0 ? (uint32_t)tokens->capacity : 0;
+    uint32_t count = 0;
+    uint32_t literals = 0;
+    uint32_t len, distance;
+
+    while (reader_next(&r, &len, &distance))
+    {
+        if (distance == 0)
+        {
+            ++literals;
+            continue;
+        }
+
+        /* Past the capacity, keep counting to report the size needed */
+        if (count < capacity)
+        {
+            tokens->literals[count] = literals;
+            tokens->length[count] = len;
+            tokens->distance[count] = (uint16_t)distance;
+        }
+        ++count;
+        literals = 0;
+    }
+
+    if (r.pos != size)
+        return 0;
+
+    if (literals)
+    {
+        if (count < capacity)
+        {
+            tokens->literals[count] = literals;
+            tokens->length[count] = 0;
+            tokens->distance[count] = 0;
+        }
+        ++count;
+    }
+
+    if (count > capacity)
+        return -(int)count;
+
+    tokens->count = (int)count;
+    return (int)count;
+}
+
+FASTYZ_API int yaz0_encode_tokens(const yaz0_tokens_t* tokens, const void* data, int length, void* output)
+{
+    const uint8_t* ip = (const uint8_t*)data;
+    uint8_t* op = (uint8_t*)output;
+
+    if (length <= 0 || tokens->count < 0)
+        return 0;
+
+    write_header(op, (uint32_t)length);
+
+    yaz0_writer_t w;
+    w.op = op + YAZ0_HEADER_SIZE;
+    writer_new_group(&w);
+
+    uint32_t size = (uint32_t)length;
+    uint32_t pos = 0;
+
+    for (int i = 0; i < tokens->count; ++i)
+    {
+        uint32_t literals = tokens->literals[i];
+        uint32_t len = tokens->length[i];
+        uint32_t distance = tokens->distance[i];
+
+        if (literals > size - pos)
+            return 0;
+        writer_emit_literals(&w, literals, ip + pos);
+        pos += literals;
+
+        if (len == 0)
+            continue;
+
+        if (len < SHORT_FORM_MIN || len > size - pos || distance == 0 || distance > MAX_MATCH_DISTANCE || distance > pos)
+            return 0;
+        writer_emit_match(&w, len, distance);
+        pos += len;
+    }
+
+    if (pos != size)
+        return 0;
+
+    return (int)(w.op - op);
+}
+
+/* ========================================================================
+ * Fixed-Capacity Compression
+ * ======================================================================== */
+
+/*
+ * Input bytes covered by the tokens of the writer's open flag group.
+ */
+static uint32_t writer_open_length(const yaz0_writer_t* w)
+{
+    /* Start past MAX_MATCH_DISTANCE so that every distance is accepted */
+    yaz0_reader_t r = { w->flagp, w->op, MAX_MATCH_DISTANCE, UINT32_MAX, 0, 0 };
+    uint32_t len, distance;
+
+    while (reader_next(&r, &len, &distance))
+        ;
+
+    return r.pos - MAX_MATCH_DISTANCE;
+}
+
+/*
+ * Compress into a buffer of 'out_cap' bytes (at least the header size)
+ * without writing past it. Chunks are compressed straight into the output
+ * while their worst case fits; the rest goes through a staging buffer from
+ * which complete flag groups move to the output while they fit.
+ *
+ * When the stream does not fit: with 'cut', the longest run of tokens that
+ * fits is kept and '*consumed' tells how much input it covers; otherwise
+ * the remaining groups are only counted and the full stream size (larger
+ * than 'out_cap') is returned. The header is written only when the
+ * returned stream is complete. Nothing is allocated: the staging buffer
+ * lives on the stack next to the match table.
+ */
+static size_t compress_capped(const uint8_t* ip, uint32_t length, uint8_t* op, size_t out_cap, bool cut,
+                              uint32_t* consumed)
+{
+    uint8_t stage[DESTSIZE_WORST + 32];
+    uint32_t htab[HASH_SIZE] = { 0 };
+    yaz0_window_t win = { ip, 0, ip + length };
+    yaz0_search_t search;
+    search_init(&search, 1, 0, 0, NULL, NULL);
+
+    yaz0_writer_t w;
+    size_t out = YAZ0_HEADER_SIZE;
+    uint32_t group_pos = 0;
+    bool fits = true;
+
+    *consumed = 0;
+
+    if (out_cap - out >= DESTSIZE_WORST)
+    {
+        w.op = op + out;
+        writer_new_group(&w);
+
+        /* Compress straight into the output while the worst case of a chunk fits */
+        while (ip < win.limit && (size_t)(op + out_cap - w.op) >= DESTSIZE_WORST)
+            ip = compress_chunk(&w, htab, &win, ip, &search);
+
+        /* Move the open flag group to the staging buffer */
+        out = (size_t)(w.flagp - op);
+        group_pos = (uint32_t)(ip - win.base) - writer_open_length(&w);
+        memcpy(stage, w.flagp, (size_t)(w.op - w.flagp));
+        w.op = stage + (w.op - w.flagp);
+        w.flagp = stage;
+    }
+    else
+    {
+        w.op = stage;
+        writer_new_group(&w);
+    }
+
+    /*
+     * Continue in the staging buffer. 'group_pos' is the input position of
+     * the first staged token.
+     */
+    for (;;)
+    {
+        if (ip < win.limit)
+            ip = compress_chunk(&w, htab, &win, ip, &search);
+
+        size_t pending = (size_t)(w.op - stage);
+        size_t ready = (size_t)(w.flagp - stage);
+
+        /* Without 'cut', keep going once the output is full, but only count */
+        if (fits && !cut && out + (ip == win.limit ? pending : ready) > out_cap)
+            fits = false;
+
+        if (ip == win.limit && (!fits || out + pending <= out_cap))
+        {
+            if (fits)
+                memcpy(op + out, stage, pending);
+            out += pending;
+            *consumed = length;
+            break;
+        }
+
+        if (ip < win.limit && (!fits || out + ready <= out_cap))
+        {
+            /* Move (or, once the output is full, count) the complete groups */
+            if (fits)
+                memcpy(op + out, stage, ready);
+            out += ready;
+            memmove(stage, w.flagp, pending - ready);
+            w.op -= ready;
+            w.flagp = stage;
+            group_pos = (uint32_t)(ip - win.base) - writer_open_length(&w);
+            continue;
+        }
+
+        /* Keep the longest run of staged tokens that fits */
+        yaz0_reader_t r = { stage, w.op, group_pos, length, 0, 0 };
+        uint8_t* flagp = NULL;
+        const uint8_t* end = stage;
+        uint8_t end_mask = 0;
+        uint32_t len, distance;
+
+        *consumed = group_pos;
+        for (;;)
+        {
+            uint8_t* token_flagp = r.mask ? flagp : stage + (r.ip - stage);
+            if (!reader_next(&r, &len, &distance) || out + (size_t)(r.ip - stage) > out_cap)
+                break;
+            flagp = token_flagp;
+            end = r.ip;
+            end_mask = r.mask;
+            *consumed = r.pos;
+        }
+
+        /* Clear the flag bits of the tokens that were dropped */
+        if (flagp && end_mask)
+            *flagp &= (uint8_t)~((end_mask << 1) - 1);
+
+        memcpy(op + out, stage, (size_t)(end - stage));
+        out += (size_t)(end - stage);
+        break;
+    }
+
+    if (fits)
+        write_header(op, *consumed);
+    return out;
+}
+
+FASTYZ_API int yaz0_compress_destsize(const void* input, int* in_len, void* output, int out_cap)
+{
+    const int length = *in_len;
+    uint32_t consumed;
+
+    *in_len = 0;
+    if (length < 0 || out_cap < YAZ0_HEADER_SIZE)
+        return 0;
+
+    if ((size_t)out_cap >= FASTYZ_BOUND((size_t)length))
+    {
+        *in_len = length;
+        return yaz0_compress(input, length, output);
+    }
+
+    size_t size = compress_capped((const uint8_t*)input, (uint32_t)length, (uint8_t*)output, (size_t)out_cap, true,
+                                  &consumed);
+
+    *in_len = (int)consumed;
+    return (int)size;
+}
+
+FASTYZ_API int yaz0_compress_safe(const void* input, int length, void* output, int maxout)
+{
+    uint32_t consumed;
+
+    if (length < 0 || maxout < 0)
+        return 0;
+
+    if ((size_t)maxout >= FASTYZ_BOUND((size_t)length))
+        return yaz0_compress(input, length, output);
+
+    /* Too small for even the header: only measure */
+    uint8_t header[YAZ0_HEADER_SIZE];
+    uint8_t* op = maxout < YAZ0_HEADER_SIZE ? header : (uint8_t*)output;
+    size_t cap = maxout < YAZ0_HEADER_SIZE ? YAZ0_HEADER_SIZE : (size_t)maxout;
+
+    size_t size = compress_capped((const uint8_t*)input, (uint32_t)length, op, cap, false, &consumed);
+
+    /* The hint is the exact size the same call needs to succeed */
+    if (size > INT32_MAX)
+        return 0;
+    if (size > (size_t)maxout)
+        return -(int)size;
+    return (int)size;
 }
 
 /* ========================================================================
  * Public API: Utility Functions
  * ======================================================================== */
 
-uint32_t yaz0_get_decompressed_size(const void* input)
+FASTYZ_API uint32_t yaz0_get_decompressed_size(const void* input)
 {
     /* Validate magic */
     if (!yaz0_is_valid(input))
@@ -566,7 +4459,7 @@ uint32_t yaz0_get_decompressed_size(const void* input)
            ((uint32_t)src[7]);
 }
 
-int yaz0_is_valid(const void* input)
+FASTYZ_API int yaz0_is_valid(const void* input)
 {
     const uint8_t* src = (const uint8_t*)input;
     return (src[0] == 'Y' && src[1] == 'a' && src[2] == 'z' && src[3] == '0');
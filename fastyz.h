@@ -21,8 +21,47 @@
 
 #define FASTYZ_VERSION_STRING "1.0.0"
 
+#include <stddef.h>
 #include <stdint.h>
 
+#if defined(_WIN32)
+#if !defined(FASTYZ_HAVE_IOVEC)
+#define FASTYZ_HAVE_IOVEC
+/* POSIX scatter/gather buffer descriptor, for yaz0_compressv() */
+struct iovec
+{
+    void* iov_base;
+    size_t iov_len;
+};
+#endif
+#else
+#include <sys/uio.h>
+#endif
+
+/*
+ * Linkage of the public functions.
+ *
+ * FASTYZ_SHARED: using (or, with FASTYZ_BUILD, building) the shared library.
+ * FASTYZ_STATIC: compiling the library into the including translation unit
+ *                with fastyz_impl.h; the functions become static inline so
+ *                the compiler can inline and specialize them per call site.
+ */
+#if !defined(FASTYZ_API)
+#if defined(FASTYZ_STATIC)
+#define FASTYZ_API static inline
+#elif defined(FASTYZ_SHARED) && defined(_WIN32)
+#if defined(FASTYZ_BUILD)
+#define FASTYZ_API __declspec(dllexport)
+#else
+#define FASTYZ_API __declspec(dllimport)
+#endif
+#elif defined(FASTYZ_SHARED) && defined(__GNUC__) && __GNUC__ >= 4
+#define FASTYZ_API __attribute__((visibility("default")))
+#else
+#define FASTYZ_API
+#endif
+#endif
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -83,6 +122,14 @@ extern "C" {
  */
 #define FASTYZ_BOUND(length) (YAZ0_HEADER_SIZE + (length) + ((length) / 8) + 1)
 
+/**
+ * Largest input the Yaz0 format can describe.
+ * The header stores the decompressed size as a 32-bit unsigned value, so
+ * streams are limited to 4 GiB - 1 bytes. The int-based functions are
+ * further limited to 2 GiB - 1; use the size_t-based ones in between.
+ */
+#define YAZ0_MAX_INPUT_SIZE 0xFFFFFFFFu
+
 /**
  * Compress a block of data using Yaz0 compression.
  *
@@ -105,7 +152,857 @@ extern "C" {
  * @note The input and output buffers must not overlap.
  * @note The output includes the 16-byte Yaz0 header.
  */
-int yaz0_compress(const void* input, int length, void* output);
+FASTYZ_API int yaz0_compress(const void* input, int length, void* output);
+
+/** Use one match search strategy for the whole input (default) */
+#define YAZ0_STRATEGY_FIXED 0
+
+/** Classify each 64 KiB region and pick a match search strategy for it */
+#define YAZ0_STRATEGY_ADAPTIVE 1
+
+/**
+ * Compression parameters for yaz0_compress_ex().
+ *
+ * Always initialize with yaz0_params_init() before changing individual
+ * fields, so that fields added in later versions get their defaults.
+ */
+typedef struct
+{
+    /**
+     * Match search alignment in bytes: 1 (default), 2, 4, 8 or 16.
+     *
+     * Only input positions that are a multiple of the alignment are hashed
+     * and inserted into the match table, which cuts match search work on
+     * arrays of fixed-size records. Matches themselves are still parsed at
+     * byte granularity. Set to 0 to detect the alignment automatically with
+     * yaz0_detect_alignment(), which also chooses alignment_phase.
+     */
+    int alignment;
+
+    /**
+     * Offset within each record at which positions are probed, in the range
+     * [0, alignment). Default 0. Ignored when alignment is 0.
+     */
+    int alignment_phase;
+
+    /**
+     * Balance between compression ratio and decoding cost, 0-9. Default 0.
+     *
+     * 0 optimizes for ratio only. Higher values favor streams that decode
+     * faster: short matches between literals are avoided, overlapping
+     * matches are moved to a non-overlapping distance where possible (so
+     * decoders can use wide copies), and the number of match tokens per KiB
+     * of input is capped more tightly. The output is always a standard
+     * Yaz0 stream.
+     */
+    int decode_speed;
+
+    /**
+     * Compression level, 0-9. Default 0.
+     *
+     * 0 is the fast greedy search used by yaz0_compress(). Levels 1-9 use a
+     * hash chain parser that compares more candidates per position (and, from
+     * level 4, defers a match by one byte when the next is longer), trading
+     * speed for ratio. The chain parser visits every position, so alignment
+     * is ignored at levels above 0.
+     */
+    int level;
+
+    /**
+     * Match search strategy: YAZ0_STRATEGY_FIXED (default) or
+     * YAZ0_STRATEGY_ADAPTIVE.
+     *
+     * In adaptive mode a sample of every 64 KiB region is classified as
+     * incompressible, run-heavy, record-structured or generic, and the
+     * region is compressed with a search suited to it: a sparse probe for
+     * incompressible data, the fast greedy search for runs, an aligned
+     * search (with the detected stride) for records and the search selected
+     * by 'level' otherwise. All regions share one match table and are
+     * written as one continuous stream. 'alignment' and 'alignment_phase'
+     * are chosen per region and ignored in this mode.
+     */
+    int strategy;
+} yaz0_params_t;
+
+/**
+ * Initialize compression parameters to their defaults.
+ *
+ * The defaults make yaz0_compress_ex() produce exactly the same output as
+ * yaz0_compress().
+ *
+ * @param params  Pointer to the parameters to initialize
+ */
+FASTYZ_API void yaz0_params_init(yaz0_params_t* params);
+
+/**
+ * Compress a block of data using Yaz0 compression with explicit parameters.
+ *
+ * Behaves like yaz0_compress(), but the match search is configured by
+ * 'params'. The output is a standard Yaz0 stream regardless of parameters.
+ *
+ * @param input   Pointer to the input data to compress
+ * @param length  Size of the input data in bytes
+ * @param output  Pointer to the output buffer for compressed data
+ *                Must be at least FASTYZ_BOUND(length) bytes
+ * @param params  Compression parameters (see yaz0_params_init())
+ *
+ * @return        Size of the compressed data in bytes,
+ *                or 0 if compression failed (e.g. invalid parameters)
+ */
+FASTYZ_API int yaz0_compress_ex(const void* input, int length, void* output, const yaz0_params_t* params);
+
+/**
+ * Compress inputs of up to YAZ0_MAX_INPUT_SIZE bytes.
+ *
+ * Same as yaz0_compress(), but with size_t lengths, so inputs between
+ * 2 GiB and 4 GiB (and their compressed output, which can be larger still)
+ * are handled. Requires a 64-bit platform for inputs of that size.
+ *
+ * @param input   Pointer to the input data to compress
+ * @param length  Size of the input data in bytes
+ * @param output  Pointer to the output buffer for compressed data
+ *                Must be at least FASTYZ_BOUND(length) bytes
+ *
+ * @return        Size of the compressed data in bytes,
+ *                or 0 if length exceeds YAZ0_MAX_INPUT_SIZE
+ */
+FASTYZ_API size_t yaz0_compress64(const void* input, size_t length, void* output);
+
+/**
+ * Compress inputs of up to YAZ0_MAX_INPUT_SIZE bytes with explicit parameters.
+ *
+ * Same as yaz0_compress_ex(), but with size_t lengths (see yaz0_compress64()).
+ *
+ * @param input   Pointer to the input data to compress
+ * @param length  Size of the input data in bytes
+ * @param output  Pointer to the output buffer for compressed data
+ *                Must be at least FASTYZ_BOUND(length) bytes
+ * @param params  Compression parameters (see yaz0_params_init())
+ *
+ * @return        Size of the compressed data in bytes, or 0 if the
+ *                parameters are invalid or length exceeds YAZ0_MAX_INPUT_SIZE
+ */
+FASTYZ_API size_t yaz0_compress_ex64(const void* input, size_t length, void* output, const yaz0_params_t* params);
+
+/**
+ * Memory allocation hooks for contexts (e.g. arena, pool or huge-page
+ * allocators). Allocations must be suitably aligned for any type, like
+ * malloc().
+ *
+ * The _cctx variants of functions that need buffers sized by their input
+ * (yaz0_compressv_cctx(), yaz0_train_dict_cctx(), yaz0_recompress_cctx())
+ * take them from the context's allocator and release them before
+ * returning. yaz0_compress_safe(), yaz0_compress_destsize(),
+ * yaz0_compress_fit(), yaz0_estimate_size() and yaz0_compress_pipelined()
+ * keep their buffers on the stack and allocate nothing.
+ */
+typedef struct
+{
+    void* (*alloc)(void* user, size_t size);  /**< Allocate 'size' bytes, NULL on failure */
+    void (*free)(void* user, void* ptr);      /**< Release memory from alloc() */
+    void* user;                               /**< Passed to both functions */
+} yaz0_allocator_t;
+
+/**
+ * Compression context holding the match tables (about 80 KiB with the
+ * default HASH_LOG), which yaz0_compress_ex() otherwise keeps on the stack.
+ * A context may be reused for any number of compressions, but by only one
+ * thread at a time.
+ */
+typedef struct yaz0_cctx yaz0_cctx_t;
+
+/**
+ * Size of a caller-provided workspace for yaz0_cctx_init().
+ *
+ * @return  Bytes needed (any alignment accepted)
+ */
+FASTYZ_API size_t yaz0_cctx_workspace_size(void);
+
+/**
+ * Allocate a compression context.
+ *
+ * @param allocator  Allocation hooks for the context and its per-call
+ *                   buffers, or NULL for malloc()/free()
+ *
+ * @return           The context (release with yaz0_cctx_free()),
+ *                   or NULL if the allocation failed
+ */
+FASTYZ_API yaz0_cctx_t* yaz0_cctx_create(const yaz0_allocator_t* allocator);
+
+/**
+ * Create a compression context inside caller-provided memory, so that
+ * compression performs no heap allocations at all. The workspace must
+ * stay valid while the context is used; nothing needs to be released.
+ * Such a context has no allocator: the _cctx variants that need per-call
+ * buffers get them from malloc().
+ *
+ * @param workspace  Memory for the context
+ * @param size       Size of the workspace, at least yaz0_cctx_workspace_size()
+ *
+ * @return           The context, or NULL if the workspace is too small
+ */
+FASTYZ_API yaz0_cctx_t* yaz0_cctx_init(void* workspace, size_t size);
+
+/**
+ * Release a context from yaz0_cctx_create(). Does nothing for contexts from
+ * yaz0_cctx_init() or for NULL.
+ *
+ * @param cctx  Context to release
+ */
+FASTYZ_API void yaz0_cctx_free(yaz0_cctx_t* cctx);
+
+/**
+ * Compress using a context; same output as yaz0_compress_ex64() unless
+ * progress reporting is set (see yaz0_cctx_set_progress()).
+ *
+ * @param cctx    Compression context
+ * @param input   Pointer to the input data to compress
+ * @param length  Size of the input data in bytes
+ * @param output  Pointer to the output buffer for compressed data
+ *                Must be at least FASTYZ_BOUND(length) bytes
+ * @param params  Compression parameters, or NULL for the defaults
+ *
+ * @return        Size of the compressed data in bytes, or 0 if the
+ *                parameters are invalid or length exceeds YAZ0_MAX_INPUT_SIZE
+ *
+ * @note Decompression never allocates memory and needs no context.
+ */
+FASTYZ_API size_t yaz0_compress_cctx(yaz0_cctx_t* cctx, const void* input, size_t length, void* output,
+                                     const yaz0_params_t* params);
+
+/**
+ * Progress callback. 'consumed' and 'produced' are the input and output
+ * bytes processed so far (totals, not increments).
+ *
+ * @return  0 to continue, nonzero to cancel the operation
+ */
+typedef int (*yaz0_progress_fn)(void* user, size_t consumed, size_t produced);
+
+/** Default reporting interval of yaz0_progress_t (1 MiB) */
+#define YAZ0_PROGRESS_INTERVAL (1u << 20)
+
+/**
+ * Progress reporting for long-running operations.
+ *
+ * The callback is invoked each time at least 'interval' more bytes have
+ * been consumed and once when the operation completes, on the calling
+ * thread (batch operations: on any worker thread, one call at a time).
+ * When it returns nonzero the operation stops at the next chunk boundary
+ * and reports failure (0); the output buffer then holds no usable stream.
+ */
+typedef struct
+{
+    yaz0_progress_fn callback;  /**< Called with progress; NULL for none */
+    void* user;                 /**< Passed to the callback */
+    size_t interval;            /**< Input bytes between calls (0 for YAZ0_PROGRESS_INTERVAL) */
+} yaz0_progress_t;
+
+/**
+ * Compress with progress reporting and cancellation.
+ *
+ * The input is searched in chunks of 'interval' bytes with the callback
+ * invoked between them. Chunking may change the stream slightly compared
+ * to yaz0_compress_ex64(); without a callback the output is identical.
+ *
+ * @param input     Pointer to the input data to compress
+ * @param length    Size of the input data in bytes
+ * @param output    Pointer to the output buffer for compressed data
+ *                  Must be at least FASTYZ_BOUND(length) bytes
+ * @param params    Compression parameters, or NULL for the defaults
+ * @param progress  Progress reporting, or NULL for none
+ *
+ * @return          Size of the compressed data in bytes, or 0 if the
+ *                  parameters are invalid, length exceeds YAZ0_MAX_INPUT_SIZE
+ *                  or the callback cancelled
+ */
+FASTYZ_API size_t yaz0_compress_progress(const void* input, size_t length, void* output, const yaz0_params_t* params,
+                                         const yaz0_progress_t* progress);
+
+/**
+ * Report progress from every yaz0_compress_cctx() call made with a context
+ * (see yaz0_compress_progress()).
+ *
+ * @param cctx      Compression context
+ * @param progress  Progress reporting (copied), or NULL to stop reporting
+ */
+FASTYZ_API void yaz0_cctx_set_progress(yaz0_cctx_t* cctx, const yaz0_progress_t* progress);
+
+/**
+ * Per-stage timing of a pipelined compression.
+ *
+ * The busy time of each stage shows how well the work splits: the pipeline
+ * can be at most (search_seconds + encode_seconds) / max(search_seconds,
+ * encode_seconds) times faster than a single thread. A stage that spends
+ * most of its time waiting is fed by (or feeding) the bottleneck stage.
+ */
+typedef struct
+{
+    double total_seconds;        /**< Wall-clock time of the whole call */
+    double search_seconds;       /**< Match finder busy time */
+    double encode_seconds;       /**< Encoder busy time */
+    double search_wait_seconds;  /**< Match finder time blocked on a full ring */
+    double encode_wait_seconds;  /**< Encoder time blocked on an empty ring */
+    uint64_t tokens;             /**< Tokens passed between the stages */
+    uint32_t search_stalls;      /**< Times the match finder found the ring full */
+    uint32_t encode_stalls;      /**< Times the encoder found the ring empty */
+} yaz0_pipeline_stats_t;
+
+/**
+ * Compress a block of data using a two-stage pipeline.
+ *
+ * The calling thread runs the match search and publishes tokens (literal
+ * run, match length, distance) into a lock-free single-producer/single-
+ * consumer ring; a second thread serializes them into flag groups. The
+ * output is byte-for-byte identical to yaz0_compress_ex() with the same
+ * parameters.
+ *
+ * If threads are unavailable (built with FASTYZ_NO_THREADS, or thread
+ * creation fails) the compression runs on the calling thread.
+ *
+ * @param input   Pointer to the input data to compress
+ * @param length  Size of the input data in bytes
+ * @param output  Pointer to the output buffer for compressed data
+ *                Must be at least FASTYZ_BOUND(length) bytes
+ * @param params  Compression parameters (see yaz0_params_init())
+ * @param stats   Receives per-stage timing (may be NULL)
+ *
+ * @return        Size of the compressed data in bytes,
+ *                or 0 if compression failed
+ */
+FASTYZ_API int yaz0_compress_pipelined(const void* input, int length, void* output, const yaz0_params_t* params,
+                                       yaz0_pipeline_stats_t* stats);
+
+/**
+ * Compress a block of data within a time budget.
+ *
+ * The input is compressed in 16 KiB chunks, starting with the fast search
+ * of yaz0_compress(). After every chunk the measured cost per byte is
+ * compared with the time left: effort is raised step by step (through
+ * compression levels 1-9) while there is ample headroom, and lowered (down
+ * to probing every 16th position) when the deadline is at risk. If the
+ * budget runs out, the rest of the input is stored as literals, so a valid
+ * standard stream is always returned. The deadline may be overshot by the
+ * time of one chunk plus the final literal copy.
+ *
+ * For a throughput target of R MB/s, pass seconds = length / (R * 1e6).
+ *
+ * @param input    Pointer to the input data to compress
+ * @param length   Size of the input data in bytes
+ * @param output   Pointer to the output buffer for compressed data
+ *                 Must be at least FASTYZ_BOUND(length) bytes
+ * @param params   Compression parameters; only decode_speed applies, the
+ *                 search is chosen by the budget
+ * @param seconds  Time budget for the whole call
+ *
+ * @return         Size of the compressed data in bytes,
+ *                 or 0 if compression failed
+ */
+FASTYZ_API int yaz0_compress_budget(const void* input, int length, void* output, const yaz0_params_t* params, double seconds);
+
+/**
+ * Compress a block of data into at most 'target' bytes, using as little
+ * effort as possible.
+ *
+ * Levels are tried in increasing order starting at params->level, and the
+ * first one whose output fits is returned. Each attempt is abandoned as
+ * soon as its output exceeds the target. For larger inputs the size at
+ * every level is first estimated from a few sampled windows: levels that
+ * are clearly too large are skipped, and the call fails at once if even
+ * level 9 is estimated to be well above the target. The output is the
+ * same as yaz0_compress_ex() produces at the returned level.
+ *
+ * @param input   Pointer to the input data to compress
+ * @param length  Size of the input data in bytes
+ * @param output  Pointer to the output buffer for compressed data
+ *                Must be at least FASTYZ_BOUND(length) bytes
+ * @param target  Maximum size of the compressed data, including the header
+ * @param params  Compression parameters; 'level' is the first level tried,
+ *                'strategy' is ignored
+ * @param level   Receives the level used, or -1 on failure (may be NULL)
+ *
+ * @return        Size of the compressed data in bytes,
+ *                or 0 if it cannot be made to fit
+ */
+FASTYZ_API int yaz0_compress_fit(const void* input, int length, void* output, int target, const yaz0_params_t* params,
+                                 int* level);
+
+/**
+ * Result of yaz0_estimate_size().
+ */
+typedef struct
+{
+    int size;            /**< Estimated compressed size in bytes, including the header */
+    int low;             /**< Lower end of the ~95% confidence interval */
+    int high;            /**< Upper end of the ~95% confidence interval */
+    int incompressible;  /**< Nonzero if compression is unlikely to save 1/32 of the input */
+} yaz0_estimate_t;
+
+/**
+ * Estimate the compressed size of a block of data without compressing it.
+ *
+ * About 1/32 of the input (8 to 64 windows of 8 KiB, spread evenly, each
+ * with 4 KiB of history) is compressed with the match search of the given
+ * level, and the mean ratio is extrapolated to the whole input. The
+ * confidence interval is two standard errors of the per-window ratio plus
+ * a small allowance for matches cut at window edges.
+ * Inputs too small to sample usefully are compressed in full, giving an
+ * exact result; no output buffer is needed either way.
+ *
+ * @param input     Pointer to the input data
+ * @param length    Size of the input data in bytes
+ * @param level     Compression level to estimate, 0-9 (see yaz0_params_t)
+ * @param estimate  Receives the estimate and its confidence interval
+ *                  (may be NULL)
+ *
+ * @return          Estimated compressed size in bytes,
+ *                  or 0 if the arguments are invalid
+ */
+FASTYZ_API int yaz0_estimate_size(const void* input, int length, int level, yaz0_estimate_t* estimate);
+
+/**
+ * Compress as much of the input as fits into a fixed-size output buffer.
+ *
+ * The input is compressed with the fast search of yaz0_compress() until
+ * the next token would not fit into 'out_cap' bytes. The header records
+ * the number of input bytes consumed, so the output is a complete stream
+ * of that prefix; the caller continues with the rest of the input.
+ *
+ * @param input    Pointer to the input data to compress
+ * @param in_len   In: size of the input data in bytes.
+ *                 Out: number of input bytes consumed.
+ * @param output   Pointer to the output buffer for compressed data
+ * @param out_cap  Size of the output buffer in bytes
+ *
+ * @return         Size of the compressed data in bytes (at most out_cap),
+ *                 or 0 if compression failed
+ */
+FASTYZ_API int yaz0_compress_destsize(const void* input, int* in_len, void* output, int out_cap);
+
+/**
+ * Compress a block of data into an output buffer of any size.
+ *
+ * Unlike yaz0_compress(), the output buffer does not have to hold
+ * FASTYZ_BOUND(length) bytes: capacity is checked as flag groups are
+ * written and nothing is written past 'maxout'. If the stream does not
+ * fit, the rest of the input is still compressed (without being written)
+ * to measure it, and the exact size needed is returned as a negative
+ * number, so a buffer sized from a predicted ratio can be retried once:
+ * the same input with a buffer of that size produces the same stream.
+ *
+ * @param input   Pointer to the input data to compress
+ * @param length  Size of the input data in bytes
+ * @param output  Pointer to the output buffer for compressed data
+ * @param maxout  Size of the output buffer in bytes
+ *
+ * @return        Size of the compressed data in bytes; if it does not fit,
+ *                minus the required output size; 0 if compression failed
+ */
+FASTYZ_API int yaz0_compress_safe(const void* input, int length, void* output, int maxout);
+
+/**
+ * Compress the concatenation of several buffers as one stream.
+ *
+ * The output is the same kind of stream yaz0_compress() would produce for
+ * the buffers copied end to end, and matches may reach across buffer
+ * boundaries, but the input is never gathered into one block: runs inside
+ * a buffer are compressed in place, and only the bytes around each
+ * boundary (with up to 4096 bytes of history) pass through a small stack
+ * buffer.
+ *
+ * @param iov     Array of input buffers; empty buffers are allowed
+ * @param iovcnt  Number of buffers
+ * @param output  Pointer to the output buffer for compressed data
+ *                Must be at least FASTYZ_BOUND(total length) bytes
+ *
+ * @return        Size of the compressed data in bytes,
+ *                or 0 if compression failed (including a total length
+ *                that does not fit in an int)
+ */
+FASTYZ_API int yaz0_compressv(const struct iovec* iov, int iovcnt, void* output);
+
+/**
+ * yaz0_compressv() using a context's match table, with the list of
+ * buffers (16 bytes per buffer) from its allocator.
+ *
+ * @param cctx    Compression context
+ * @param iov     Array of input buffers; empty buffers are allowed
+ * @param iovcnt  Number of buffers
+ * @param output  Pointer to the output buffer for compressed data
+ *                Must be at least FASTYZ_BOUND(total length) bytes
+ *
+ * @return        Size of the compressed data in bytes,
+ *                or 0 if compression failed
+ */
+FASTYZ_API int yaz0_compressv_cctx(yaz0_cctx_t* cctx, const struct iovec* iov, int iovcnt, void* output);
+
+/**
+ * Detect the record alignment of structured binary data.
+ *
+ * Samples the input and measures byte autocorrelation at lags 1, 2, 4, 8
+ * and 16. Data made of fixed-size records shows a clear peak at the record
+ * size (or a divisor of it). The phase is the offset within each record
+ * where repeated sequences most often start.
+ *
+ * @param input   Pointer to the data to analyze
+ * @param length  Size of the data in bytes
+ * @param phase   Receives the detected phase (may be NULL)
+ *
+ * @return        Detected alignment (2, 4, 8 or 16),
+ *                or 1 if the data shows no record structure
+ */
+FASTYZ_API int yaz0_detect_alignment(const void* input, int length, int* phase);
+
+/**
+ * Compress a block of data using a preset dictionary.
+ *
+ * The dictionary is treated as if it immediately preceded the input: it
+ * primes the 4096-byte match window but is not emitted. Only the last 4096
+ * bytes of a larger dictionary are used.
+ *
+ * The output has a standard Yaz0 header and token format, but its back-
+ * references may reach into the dictionary, so it can only be decompressed
+ * with yaz0_decompress_dict() and the same dictionary. Use this for formats
+ * where both ends are under your control.
+ *
+ * @param input      Pointer to the input data to compress
+ * @param length     Size of the input data in bytes
+ * @param output     Pointer to the output buffer for compressed data
+ *                   Must be at least FASTYZ_BOUND(length) bytes
+ * @param dict       Pointer to the dictionary
+ * @param dict_size  Size of the dictionary in bytes (0 for none)
+ *
+ * @return           Size of the compressed data in bytes,
+ *                   or 0 if compression failed
+ */
+FASTYZ_API int yaz0_compress_dict(const void* input, int length, void* output, const void* dict, int dict_size);
+
+/**
+ * Decompress data produced by yaz0_compress_dict().
+ *
+ * @param input      Pointer to the compressed Yaz0 data (including header)
+ * @param length     Size of the compressed data in bytes
+ * @param output     Pointer to the output buffer for decompressed data
+ * @param maxout     Maximum size of the output buffer in bytes
+ * @param dict       Pointer to the dictionary used for compression
+ * @param dict_size  Size of the dictionary in bytes
+ *
+ * @return           Size of the decompressed data in bytes,
+ *                   or 0 if decompression failed
+ */
+FASTYZ_API int yaz0_decompress_dict(const void* input, int length, void* output, int maxout, const void* dict, int dict_size);
+
+/**
+ * Decompress Yaz0 data into a list of destination buffers.
+ *
+ * The decompressed data is written across the buffers in order, each
+ * filled completely before the next (empty buffers are skipped), so it can
+ * land directly in its final locations. Back-references that reach into
+ * earlier buffers are resolved from them, so those must stay untouched
+ * until the call returns; only the last 4096 bytes are ever read.
+ *
+ * @param input   Pointer to the compressed data (including header)
+ * @param length  Size of the compressed data in bytes
+ * @param iov     Array of destination buffers
+ * @param iovcnt  Number of buffers; their total size must be at least
+ *                the decompressed size
+ *
+ * @return        Number of bytes decompressed,
+ *                or 0 if decompression failed
+ */
+FASTYZ_API int yaz0_decompressv(const void* input, int length, const struct iovec* iov, int iovcnt);
+
+/**
+ * Token stream of a Yaz0 stream, in structure-of-arrays layout.
+ *
+ * Token i is a run of literals[i] literal bytes followed by a match of
+ * length[i] bytes copied from distance[i] bytes back; a length of 0 means
+ * the run is not followed by a match (e.g. the end of the stream). The
+ * arrays are owned by the caller and hold 'capacity' entries each.
+ */
+typedef struct
+{
+    uint32_t* literals;  /**< Literal bytes before each match */
+    uint32_t* length;    /**< Match lengths (3 or more), 0 for none */
+    uint16_t* distance;  /**< Match distances (1-4096) */
+    int count;           /**< Number of tokens */
+    int capacity;        /**< Entries available in each array */
+} yaz0_tokens_t;
+
+/**
+ * Maximum number of tokens in a stream of 'size' decompressed bytes.
+ *
+ * @param size  Decompressed size (see yaz0_get_decompressed_size())
+ * @return      Token array capacity that is always sufficient
+ */
+#define YAZ0_TOKEN_BOUND(size) ((size) / YAZ0_MIN_MATCH_LENGTH + 1)
+
+/**
+ * Split a Yaz0 stream into tokens.
+ *
+ * Every match of the stream becomes one token, with the literals before
+ * it; matches are reported as stored (at most YAZ0_MAX_MATCH_LENGTH bytes).
+ * Literal bytes themselves are not copied: they are the bytes of the
+ * decompressed data at the run's position.
+ *
+ * @param input   Pointer to the compressed data (including header)
+ * @param length  Size of the compressed data in bytes
+ * @param tokens  Token arrays to fill; 'count' is set on success
+ *
+ * @return        Number of tokens, the negated number needed if
+ *                'capacity' is too small, or 0 if the stream is malformed
+ */
+FASTYZ_API int yaz0_parse_tokens(const void* input, int length, yaz0_tokens_t* tokens);
+
+/**
+ * Serialize tokens into a Yaz0 stream.
+ *
+ * Flag grouping and the splitting of matches longer than
+ * YAZ0_MAX_MATCH_LENGTH are those of the built-in compressor, so tokens
+ * from any match finder (or from yaz0_parse_tokens()) produce a valid
+ * stream. Matches may overlap their own output (distance < length).
+ *
+ * @param tokens  Tokens to encode; they must cover exactly 'length' bytes
+ * @param data    The uncompressed data the tokens describe
+ * @param length  Size of the uncompressed data in bytes
+ * @param output  Pointer to the output buffer for compressed data
+ *                Must be at least FASTYZ_BOUND(length) bytes
+ *
+ * @return        Size of the compressed data in bytes, or 0 if a token is
+ *                invalid (match shorter than 3 bytes, distance outside
+ *                1-4096 or before the start) or the tokens do not cover
+ *                exactly 'length' bytes
+ */
+FASTYZ_API int yaz0_encode_tokens(const yaz0_tokens_t* tokens, const void* data, int length, void* output);
+
+/**
+ * Train a preset dictionary from a corpus of samples.
+ *
+ * Selects segments of content that recur across many samples and measures
+ * several candidate dictionaries by compressing the samples with them,
+ * keeping the one with the smallest total output.
+ *
+ * @param dict           Pointer to the output buffer for the dictionary
+ * @param dict_capacity  Size of the dictionary buffer (at most 4096 is used)
+ * @param samples        Pointer to all samples, stored back to back
+ * @param sample_sizes   Size of each sample in bytes
+ * @param num_samples    Number of samples
+ *
+ * @return               Size of the trained dictionary in bytes,
+ *                       or 0 if no useful dictionary could be built
+ */
+FASTYZ_API int yaz0_train_dict(void* dict, int dict_capacity, const void* samples, const int* sample_sizes, int num_samples);
+
+/**
+ * yaz0_train_dict() with its working memory (12 MiB of d-mer tables plus
+ * FASTYZ_BOUND() of the largest sample) from a context's allocator.
+ *
+ * @param cctx           Context whose allocator is used
+ * @param dict           Pointer to the output buffer for the dictionary
+ * @param dict_capacity  Size of the dictionary buffer (at most 4096 is used)
+ * @param samples        Pointer to all samples, stored back to back
+ * @param sample_sizes   Size of each sample in bytes
+ * @param num_samples    Number of samples
+ *
+ * @return               Size of the trained dictionary in bytes,
+ *                       or 0 if no useful dictionary could be built
+ */
+FASTYZ_API int yaz0_train_dict_cctx(yaz0_cctx_t* cctx, void* dict, int dict_capacity, const void* samples,
+                                    const int* sample_sizes, int num_samples);
+
+/**
+ * Recompress an edited version of previously compressed data.
+ *
+ * Runs of the new input that are unchanged from the old input (at the same
+ * offset, or shifted by an insertion or deletion) are not searched again:
+ * their tokens are copied from the old compressed stream, whole flag groups
+ * at a time where possible. Only the changed spans, plus 4096 bytes of
+ * history after each change, go through the match finder, so rebuilding
+ * after a small edit costs about as much as walking the old stream's flag
+ * groups. Malformed parts of the old stream are compressed from scratch.
+ *
+ * @param old_input              Pointer to the previous uncompressed data
+ * @param old_length             Size of the previous data in bytes
+ * @param old_compressed         Yaz0 stream of old_input (any encoder)
+ * @param old_compressed_length  Size of the Yaz0 stream in bytes
+ * @param new_input              Pointer to the edited data
+ * @param new_length             Size of the edited data in bytes
+ * @param output                 Pointer to the output buffer for compressed data
+ *                               Must be at least FASTYZ_BOUND(new_length) bytes
+ *
+ * @return                       Size of the compressed data in bytes,
+ *                               or 0 if the old stream's header is invalid or
+ *                               does not give old_length as its size
+ *
+ * @note old_compressed must be the compressed form of old_input; the token
+ *       bytes are trusted and not checked against it.
+ */
+FASTYZ_API int yaz0_recompress_incremental(const void* old_input, int old_length, const void* old_compressed, int old_compressed_length,
+                                           const void* new_input, int new_length, void* output);
+
+/**
+ * Re-encode a Yaz0 stream produced by any encoder.
+ *
+ * The stream is decoded and re-encoded chunk by chunk with the hash chain
+ * parser (params->level, at least 1), so memory use does not depend on the
+ * size of the data. The matches of the existing stream are offered to the
+ * parser as extra candidates, so the result keeps what the original
+ * encoder found and improves on it where the parser finds longer matches.
+ * params->decode_speed can be used to make the stream cheaper to decode.
+ *
+ * The result is never larger than the input: if re-encoding does not
+ * produce a smaller stream, the input is copied to the output unchanged.
+ *
+ * @param input   Pointer to the Yaz0 stream (including header)
+ * @param length  Size of the stream in bytes
+ * @param output  Pointer to the output buffer, at least 'length' bytes
+ * @param maxout  Size of the output buffer in bytes
+ * @param params  Compression parameters (see yaz0_params_init())
+ *
+ * @return        Size of the output in bytes (equal to 'length' if the input
+ *                was kept), or 0 if the stream is invalid or 'maxout' is
+ *                smaller than 'length'
+ */
+FASTYZ_API int yaz0_recompress(const void* input, int length, void* output, int maxout, const yaz0_params_t* params);
+
+/**
+ * yaz0_recompress() using a context's match tables, with the decoding
+ * window and staging buffers (about 400 KiB) from its allocator.
+ *
+ * @param cctx    Compression context
+ * @param input   Pointer to the Yaz0 stream (including header)
+ * @param length  Size of the stream in bytes
+ * @param output  Pointer to the output buffer, at least 'length' bytes
+ * @param maxout  Size of the output buffer in bytes
+ * @param params  Compression parameters (see yaz0_params_init())
+ *
+ * @return        Size of the output in bytes, or 0 if the stream is
+ *                invalid, 'maxout' is smaller than 'length' or an
+ *                allocation failed
+ */
+FASTYZ_API int yaz0_recompress_cctx(yaz0_cctx_t* cctx, const void* input, int length, void* output, int maxout,
+                                    const yaz0_params_t* params);
+
+/**
+ * One stream for yaz0_recompress_batch().
+ */
+typedef struct
+{
+    const void* input;  /**< Yaz0 stream to re-encode */
+    int length;         /**< Size of the stream in bytes */
+    void* output;       /**< Output buffer of at least 'length' bytes */
+    int result;         /**< Set to the yaz0_recompress() return value */
+} yaz0_recompress_job_t;
+
+/**
+ * Re-encode many Yaz0 streams in parallel with yaz0_recompress().
+ *
+ * Jobs with identical input are re-encoded once and the result is copied
+ * to the others.
+ *
+ * @param jobs     Streams to re-encode; 'result' is filled in for each
+ * @param count    Number of jobs
+ * @param params   Compression parameters shared by all jobs
+ * @param threads  Number of threads (0 for one per processor)
+ */
+FASTYZ_API void yaz0_recompress_batch(yaz0_recompress_job_t* jobs, int count, const yaz0_params_t* params, int threads);
+
+/**
+ * yaz0_recompress_batch() with progress reporting and cancellation.
+ *
+ * Progress counts whole jobs: 'consumed' is the total input length and
+ * 'produced' the total output size of the finished jobs. After a cancel,
+ * jobs already running complete; jobs not yet started get a result of 0.
+ *
+ * @param jobs      Streams to re-encode; 'result' is filled in for each
+ * @param count     Number of jobs
+ * @param params    Compression parameters shared by all jobs
+ * @param threads   Number of threads (0 for one per processor)
+ * @param progress  Progress reporting, or NULL for none
+ *
+ * @return          0 if all jobs ran, or nonzero if the callback cancelled
+ */
+FASTYZ_API int yaz0_recompress_batch_progress(yaz0_recompress_job_t* jobs, int count, const yaz0_params_t* params,
+                                              int threads, const yaz0_progress_t* progress);
+
+/** Size of a yaz0_cache_key_t in bytes */
+#define YAZ0_CACHE_KEY_SIZE 16
+
+/** Cache key of compressing raw data (yaz0_compress_ex64() and yaz0_compress_cctx()) */
+#define YAZ0_CACHE_COMPRESS 0
+
+/** Cache key of re-encoding a Yaz0 stream (yaz0_recompress()) */
+#define YAZ0_CACHE_RECOMPRESS 1
+
+/**
+ * Content key of an operation's output, for caching outputs across runs.
+ */
+typedef struct
+{
+    uint8_t bytes[YAZ0_CACHE_KEY_SIZE];
+} yaz0_cache_key_t;
+
+/**
+ * Compute the cache key of an operation on 'input'.
+ *
+ * The key is a 128-bit hash of the input bytes, the operation, every field
+ * of 'params', the library version and the match table size the library
+ * was built with, so equal keys mean that the operation produces the same
+ * output. The hash runs at memory speed and is the same on every host,
+ * but it is not cryptographic: do not share a cache with untrusted writers.
+ *
+ * @param key        Receives the key
+ * @param operation  YAZ0_CACHE_COMPRESS or YAZ0_CACHE_RECOMPRESS
+ * @param input      Pointer to the input data
+ * @param length     Size of the input data in bytes
+ * @param params     Parameters of the operation (see yaz0_params_init())
+ */
+FASTYZ_API void yaz0_cache_key(yaz0_cache_key_t* key, int operation, const void* input, size_t length,
+                               const yaz0_params_t* params);
+
+/**
+ * Storage for yaz0_recompress_batch_cached(), such as a directory of files.
+ * Both hooks are called from the worker threads, possibly at the same time.
+ */
+typedef struct
+{
+    /**
+     * Copy the stored output for 'key' into 'output'.
+     *
+     * @return  Size of the stored output, or 0 if there is none or it is
+     *          larger than 'maxout'
+     */
+    size_t (*lookup)(void* user, const yaz0_cache_key_t* key, void* output, size_t maxout);
+
+    /** Store the output of a re-encoded job (NULL to only read the cache) */
+    void (*store)(void* user, const yaz0_cache_key_t* key, const void* data, size_t size);
+
+    void* user;  /**< Passed to the hooks */
+} yaz0_cache_t;
+
+/**
+ * yaz0_recompress_batch_progress() with a cache of re-encoded streams.
+ *
+ * Each job's input is keyed with yaz0_cache_key(YAZ0_CACHE_RECOMPRESS).
+ * A stored output is copied instead of re-encoding the job if it fits the
+ * job's output buffer and records the same decompressed size. Otherwise
+ * the job is re-encoded and the result stored. Duplicate inputs in the
+ * batch are looked up and re-encoded once.
+ *
+ * @param jobs       Streams to re-encode; 'result' is filled in for each
+ * @param count      Number of jobs
+ * @param params     Compression parameters shared by all jobs
+ * @param threads    Number of threads (0 for one per processor)
+ * @param progress   Progress reporting, or NULL for none
+ * @param cache      Cache hooks, or NULL for none
+ * @param allocator  Allocation hooks for the job keys and each job's
+ *                   buffers, or NULL for malloc()/free(); called from the
+ *                   worker threads, possibly at the same time
+ *
+ * @return           0 if all jobs ran, or nonzero if the callback cancelled
+ */
+FASTYZ_API int yaz0_recompress_batch_cached(yaz0_recompress_job_t* jobs, int count, const yaz0_params_t* params,
+                                            int threads, const yaz0_progress_t* progress, const yaz0_cache_t* cache,
+                                            const yaz0_allocator_t* allocator);
 
 /**
  * Decompress a Yaz0-compressed block of data.
@@ -124,7 +1021,41 @@ int yaz0_compress(const void* input, int length, void* output);
  *
  * @note The input and output buffers must not overlap.
  */
-int yaz0_decompress(const void* input, int length, void* output, int maxout);
+FASTYZ_API int yaz0_decompress(const void* input, int length, void* output, int maxout);
+
+/**
+ * Decompress streams of up to YAZ0_MAX_INPUT_SIZE bytes.
+ *
+ * Same as yaz0_decompress(), but with size_t lengths, so streams whose
+ * decompressed size (or compressed size) is 2 GiB or more are handled.
+ *
+ * @param input   Pointer to the compressed Yaz0 data (including header)
+ * @param length  Size of the compressed data in bytes
+ * @param output  Pointer to the output buffer for decompressed data
+ * @param maxout  Maximum size of the output buffer in bytes
+ *
+ * @return        Size of the decompressed data in bytes,
+ *                or 0 if decompression failed (invalid data or buffer too small)
+ */
+FASTYZ_API size_t yaz0_decompress64(const void* input, size_t length, void* output, size_t maxout);
+
+/**
+ * Decompress with progress reporting and cancellation.
+ *
+ * Same as yaz0_decompress64(); the callback receives the compressed bytes
+ * read as 'consumed' and is invoked every 'interval' bytes of output.
+ *
+ * @param input     Pointer to the compressed Yaz0 data (including header)
+ * @param length    Size of the compressed data in bytes
+ * @param output    Pointer to the output buffer for decompressed data
+ * @param maxout    Maximum size of the output buffer in bytes
+ * @param progress  Progress reporting, or NULL for none
+ *
+ * @return          Size of the decompressed data in bytes, or 0 if
+ *                  decompression failed or the callback cancelled
+ */
+FASTYZ_API size_t yaz0_decompress_progress(const void* input, size_t length, void* output, size_t maxout,
+                                           const yaz0_progress_t* progress);
 
 /**
  * Read the decompressed size from a Yaz0 header.
@@ -138,7 +1069,7 @@ int yaz0_decompress(const void* input, int length, void* output, int maxout);
  * @return        The decompressed size in bytes,
  *                or 0 if the header is invalid (wrong magic)
  */
-uint32_t yaz0_get_decompressed_size(const void* input);
+FASTYZ_API uint32_t yaz0_get_decompressed_size(const void* input);
 
 /**
  * Validate a Yaz0 header.
@@ -149,7 +1080,7 @@ uint32_t yaz0_get_decompressed_size(const void* input);
  *
  * @return        Non-zero if the header is valid, 0 otherwise
  */
-int yaz0_is_valid(const void* input);
+FASTYZ_API int yaz0_is_valid(const void* input);
 
 #if defined(__cplusplus)
 }
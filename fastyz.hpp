@@ -0,0 +1,381 @@
+/*
+  FastYZ - Fast Yaz0 compression library
+  C++ interface (C++17 or later)
+
+  Header-only wrapper around fastyz.h: span-based compression and
+  decompression into caller-owned buffers or reused std::vector storage,
+  compressor objects that own their scratch output, and compressors whose
+  parameters are checked at compile time.
+
+  This software is released under the MIT License.
+  See LICENSE file for details.
+*/
+
+#ifndef FASTYZ_HPP
+#define FASTYZ_HPP
+
+#include "fastyz.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#if defined(__has_include)
+#if __has_include(<version>)
+#include <version>
+#endif
+#endif
+
+#if defined(__cpp_lib_span)
+#include <span>
+#endif
+
+namespace fastyz
+{
+
+/* ========================================================================
+ * Buffer Views
+ * ======================================================================== */
+
+#if defined(__cpp_lib_span)
+
+template <class T>
+using span = std::span<T>;
+
+#else
+
+/**
+ * Minimal stand-in for std::span (C++20) when compiling as C++17.
+ * Converts from pointer/size pairs and from contiguous containers.
+ */
+template <class T>
+class span
+{
+public:
+    constexpr span() noexcept : data_(nullptr), size_(0) {}
+    constexpr span(T* data, std::size_t size) noexcept : data_(data), size_(size) {}
+
+    template <class U, std::size_t N,
+              class = std::enable_if_t<std::is_convertible<U (*)[], T (*)[]>::value>>
+    constexpr span(U (&array)[N]) noexcept : data_(array), size_(N) {}
+
+    template <class Container,
+              class = std::enable_if_t<std::is_convertible<
+                  std::remove_pointer_t<decltype(std::declval<Container&>().data())> (*)[], T (*)[]>::value>>
+    constexpr span(Container& c) noexcept : data_(c.data()), size_(c.size()) {}
+
+    template <class U, class = std::enable_if_t<std::is_convertible<U (*)[], T (*)[]>::value>>
+    constexpr span(const span<U>& other) noexcept : data_(other.data()), size_(other.size()) {}
+
+    constexpr T* data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr T* begin() const noexcept { return data_; }
+    constexpr T* end() const noexcept { return data_ + size_; }
+    constexpr T& operator[](std::size_t i) const noexcept { return data_[i]; }
+
+private:
+    T* data_;
+    std::size_t size_;
+};
+
+#endif
+
+/** Read-only bytes (input data) */
+using bytes_view = span<const std::uint8_t>;
+
+/** Writable bytes (output buffers) */
+using mutable_bytes_view = span<std::uint8_t>;
+
+/* ========================================================================
+ * Errors and Parameters
+ * ======================================================================== */
+
+/**
+ * Thrown when compression or decompression fails: invalid parameters,
+ * input over YAZ0_MAX_INPUT_SIZE, an output buffer that is too small or
+ * a malformed stream.
+ */
+class error : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/**
+ * Worst-case compressed size of 'length' input bytes (FASTYZ_BOUND).
+ */
+constexpr std::size_t compress_bound(std::size_t length) noexcept
+{
+    return FASTYZ_BOUND(length);
+}
+
+/**
+ * Decompressed size recorded in a stream's header, or 0 if 'input' is not
+ * a Yaz0 stream.
+ */
+inline std::size_t decompressed_size(bytes_view input) noexcept
+{
+    if (input.size() < YAZ0_HEADER_SIZE || !yaz0_is_valid(input.data()))
+        return 0;
+    return yaz0_get_decompressed_size(input.data());
+}
+
+/**
+ * yaz0_params_t initialized with yaz0_params_init(), with chainable setters.
+ */
+class params
+{
+public:
+    params() noexcept { yaz0_params_init(&p_); }
+
+    params& level(int value) noexcept { p_.level = value; return *this; }
+    params& alignment(int value, int phase = 0) noexcept { p_.alignment = value; p_.alignment_phase = phase; return *this; }
+    params& decode_speed(int value) noexcept { p_.decode_speed = value; return *this; }
+    params& strategy(int value) noexcept { p_.strategy = value; return *this; }
+
+    const yaz0_params_t* get() const noexcept { return &p_; }
+
+private:
+    yaz0_params_t p_;
+};
+
+/* ========================================================================
+ * Span API
+ * ======================================================================== */
+
+/**
+ * Compress 'input' into 'output', which must hold compress_bound() bytes.
+ *
+ * @return  Size of the compressed stream
+ * @throws  error if the parameters are invalid, the input is too large
+ *          or 'output' is smaller than compress_bound(input.size())
+ */
+inline std::size_t compress(bytes_view input, mutable_bytes_view output, const params& p = params())
+{
+    if (output.size() < compress_bound(input.size()))
+        throw error("fastyz: output buffer smaller than compress_bound()");
+
+    std::size_t size = yaz0_compress_ex64(input.data(), input.size(), output.data(), p.get());
+    if (size == 0)
+        throw error("fastyz: compression failed");
+    return size;
+}
+
+/**
+ * Compress 'input' into 'output', replacing its contents. The vector's
+ * capacity is reused, so compressing many inputs into the same vector
+ * reallocates only when an input is larger than any before it.
+ */
+inline void compress(bytes_view input, std::vector<std::uint8_t>& output, const params& p = params())
+{
+    output.resize(compress_bound(input.size()));
+    output.resize(compress(input, mutable_bytes_view(output.data(), output.size()), p));
+}
+
+/**
+ * Decompress the stream 'input' into 'output'.
+ *
+ * @return  Size of the decompressed data
+ * @throws  error if the stream is malformed or 'output' is too small
+ */
+inline std::size_t decompress(bytes_view input, mutable_bytes_view output)
+{
+    std::size_t size = yaz0_decompress64(input.data(), input.size(), output.data(), output.size());
+    if (size == 0)
+        throw error("fastyz: decompression failed");
+    return size;
+}
+
+/**
+ * Decompress the stream 'input' into 'output', replacing its contents and
+ * reusing its capacity.
+ */
+inline void decompress(bytes_view input, std::vector<std::uint8_t>& output)
+{
+    std::size_t size = decompressed_size(input);
+    if (size == 0)
+        throw error("fastyz: not a Yaz0 stream");
+
+    output.resize(size);
+    decompress(input, mutable_bytes_view(output.data(), output.size()));
+}
+
+/* ========================================================================
+ * Compressor Objects
+ * ======================================================================== */
+
+/**
+ * Owning handle for a yaz0_cctx_t (the match tables of a compression),
+ * created with malloc() or the given allocator and released on destruction.
+ * Move-only; use one context per thread.
+ */
+class context
+{
+public:
+    explicit context(const yaz0_allocator_t* allocator = nullptr) : cctx_(yaz0_cctx_create(allocator))
+    {
+        if (!cctx_)
+            throw std::bad_alloc();
+    }
+
+    /**
+     * Compress 'input' into 'output' (at least compress_bound() bytes).
+     */
+    std::size_t compress(bytes_view input, mutable_bytes_view output, const params& p = params())
+    {
+        if (output.size() < compress_bound(input.size()))
+            throw error("fastyz: output buffer smaller than compress_bound()");
+
+        std::size_t size = yaz0_compress_cctx(cctx_.get(), input.data(), input.size(), output.data(), p.get());
+        if (size == 0)
+            throw error("fastyz: compression failed");
+        return size;
+    }
+
+    yaz0_cctx_t* get() const noexcept { return cctx_.get(); }
+
+private:
+    struct deleter
+    {
+        void operator()(yaz0_cctx_t* cctx) const noexcept { yaz0_cctx_free(cctx); }
+    };
+
+    std::unique_ptr<yaz0_cctx_t, deleter> cctx_;
+};
+
+/**
+ * Compressor with its parameters checked at compile time.
+ *
+ * Invalid parameters are rejected by static_assert, and the default
+ * configuration (level 0, byte alignment, fixed strategy, no decode-speed
+ * bias) calls the parameterless fast path directly; other configurations
+ * keep their match tables in a context owned by the object. The object
+ * also owns the output buffer of operator(), which keeps its capacity
+ * between calls. Use one compressor per thread.
+ *
+ * The template arguments do not make compression faster: every
+ * configuration runs the same compiled library code as the runtime
+ * parameters of context::compress(). That code picks a match search loop
+ * specialized for the alignment once per call, so the loops themselves
+ * have no parameter branches either way.
+ *
+ * The hash table size (HASH_LOG) is a build setting of fastyz.c and is not
+ * a template parameter.
+ *
+ * @tparam Level        Compression level (0-9)
+ * @tparam Alignment    Match search alignment (1, 2, 4, 8 or 16; 0 = detect)
+ * @tparam Strategy     YAZ0_STRATEGY_FIXED or YAZ0_STRATEGY_ADAPTIVE
+ * @tparam DecodeSpeed  Decoder-friendly match selection (0-9)
+ */
+template <int Level = 0, int Alignment = 1, int Strategy = YAZ0_STRATEGY_FIXED, int DecodeSpeed = 0>
+class basic_compressor
+{
+    static_assert(Level >= 0 && Level <= 9, "level must be 0-9");
+    static_assert(Alignment == 0 || Alignment == 1 || Alignment == 2 || Alignment == 4 ||
+                  Alignment == 8 || Alignment == 16, "alignment must be 0 (detect), 1, 2, 4, 8 or 16");
+    static_assert(Strategy == YAZ0_STRATEGY_FIXED || Strategy == YAZ0_STRATEGY_ADAPTIVE, "unknown strategy");
+    static_assert(DecodeSpeed >= 0 && DecodeSpeed <= 9, "decode speed must be 0-9");
+
+    static constexpr bool fast_path =
+        Level == 0 && Alignment == 1 && Strategy == YAZ0_STRATEGY_FIXED && DecodeSpeed == 0;
+
+public:
+    static constexpr int level = Level;
+    static constexpr int alignment = Alignment;
+    static constexpr int strategy = Strategy;
+    static constexpr int decode_speed = DecodeSpeed;
+
+    basic_compressor()
+    {
+        params_.level(Level).alignment(Alignment).strategy(Strategy).decode_speed(DecodeSpeed);
+    }
+
+    /**
+     * Compress 'input' into 'output' (at least compress_bound() bytes).
+     */
+    std::size_t compress(bytes_view input, mutable_bytes_view output)
+    {
+        if constexpr (fast_path)
+        {
+            if (output.size() < compress_bound(input.size()))
+                throw error("fastyz: output buffer smaller than compress_bound()");
+
+            std::size_t size = yaz0_compress64(input.data(), input.size(), output.data());
+            if (size == 0)
+                throw error("fastyz: compression failed");
+            return size;
+        }
+        else
+        {
+            return context_.compress(input, output, params_);
+        }
+    }
+
+    /**
+     * Compress 'input' into 'output', replacing its contents and reusing
+     * its capacity.
+     */
+    void compress(bytes_view input, std::vector<std::uint8_t>& output)
+    {
+        output.resize(compress_bound(input.size()));
+        output.resize(compress(input, mutable_bytes_view(output.data(), output.size())));
+    }
+
+    /**
+     * Compress 'input' into the compressor's own buffer. The returned view
+     * stays valid until the next call or the compressor's destruction.
+     */
+    bytes_view operator()(bytes_view input)
+    {
+        compress(input, buffer_);
+        return bytes_view(buffer_.data(), buffer_.size());
+    }
+
+    /** Parameters equivalent to the template arguments */
+    const params& parameters() const noexcept { return params_; }
+
+private:
+    struct no_context
+    {
+    };
+
+    params params_;
+    std::conditional_t<fast_path, no_context, context> context_;
+    std::vector<std::uint8_t> buffer_;
+};
+
+/** Default compressor (the yaz0_compress() fast path) */
+using compressor = basic_compressor<>;
+
+/** Best-ratio compressor (hash chain parser, level 9) */
+using max_compressor = basic_compressor<9>;
+
+/**
+ * Decompressor owning its output buffer, which keeps its capacity between
+ * calls and is freed with the object.
+ */
+class decompressor
+{
+public:
+    /**
+     * Decompress 'input' into the decompressor's own buffer. The returned
+     * view stays valid until the next call or the decompressor's destruction.
+     */
+    bytes_view operator()(bytes_view input)
+    {
+        fastyz::decompress(input, buffer_);
+        return bytes_view(buffer_.data(), buffer_.size());
+    }
+
+private:
+    std::vector<std::uint8_t> buffer_;
+};
+
+} // namespace fastyz
+
+#endif /* FASTYZ_HPP */
@@ -5,13 +5,25 @@
   using the Yaz0 compression format.
 
   Usage:
-    fastyz [-c|-d] [-o output] input
+    fastyz [-c|-d] [-a align] [-D dict] [--cache dir] [-o output] input
+    fastyz --train -o dict.bin samples...
+    fastyz --recompress [-l level] [-j threads] [--cache dir] files...
+    fastyz --serve socket [-j threads]
+    fastyz --watch dir [-o outdir] [-l level] [-j threads]
+    fastyz --connect socket [-c|-d] [-l level] [--priority n] [-o output] input
     fastyz -c input.bin                  # Compress to input.bin.yaz0
     fastyz -c input.bin -o output.szs    # Compress to output.szs
     fastyz -d input.yaz0                 # Decompress to input (without .yaz0)
     fastyz -d input.yaz0 -o output.bin   # Decompress to output.bin
 */
 
+/* 64-bit file offsets (so inputs over 2 GiB can be sized) and POSIX/XSI interfaces, before any system header */
+#if !defined(_WIN32)
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,6 +32,40 @@
 
 #include "fastyz.h"
 
+/* The compression server needs Unix domain sockets and POSIX threads */
+#if !defined(_WIN32)
+#define HAVE_SERVER
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0  /* SIGPIPE is ignored instead */
+#endif
+#endif
+
+/* The compression cache is a directory tree; Linux can clone its entries */
+#if defined(HAVE_SERVER)
+#define HAVE_CACHE
+#include <dirent.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+#endif
+
+/* Watch mode uses inotify */
+#if defined(HAVE_SERVER) && defined(__linux__)
+#define HAVE_WATCH
+#include <sys/inotify.h>
+#endif
+
 /* ========================================================================
  * Constants
  * ======================================================================== */
@@ -30,9 +76,26 @@
 typedef enum {
     MODE_AUTO,       /* Auto-detect based on file extension/content */
     MODE_COMPRESS,   /* Force compression */
-    MODE_DECOMPRESS  /* Force decompression */
+    MODE_DECOMPRESS, /* Force decompression */
+    MODE_TRAIN,      /* Train a dictionary from sample files */
+    MODE_RECOMPRESS  /* Re-encode Yaz0 files */
 } operation_mode_t;
 
+#define MAX_DICT_SIZE   4096
+
+/* Files loaded and re-encoded together by --recompress */
+#define RECOMPRESS_BATCH 64
+
+#if defined(_WIN32)
+typedef __int64 file_offset_t;
+#define file_seek _fseeki64
+#define file_tell _ftelli64
+#else
+typedef off_t file_offset_t;
+#define file_seek fseeko
+#define file_tell ftello
+#endif
+
 /* ========================================================================
  * File I/O Utilities
  * ======================================================================== */
@@ -41,7 +104,7 @@ typedef enum {
  * Read entire file into memory.
  * Returns allocated buffer (caller must free) or NULL on error.
  */
-static uint8_t* read_file(const char* filename, long* out_size)
+static uint8_t* read_file(const char* filename, size_t* out_size)
 {
     FILE* fp = fopen(filename, "rb");
     if (!fp) {
@@ -49,19 +112,26 @@ static uint8_t* read_file(const char* filename, long* out_size)
         return NULL;
     }
 
-    fseek(fp, 0, SEEK_END);
-    long size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    file_seek(fp, 0, SEEK_END);
+    file_offset_t offset = file_tell(fp);
+    file_seek(fp, 0, SEEK_SET);
 
-    if (size <= 0) {
+    if (offset <= 0) {
         fprintf(stderr, "Error: File '%s' is empty or invalid\n", filename);
         fclose(fp);
         return NULL;
     }
 
+    if ((uint64_t)offset > SIZE_MAX) {
+        fprintf(stderr, "Error: File '%s' is too large to load on this platform\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+
+    size_t size = (size_t)offset;
     uint8_t* buffer = (uint8_t*)malloc(size);
     if (!buffer) {
-        fprintf(stderr, "Error: Failed to allocate %ld bytes\n", size);
+        fprintf(stderr, "Error: Failed to allocate %zu bytes\n", size);
         fclose(fp);
         return NULL;
     }
@@ -69,8 +139,8 @@ static uint8_t* read_file(const char* filename, long* out_size)
     size_t read = fread(buffer, 1, size, fp);
     fclose(fp);
 
-    if ((long)read != size) {
-        fprintf(stderr, "Error: Failed to read '%s' (expected %ld, got %zu)\n",
+    if (read != size) {
+        fprintf(stderr, "Error: Failed to read '%s' (expected %zu, got %zu)\n",
                 filename, size, read);
         free(buffer);
         return NULL;
@@ -104,6 +174,112 @@ static int write_file(const char* filename, const uint8_t* data, size_t size)
     return 0;
 }
 
+#if defined(HAVE_SERVER)
+
+/*
+ * Modification time of a struct stat in nanoseconds, so that files written
+ * within the same second are ordered. C libraries that define st_mtime as
+ * a macro for st_mtim.tv_sec have st_mtim; elsewhere only whole seconds
+ * are compared.
+ */
+#if defined(__APPLE__)
+#define STAT_MTIME_NS(st) ((long long)(st).st_mtimespec.tv_sec * 1000000000 + (st).st_mtimespec.tv_nsec)
+#elif defined(st_mtime)
+#define STAT_MTIME_NS(st) ((long long)(st).st_mtim.tv_sec * 1000000000 + (st).st_mtim.tv_nsec)
+#else
+#define STAT_MTIME_NS(st) ((long long)(st).st_mtime * 1000000000)
+#endif
+
+/*
+ * Create the missing parent directories of 'path'.
+ */
+static void make_parents(char* path)
+{
+    for (char* p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(path, 0777);
+        *p = '/';
+    }
+}
+
+/*
+ * Temporary file for an atomic write of 'path': a hidden file in the same
+ * directory, so that rename() replaces the target in one step. Returns the
+ * open descriptor, with the name in 'tmp'.
+ */
+static int open_temp(const char* path, char* tmp, size_t size)
+{
+    const char* base = strrchr(path, '/');
+    int dir_len = base ? (int)(base - path + 1) : 0;
+
+    base = base ? base + 1 : path;
+    if (snprintf(tmp, size, "%.*s.%s.tmpXXXXXX", dir_len, path, base) >= (int)size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = mkstemp(tmp);
+    if (fd >= 0)
+        fchmod(fd, 0644);
+    return fd;
+}
+
+static int write_fd(int fd, const void* data, size_t size)
+{
+    const uint8_t* p = (const uint8_t*)data;
+
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Read 'size' bytes at 'offset'. Returns the number of bytes read, which
+ * is short only if the file ends first, or -1 on error.
+ */
+static ssize_t pread_full(int fd, void* data, size_t size, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = pread(fd, (uint8_t*)data + done, size - done, offset + (off_t)done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+static int pwrite_full(int fd, const void* data, size_t size, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = pwrite(fd, (const uint8_t*)data + done, size - done, offset + (off_t)done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+#endif /* HAVE_SERVER */
+
 /* ========================================================================
  * String Utilities
  * ======================================================================== */
@@ -186,17 +362,334 @@ static char* generate_output_filename(const char* input, operation_mode_t mode)
     return output;
 }
 
+/* ========================================================================
+ * Progress Display
+ * ======================================================================== */
+
+/* Set by --progress */
+static int show_progress = 0;
+
+static int print_progress(void* user, size_t consumed, size_t produced)
+{
+    size_t total = *(const size_t*)user;
+    (void)produced;
+    fprintf(stderr, "\r  Progress: %3d%%", total && consumed < total ? (int)(100.0 * consumed / total) : 100);
+    return 0;
+}
+
+/*
+ * Progress reporting for an operation on 'total' input bytes, or NULL
+ * without --progress. 'total' must stay valid during the operation.
+ */
+static const yaz0_progress_t* progress_begin(yaz0_progress_t* progress, const size_t* total)
+{
+    if (!show_progress)
+        return NULL;
+
+    progress->callback = print_progress;
+    progress->user = (void*)total;
+    progress->interval = 0;
+    return progress;
+}
+
+static void progress_end(void)
+{
+    if (show_progress)
+        fputc('\n', stderr);
+}
+
+#if defined(HAVE_CACHE)
+
+/* ========================================================================
+ * Compression Cache
+ * ======================================================================== */
+
+/*
+ * Outputs are stored as <dir>/<first hex digit of the key>/<rest>.yaz0.
+ * A hit sets the entry's modification time, and each store trims the
+ * entry's subdirectory to 1/CACHE_FANOUT of the size limit, deleting the
+ * least recently used entries first. Keys spread evenly over the
+ * subdirectories, so this bounds the whole cache without scanning it.
+ */
+#define CACHE_FANOUT 16
+
+/* Default size limit in MiB (--cache-size) */
+#define CACHE_DEFAULT_MB 1024
+
+/* Age in seconds after which a temporary file was left by a crashed writer */
+#define CACHE_STALE_TEMP 3600
+
+/* Set by --cache and --cache-size */
+static const char* cache_dir = NULL;
+static long long cache_limit = CACHE_DEFAULT_MB * 1024LL * 1024;
+
+typedef struct {
+    char name[48];
+    long long size;
+    long long used;
+} cache_entry_t;
+
+static int cache_entry_path(const yaz0_cache_key_t* key, char* path, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    char name[2 * YAZ0_CACHE_KEY_SIZE + 1];
+
+    for (int i = 0; i < YAZ0_CACHE_KEY_SIZE; i++) {
+        name[2 * i] = hex[key->bytes[i] >> 4];
+        name[2 * i + 1] = hex[key->bytes[i] & 15];
+    }
+    name[2 * YAZ0_CACHE_KEY_SIZE] = '\0';
+
+    return snprintf(path, size, "%s/%c/%s.yaz0", cache_dir, name[0], name + 1) < (int)size ? 0 : -1;
+}
+
+/*
+ * Open the entry for 'key' and mark it used. Returns the descriptor, with
+ * the entry's size and header, or -1 if there is no valid entry.
+ */
+static int cache_open(const yaz0_cache_key_t* key, size_t* size, uint8_t header[YAZ0_HEADER_SIZE])
+{
+    char path[4096];
+    struct stat st;
+
+    if (cache_entry_path(key, path, sizeof(path)) != 0)
+        return -1;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) != 0 || st.st_size < YAZ0_HEADER_SIZE ||
+        pread(fd, header, YAZ0_HEADER_SIZE, 0) != YAZ0_HEADER_SIZE || !yaz0_is_valid(header)) {
+        close(fd);
+        return -1;
+    }
+
+    futimens(fd, NULL);
+    *size = (size_t)st.st_size;
+    return fd;
+}
+
+/*
+ * Copy a file's contents, sharing its blocks (a reflink) on filesystems
+ * that support it.
+ */
+static int copy_fd(int dst, int src)
+{
+    uint8_t buffer[65536];
+
+#if defined(FICLONE)
+    if (ioctl(dst, FICLONE, src) == 0)
+        return 0;
+#endif
+
+    for (;;) {
+        ssize_t n = read(src, buffer, sizeof(buffer));
+        if (n == 0)
+            return 0;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (write_fd(dst, buffer, (size_t)n) != 0)
+            return -1;
+    }
+}
+
+/*
+ * Write the cached compression of 'input_size' bytes to 'output_file'.
+ * Returns the compressed size, 0 if it is not cached, or -1 if the output
+ * cannot be written.
+ */
+static long long cache_fetch(const yaz0_cache_key_t* key, size_t input_size, const char* output_file)
+{
+    uint8_t header[YAZ0_HEADER_SIZE];
+    size_t size;
+
+    int src = cache_open(key, &size, header);
+    if (src < 0)
+        return 0;
+    if (yaz0_get_decompressed_size(header) != input_size) {
+        close(src);
+        return 0;
+    }
+
+    int dst = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dst < 0) {
+        fprintf(stderr, "Error: Cannot open '%s' for writing\n", output_file);
+        close(src);
+        return -1;
+    }
+
+    int failed = copy_fd(dst, src) != 0;
+    failed |= close(dst) != 0;
+    close(src);
+
+    if (failed) {
+        fprintf(stderr, "Error: Failed to write '%s'\n", output_file);
+        return -1;
+    }
+    return (long long)size;
+}
+
+/* yaz0_cache_t lookup hook */
+static size_t cache_lookup(void* user, const yaz0_cache_key_t* key, void* output, size_t maxout)
+{
+    uint8_t header[YAZ0_HEADER_SIZE];
+    size_t size;
+    (void)user;
+
+    int fd = cache_open(key, &size, header);
+    if (fd < 0)
+        return 0;
+
+    ssize_t done = size <= maxout ? pread_full(fd, output, size, 0) : -1;
+    close(fd);
+
+    return done >= 0 && (size_t)done == size ? size : 0;
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+    const cache_entry_t* x = (const cache_entry_t*)a;
+    const cache_entry_t* y = (const cache_entry_t*)b;
+    return (x->used > y->used) - (x->used < y->used);
+}
+
+/*
+ * Delete the least recently used entries of a subdirectory, except the
+ * entry just stored ('keep'), until it is within its share of the size
+ * limit. Temporary files left by crashed writers are deleted too.
+ */
+static void cache_trim(const char* dir_path, const char* keep)
+{
+    cache_entry_t* entries = NULL;
+    int count = 0, capacity = 0;
+    long long total = 0;
+    time_t now = time(NULL);
+    struct dirent* e;
+
+    DIR* dir = opendir(dir_path);
+    if (!dir)
+        return;
+
+    while ((e = readdir(dir)) != NULL) {
+        struct stat st;
+        if (fstatat(dirfd(dir), e->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        if (e->d_name[0] == '.') {
+            if (now - st.st_mtime > CACHE_STALE_TEMP)
+                unlinkat(dirfd(dir), e->d_name, 0);
+            continue;
+        }
+        if (strlen(e->d_name) >= sizeof(entries[0].name) || strcmp(e->d_name, keep) == 0) {
+            total += (long long)st.st_size;
+            continue;
+        }
+
+        if (count == capacity) {
+            int grown = capacity ? capacity * 2 : 256;
+            cache_entry_t* more = (cache_entry_t*)realloc(entries, grown * sizeof(cache_entry_t));
+            if (!more)
+                break;
+            entries = more;
+            capacity = grown;
+        }
+        strcpy(entries[count].name, e->d_name);
+        entries[count].size = (long long)st.st_size;
+        entries[count].used = STAT_MTIME_NS(st);
+        total += entries[count++].size;
+    }
+
+    long long limit = cache_limit / CACHE_FANOUT;
+    if (total > limit) {
+        qsort(entries, count, sizeof(cache_entry_t), compare_entries);
+        for (int i = 0; i < count && total > limit; i++) {
+            if (unlinkat(dirfd(dir), entries[i].name, 0) == 0)
+                total -= entries[i].size;
+        }
+    }
+
+    closedir(dir);
+    free(entries);
+}
+
+/*
+ * yaz0_cache_t store hook. The entry is written to a temporary file and
+ * renamed into place, so concurrent processes can share the cache. A
+ * failure only costs a later hit, so it is not reported.
+ */
+static void cache_store(void* user, const yaz0_cache_key_t* key, const void* data, size_t size)
+{
+    char path[4096], tmp[4096];
+    (void)user;
+
+    if (cache_entry_path(key, path, sizeof(path)) != 0)
+        return;
+    make_parents(path);
+
+    int fd = open_temp(path, tmp, sizeof(tmp));
+    if (fd < 0)
+        return;
+
+    int failed = write_fd(fd, data, size) != 0;
+    failed |= close(fd) != 0;
+    if (failed || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return;
+    }
+
+    char* name = strrchr(path, '/');
+    *name++ = '\0';
+    cache_trim(path, name);
+}
+
+#endif /* HAVE_CACHE */
+
 /* ========================================================================
  * Compression/Decompression Operations
  * ======================================================================== */
 
-static int do_compress(const char* input_file, const char* output_file)
+static int do_compress(const char* input_file, const char* output_file, const yaz0_params_t* params, int pipelined,
+                       double budget, long fit, const uint8_t* dict, size_t dict_size)
 {
-    long input_size;
+    size_t input_size;
     uint8_t* input_data = read_file(input_file, &input_size);
     if (!input_data)
         return 1;
 
+    /* Only plain compression has a size_t entry point */
+    int sized = dict || fit > 0 || budget > 0 || pipelined;
+    if (input_size > YAZ0_MAX_INPUT_SIZE || (sized && input_size > INT32_MAX)) {
+        fprintf(stderr, "Error: '%s' is too large to compress (limit %s)\n", input_file,
+                input_size > YAZ0_MAX_INPUT_SIZE ? "4 GiB" : "2 GiB with -D, --fit, --budget or --pipeline");
+        free(input_data);
+        return 1;
+    }
+
+#if defined(HAVE_CACHE)
+    /* Plain compression is looked up in the cache first */
+    yaz0_cache_key_t key;
+    if (cache_dir && !sized) {
+        clock_t lookup_start = clock();
+        yaz0_cache_key(&key, YAZ0_CACHE_COMPRESS, input_data, input_size, params);
+        long long cached = cache_fetch(&key, input_size, output_file);
+
+        if (cached > 0) {
+            printf("Compressed: %s -> %s\n", input_file, output_file);
+            printf("  Original:   %zu bytes\n", input_size);
+            printf("  Compressed: %lld bytes (%.1f%%)\n", cached, 100.0 * cached / input_size);
+            printf("  Time:       %.3f sec (cache hit)\n", (double)(clock() - lookup_start) / CLOCKS_PER_SEC);
+        }
+        if (cached != 0) {
+            free(input_data);
+            return cached > 0 ? 0 : 1;
+        }
+    }
+#endif
+
     /* Allocate output buffer with worst-case size */
     size_t max_output = FASTYZ_BOUND(input_size);
     uint8_t* output_data = (uint8_t*)malloc(max_output);
@@ -207,12 +700,32 @@ static int do_compress(const char* input_file, const char* output_file)
     }
 
     /* Compress */
+    yaz0_pipeline_stats_t stats;
+    yaz0_progress_t progress;
+    int fit_level = -1;
     clock_t start = clock();
-    int output_size = yaz0_compress(input_data, (int)input_size, output_data);
+    size_t output_size;
+    if (sized) {
+        int size = dict
+            ? yaz0_compress_dict(input_data, (int)input_size, output_data, dict, (int)dict_size)
+            : fit > 0
+            ? yaz0_compress_fit(input_data, (int)input_size, output_data, (int)fit, params, &fit_level)
+            : budget > 0
+            ? yaz0_compress_budget(input_data, (int)input_size, output_data, params, budget)
+            : yaz0_compress_pipelined(input_data, (int)input_size, output_data, params, &stats);
+        output_size = size > 0 ? (size_t)size : 0;
+    } else {
+        output_size = yaz0_compress_progress(input_data, input_size, output_data, params,
+                                             progress_begin(&progress, &input_size));
+        progress_end();
+    }
     clock_t end = clock();
 
-    if (output_size <= 0) {
-        fprintf(stderr, "Error: Compression failed\n");
+    if (output_size == 0) {
+        if (fit > 0 && !dict)
+            fprintf(stderr, "Error: %s does not compress to %ld bytes\n", input_file, fit);
+        else
+            fprintf(stderr, "Error: Compression failed\n");
         free(input_data);
         free(output_data);
         return 1;
@@ -220,6 +733,12 @@ static int do_compress(const char* input_file, const char* output_file)
 
     /* Write output */
     int result = write_file(output_file, output_data, output_size);
+
+#if defined(HAVE_CACHE)
+    /* Chunked --progress output differs slightly, so only unchunked output is stored */
+    if (result == 0 && cache_dir && !sized && !show_progress)
+        cache_store(NULL, &key, output_data, output_size);
+#endif
     
     if (result == 0) {
         double elapsed = (double)(end - start) / CLOCKS_PER_SEC;
@@ -227,9 +746,22 @@ static int do_compress(const char* input_file, const char* output_file)
         double speed = (input_size / (1024.0 * 1024.0)) / elapsed;
         
         printf("Compressed: %s -> %s\n", input_file, output_file);
-        printf("  Original:   %ld bytes\n", input_size);
-        printf("  Compressed: %d bytes (%.1f%%)\n", output_size, ratio);
+        printf("  Original:   %zu bytes\n", input_size);
+        printf("  Compressed: %zu bytes (%.1f%%)\n", output_size, ratio);
         printf("  Time:       %.3f sec (%.1f MB/s)\n", elapsed, speed);
+
+        if (fit > 0 && !dict)
+            printf("  Level:      %d\n", fit_level);
+
+        if (pipelined && !dict) {
+            /* clock() sums CPU time over both threads; report wall time too */
+            printf("  Wall time:  %.3f sec (%.1f MB/s)\n", stats.total_seconds,
+                   (input_size / (1024.0 * 1024.0)) / stats.total_seconds);
+            printf("  Search:     %.3f sec busy, %.3f sec waiting (%u stalls)\n",
+                   stats.search_seconds, stats.search_wait_seconds, stats.search_stalls);
+            printf("  Encode:     %.3f sec busy, %.3f sec waiting (%u stalls)\n",
+                   stats.encode_seconds, stats.encode_wait_seconds, stats.encode_stalls);
+        }
     }
 
     free(input_data);
@@ -237,9 +769,9 @@ static int do_compress(const char* input_file, const char* output_file)
     return result;
 }
 
-static int do_decompress(const char* input_file, const char* output_file)
+static int do_decompress(const char* input_file, const char* output_file, const uint8_t* dict, size_t dict_size)
 {
-    long input_size;
+    size_t input_size;
     uint8_t* input_data = read_file(input_file, &input_size);
     if (!input_data)
         return 1;
@@ -259,6 +791,12 @@ static int do_decompress(const char* input_file, const char* output_file)
         return 1;
     }
 
+    if (dict && (input_size > INT32_MAX || output_size > INT32_MAX)) {
+        fprintf(stderr, "Error: '%s' is too large to decompress with -D (limit 2 GiB)\n", input_file);
+        free(input_data);
+        return 1;
+    }
+
     /* Allocate output buffer */
     uint8_t* output_data = (uint8_t*)malloc(output_size);
     if (!output_data) {
@@ -268,11 +806,20 @@ static int do_decompress(const char* input_file, const char* output_file)
     }
 
     /* Decompress */
+    yaz0_progress_t progress;
     clock_t start = clock();
-    int decompressed = yaz0_decompress(input_data, (int)input_size, output_data, output_size);
+    size_t decompressed;
+    if (dict) {
+        decompressed = (size_t)yaz0_decompress_dict(input_data, (int)input_size, output_data, (int)output_size,
+                                                    dict, (int)dict_size);
+    } else {
+        decompressed = yaz0_decompress_progress(input_data, input_size, output_data, output_size,
+                                                progress_begin(&progress, &input_size));
+        progress_end();
+    }
     clock_t end = clock();
 
-    if (decompressed <= 0) {
+    if (decompressed == 0) {
         fprintf(stderr, "Error: Decompression failed\n");
         free(input_data);
         free(output_data);
@@ -287,8 +834,8 @@ static int do_decompress(const char* input_file, const char* output_file)
         double speed = (decompressed / (1024.0 * 1024.0)) / elapsed;
         
         printf("Decompressed: %s -> %s\n", input_file, output_file);
-        printf("  Compressed:   %ld bytes\n", input_size);
-        printf("  Decompressed: %d bytes\n", decompressed);
+        printf("  Compressed:   %zu bytes\n", input_size);
+        printf("  Decompressed: %zu bytes\n", decompressed);
         printf("  Time:         %.3f sec (%.1f MB/s)\n", elapsed, speed);
     }
 
@@ -297,82 +844,2066 @@ static int do_decompress(const char* input_file, const char* output_file)
     return result;
 }
 
-/* ========================================================================
- * Usage and Main
- * ======================================================================== */
-
-static void print_usage(void)
-{
-    printf("FastYZ v%s - Fast Yaz0 compression\n", PROGRAM_VERSION);
-    printf("\n");
-    printf("Usage: %s [options] <input>\n", PROGRAM_NAME);
-    printf("\n");
-    printf("Options:\n");
-    printf("  -c          Force compression mode\n");
-    printf("  -d          Force decompression mode\n");
-    printf("  -o <file>   Specify output filename\n");
-    printf("  -h, --help  Show this help message\n");
-    printf("  -v          Show version information\n");
-    printf("\n");
-    printf("If no mode is specified, the operation is auto-detected:\n");
-    printf("  - Files with .yaz0, .szs, or .carc extension are decompressed\n");
-    printf("  - Files starting with 'Yaz0' magic are decompressed\n");
-    printf("  - All other files are compressed\n");
-    printf("\n");
-    printf("Examples:\n");
-    printf("  %s file.bin                 Compress to file.bin.yaz0\n", PROGRAM_NAME);
-    printf("  %s -c file.bin -o out.szs   Compress to out.szs\n", PROGRAM_NAME);
-    printf("  %s file.yaz0                Decompress to file\n", PROGRAM_NAME);
-    printf("  %s -d data.szs -o raw.bin   Decompress to raw.bin\n", PROGRAM_NAME);
-}
-
-static void print_version(void)
+static int do_train(const char* const* sample_files, int num_samples, const char* output_file)
 {
-    printf("FastYZ v%s\n", PROGRAM_VERSION);
-    printf("Fast Yaz0 compression based on FastLZ\n");
-    printf("https://github.com/your-username/fastyz\n");
-}
+    uint8_t** samples = (uint8_t**)calloc(num_samples, sizeof(uint8_t*));
+    int* sample_sizes = (int*)calloc(num_samples, sizeof(int));
+    uint8_t* corpus = NULL;
+    size_t total = 0;
+    int result = 1;
 
-int main(int argc, char* argv[])
-{
-    operation_mode_t mode = MODE_AUTO;
-    const char* input_file = NULL;
-    const char* output_file = NULL;
-    char* generated_output = NULL;
+    if (!samples || !sample_sizes) {
+        fprintf(stderr, "Error: Failed to allocate sample list\n");
+        goto done;
+    }
 
-    /* Parse command-line arguments */
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-c") == 0) {
-            mode = MODE_COMPRESS;
-        } else if (strcmp(argv[i], "-d") == 0) {
-            mode = MODE_DECOMPRESS;
-        } else if (strcmp(argv[i], "-o") == 0) {
-            if (i + 1 >= argc) {
-                fprintf(stderr, "Error: -o requires an argument\n");
-                return 1;
-            }
-            output_file = argv[++i];
-        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-            print_usage();
-            return 0;
-        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--version") == 0) {
-            print_version();
-            return 0;
-        } else if (argv[i][0] == '-') {
-            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
-            return 1;
-        } else {
-            if (input_file) {
-                fprintf(stderr, "Error: Multiple input files specified\n");
-                return 1;
-            }
-            input_file = argv[i];
+    for (int i = 0; i < num_samples; i++) {
+        size_t size;
+        samples[i] = read_file(sample_files[i], &size);
+        if (!samples[i])
+            goto done;
+        if (size > INT32_MAX - total) {
+            fprintf(stderr, "Error: Samples are too large to train on (limit 2 GiB in total)\n");
+            goto done;
         }
+        sample_sizes[i] = (int)size;
+        total += size;
     }
 
-    /* Validate arguments */
-    if (!input_file) {
-        fprintf(stderr, "Error: No input file specified\n");
+    /* yaz0_train_dict() takes the samples concatenated */
+    corpus = (uint8_t*)malloc(total);
+    if (!corpus) {
+        fprintf(stderr, "Error: Failed to allocate %zu bytes\n", total);
+        goto done;
+    }
+    for (int i = 0, pos = 0; i < num_samples; pos += sample_sizes[i], i++)
+        memcpy(corpus + pos, samples[i], sample_sizes[i]);
+
+    uint8_t dict[MAX_DICT_SIZE];
+    clock_t start = clock();
+    int dict_size = yaz0_train_dict(dict, MAX_DICT_SIZE, corpus, sample_sizes, num_samples);
+    clock_t end = clock();
+
+    if (dict_size <= 0) {
+        fprintf(stderr, "Error: Samples have too little in common to build a dictionary\n");
+        goto done;
+    }
+
+    result = write_file(output_file, dict, dict_size);
+
+    if (result == 0) {
+        printf("Trained: %d samples (%zu bytes) -> %s\n", num_samples, total, output_file);
+        printf("  Dictionary: %d bytes\n", dict_size);
+        printf("  Time:       %.3f sec\n", (double)(end - start) / CLOCKS_PER_SEC);
+    }
+
+done:
+    if (samples) {
+        for (int i = 0; i < num_samples; i++)
+            free(samples[i]);
+    }
+    free(samples);
+    free(sample_sizes);
+    free(corpus);
+    return result;
+}
+
+/*
+ * Re-encode Yaz0 files in parallel. Files that do not get smaller are left
+ * untouched; with a single input, 'output_file' may redirect the result.
+ */
+static int do_recompress(const char* const* files, int num_files, const char* output_file,
+                         const yaz0_params_t* params, int threads)
+{
+    yaz0_recompress_job_t jobs[RECOMPRESS_BATCH];
+    yaz0_progress_t progress;
+    const yaz0_cache_t* cache = NULL;
+    long total_in = 0, total_out = 0;
+    int failed = 0;
+
+#if defined(HAVE_CACHE)
+    static const yaz0_cache_t disk_cache = { cache_lookup, cache_store, NULL };
+    if (cache_dir)
+        cache = &disk_cache;
+#endif
+
+    clock_t start = clock();
+
+    for (int first = 0; first < num_files; first += RECOMPRESS_BATCH) {
+        int count = num_files - first < RECOMPRESS_BATCH ? num_files - first : RECOMPRESS_BATCH;
+        size_t batch_size = 0;
+
+        for (int i = 0; i < count; i++) {
+            size_t size = 0;
+            uint8_t* data = read_file(files[first + i], &size);
+            if (data && size > INT32_MAX) {
+                fprintf(stderr, "Error: '%s' is too large to recompress (limit 2 GiB)\n", files[first + i]);
+                free(data);
+                data = NULL;
+            }
+            uint8_t* out = data ? (uint8_t*)malloc(size) : NULL;
+
+            jobs[i].input = data;
+            jobs[i].length = out ? (int)size : 0;
+            jobs[i].output = out;
+            jobs[i].result = 0;
+            batch_size += (size_t)jobs[i].length;
+        }
+
+        yaz0_recompress_batch_cached(jobs, count, params, threads, progress_begin(&progress, &batch_size), cache,
+                                     NULL);
+        progress_end();
+
+        for (int i = 0; i < count; i++) {
+            const char* name = files[first + i];
+            const char* target = output_file ? output_file : name;
+
+            if (jobs[i].result <= 0) {
+                if (jobs[i].input)
+                    fprintf(stderr, "Error: '%s' is not a valid Yaz0 file\n", name);
+                failed++;
+            } else if (jobs[i].result < jobs[i].length || output_file) {
+                if (write_file(target, (const uint8_t*)jobs[i].output, jobs[i].result) != 0) {
+                    failed++;
+                } else {
+                    printf("Recompressed: %s -> %s (%d -> %d bytes)\n",
+                           name, target, jobs[i].length, jobs[i].result);
+                }
+            } else {
+                printf("Kept:         %s (%d bytes, no smaller encoding found)\n", name, jobs[i].length);
+            }
+
+            if (jobs[i].result > 0) {
+                total_in += jobs[i].length;
+                total_out += jobs[i].result;
+            }
+
+            free((void*)jobs[i].input);
+            free(jobs[i].output);
+        }
+    }
+
+    clock_t end = clock();
+
+    if (num_files > 1 && total_in > 0) {
+        printf("  Total:      %ld -> %ld bytes (%.1f%%)\n", total_in, total_out, 100.0 * total_out / total_in);
+        printf("  Time:       %.3f sec\n", (double)(end - start) / CLOCKS_PER_SEC);
+    }
+
+    return failed ? 1 : 0;
+}
+
+#if defined(HAVE_SERVER)
+
+/* ========================================================================
+ * Worker Pool
+ * ======================================================================== */
+
+/* Upper bound on pool threads */
+#define POOL_MAX_THREADS 64
+
+/* Recent job latencies kept for the percentiles of the pool metrics */
+#define POOL_LATENCY_SAMPLES 1024
+
+typedef struct pool_job pool_job_t;
+
+/*
+ * One compression or decompression run by the worker pool. Input and
+ * output are descriptors owned by the job, or paths opened by the worker.
+ */
+struct pool_job {
+    int decompress;
+    int priority;               /* Higher runs first; FIFO within a priority */
+    yaz0_params_t params;
+    int in_fd, out_fd;          /* -1 to open in_path/out_path */
+    const char* in_path;
+    const char* out_path;
+    int atomic;                 /* Write out_path as a temporary file renamed into place */
+
+    /* Filled in by the worker */
+    size_t in_size, out_size;
+    double latency;             /* Seconds from submission to completion */
+    char error[160];            /* Empty on success */
+
+    void (*done)(pool_job_t* job);  /* Called on the worker thread */
+    void* owner;
+
+    double queued_at;
+    uint64_t seq;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pool_job_t** heap;          /* Pending jobs, a max-heap on (priority, -seq) */
+    int count, capacity;
+    uint64_t seq;
+    int stopping;
+
+    pthread_t threads[POOL_MAX_THREADS];
+    int num_threads;
+
+    /* Metrics, guarded by 'lock' */
+    int running;
+    uint64_t completed, failed;
+    uint64_t bytes_in, bytes_out;
+    double started;
+    uint32_t latency_us[POOL_LATENCY_SAMPLES];
+    uint64_t latency_count;
+} pool_t;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int job_before(const pool_job_t* a, const pool_job_t* b)
+{
+    return a->priority > b->priority || (a->priority == b->priority && a->seq < b->seq);
+}
+
+static void heap_push(pool_t* pool, pool_job_t* job)
+{
+    int i = pool->count++;
+    while (i > 0 && job_before(job, pool->heap[(i - 1) / 2])) {
+        pool->heap[i] = pool->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    pool->heap[i] = job;
+}
+
+static pool_job_t* heap_pop(pool_t* pool)
+{
+    pool_job_t* top = pool->heap[0];
+    pool_job_t* last = pool->heap[--pool->count];
+    int i = 0;
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= pool->count)
+            break;
+        if (child + 1 < pool->count && job_before(pool->heap[child + 1], pool->heap[child]))
+            child++;
+        if (!job_before(pool->heap[child], last))
+            break;
+        pool->heap[i] = pool->heap[child];
+        i = child;
+    }
+    if (pool->count > 0)
+        pool->heap[i] = last;
+    return top;
+}
+
+static void job_error(pool_job_t* job, const char* what, int err)
+{
+    if (err)
+        snprintf(job->error, sizeof(job->error), "%s: %s", what, strerror(err));
+    else
+        snprintf(job->error, sizeof(job->error), "%s", what);
+}
+
+/*
+ * A worker's staging buffer, kept across its jobs.
+ */
+typedef struct {
+    uint8_t* data;
+    size_t capacity;
+} pool_buffer_t;
+
+/* Staging buffers larger than this are released after the job */
+#define POOL_KEEP_BUFFER ((size_t)64 << 20)
+
+static uint8_t* buffer_reserve(pool_buffer_t* buffer, size_t size)
+{
+    if (size > buffer->capacity) {
+        free(buffer->data);
+        buffer->data = (uint8_t*)malloc(size);
+        buffer->capacity = buffer->data ? size : 0;
+    }
+    return buffer->data;
+}
+
+static void buffer_trim(pool_buffer_t* buffer)
+{
+    if (buffer->capacity > POOL_KEEP_BUFFER) {
+        free(buffer->data);
+        buffer->data = NULL;
+        buffer->capacity = 0;
+    }
+}
+
+/*
+ * Run a job with the worker's context and staging buffers. Files are read
+ * and written with pread()/pwrite() rather than mapped: a client that
+ * truncates its file mid-job then fails only that job, where a mapping
+ * would raise SIGBUS and take the whole process down.
+ */
+static void pool_execute(pool_job_t* job, yaz0_cctx_t* cctx, pool_buffer_t* in, pool_buffer_t* out)
+{
+    int in_fd = job->in_fd, out_fd = job->out_fd;
+    size_t out_cap = 0, result = 0;
+    const char* created = NULL;
+    char tmp_path[4096];
+    struct stat st;
+
+    job->in_fd = job->out_fd = -1;
+    job->in_size = job->out_size = 0;
+    job->error[0] = '\0';
+
+    if (!cctx && !job->decompress) {
+        job_error(job, "out of memory", 0);
+        goto done;
+    }
+
+    if (in_fd < 0 && (in_fd = open(job->in_path, O_RDONLY)) < 0) {
+        job_error(job, "cannot open input", errno);
+        goto done;
+    }
+    if (fstat(in_fd, &st) != 0 || st.st_size <= 0) {
+        job_error(job, "input is empty or unreadable", 0);
+        goto done;
+    }
+    if ((uint64_t)st.st_size > YAZ0_MAX_INPUT_SIZE) {
+        job_error(job, "input is too large (limit 4 GiB)", 0);
+        goto done;
+    }
+    job->in_size = (size_t)st.st_size;
+
+    if (!buffer_reserve(in, job->in_size)) {
+        job_error(job, "out of memory", 0);
+        goto done;
+    }
+    ssize_t got = pread_full(in_fd, in->data, job->in_size, 0);
+    if (got < 0) {
+        job_error(job, "cannot read input", errno);
+        goto done;
+    }
+    if ((size_t)got != job->in_size) {
+        job_error(job, "input was truncated while reading", 0);
+        goto done;
+    }
+
+    if (job->decompress) {
+        if (job->in_size < YAZ0_HEADER_SIZE || !yaz0_is_valid(in->data) || yaz0_get_decompressed_size(in->data) == 0) {
+            job_error(job, "input is not a valid Yaz0 stream", 0);
+            goto done;
+        }
+        out_cap = yaz0_get_decompressed_size(in->data);
+    } else {
+        out_cap = FASTYZ_BOUND(job->in_size);
+    }
+    if (!buffer_reserve(out, out_cap)) {
+        job_error(job, "out of memory", 0);
+        goto done;
+    }
+
+    result = job->decompress
+        ? yaz0_decompress64(in->data, job->in_size, out->data, out_cap)
+        : yaz0_compress_cctx(cctx, in->data, job->in_size, out->data, &job->params);
+
+    if (result == 0) {
+        job_error(job, job->decompress ? "decompression failed" : "compression failed (invalid parameters?)", 0);
+        goto done;
+    }
+
+    if (out_fd < 0) {
+        out_fd = job->atomic
+            ? open_temp(job->out_path, tmp_path, sizeof(tmp_path))
+            : open(job->out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out_fd < 0) {
+            job_error(job, "cannot open output", errno);
+            goto done;
+        }
+        created = job->atomic ? tmp_path : job->out_path;
+    }
+    if (pwrite_full(out_fd, out->data, result, 0) != 0) {
+        job_error(job, "cannot write output", errno);
+        goto done;
+    }
+    if (ftruncate(out_fd, (off_t)result) != 0) {
+        job_error(job, "cannot truncate output", errno);
+        goto done;
+    }
+    job->out_size = result;
+
+    if (job->atomic && created && rename(created, job->out_path) != 0)
+        job_error(job, "cannot replace output", errno);
+
+done:
+    if (in_fd >= 0)
+        close(in_fd);
+    if (out_fd >= 0)
+        close(out_fd);
+    if (job->error[0] && created)
+        unlink(created);
+    buffer_trim(in);
+    buffer_trim(out);
+}
+
+static void* pool_worker(void* arg)
+{
+    pool_t* pool = (pool_t*)arg;
+
+    /* Match tables stay allocated (and warm in cache) for all of the worker's jobs */
+    yaz0_cctx_t* cctx = yaz0_cctx_create(NULL);
+    pool_buffer_t in = { NULL, 0 }, out = { NULL, 0 };
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->stopping)
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        if (pool->count == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pool_job_t* job = heap_pop(pool);
+        pool->running++;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_execute(job, cctx, &in, &out);
+        job->latency = now_seconds() - job->queued_at;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->running--;
+        if (job->error[0]) {
+            pool->failed++;
+        } else {
+            pool->completed++;
+            pool->bytes_in += job->in_size;
+            pool->bytes_out += job->out_size;
+        }
+        pool->latency_us[pool->latency_count++ % POOL_LATENCY_SAMPLES] =
+            job->latency * 1e6 < UINT32_MAX ? (uint32_t)(job->latency * 1e6) : UINT32_MAX;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->done(job);
+    }
+
+    free(in.data);
+    free(out.data);
+    yaz0_cctx_free(cctx);
+    return NULL;
+}
+
+/*
+ * Start 'threads' workers (0 for one per processor) for at most
+ * 'capacity' pending jobs. Returns 0 on success.
+ */
+static int pool_start(pool_t* pool, int threads, int capacity)
+{
+    memset(pool, 0, sizeof(*pool));
+
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    if (threads > POOL_MAX_THREADS)
+        threads = POOL_MAX_THREADS;
+
+    pool->heap = (pool_job_t**)malloc(capacity * sizeof(pool_job_t*));
+    if (!pool->heap)
+        return -1;
+    pool->capacity = capacity;
+    pool->started = now_seconds();
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+
+    while (pool->num_threads < threads &&
+           pthread_create(&pool->threads[pool->num_threads], NULL, pool_worker, pool) == 0)
+        pool->num_threads++;
+
+    return pool->num_threads > 0 ? 0 : -1;
+}
+
+/*
+ * Queue a job. Returns -1 if the queue is full.
+ */
+static int pool_submit(pool_t* pool, pool_job_t* job)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count == pool->capacity) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    job->seq = pool->seq++;
+    job->queued_at = now_seconds();
+    heap_push(pool, job);
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/*
+ * Finish the queued jobs and stop the workers. The metrics stay readable
+ * until pool_free().
+ */
+static void pool_stop(pool_t* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    while (pool->num_threads > 0)
+        pthread_join(pool->threads[--pool->num_threads], NULL);
+}
+
+static void pool_free(pool_t* pool)
+{
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->ready);
+    free(pool->heap);
+}
+
+/* Set by SIGINT/SIGTERM in the resident modes (--serve, --watch) */
+static volatile sig_atomic_t stop_requested = 0;
+static int stop_wake_fd = -1;
+
+static void stop_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+    if (write(stop_wake_fd, "s", 1) < 0) {
+        /* Nothing to do; the flag is checked after poll() returns */
+    }
+}
+
+/*
+ * Stop on SIGINT or SIGTERM, waking a poll() loop through the pipe
+ * descriptor 'wake_fd'.
+ */
+static void handle_stop_signals(int wake_fd)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_signal;
+    stop_wake_fd = wake_fd;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+}
+
+static int compare_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Format the pool metrics as "key=value" pairs: queue depth, running and
+ * finished jobs, bytes processed, throughput since start and latency
+ * percentiles (submission to completion) of the recent jobs.
+ */
+static void pool_metrics(pool_t* pool, char* buffer, size_t size)
+{
+    uint32_t latencies[POOL_LATENCY_SAMPLES];
+
+    pthread_mutex_lock(&pool->lock);
+    int n = pool->latency_count < POOL_LATENCY_SAMPLES ? (int)pool->latency_count : POOL_LATENCY_SAMPLES;
+    memcpy(latencies, pool->latency_us, n * sizeof(uint32_t));
+    double uptime = now_seconds() - pool->started;
+    snprintf(buffer, size,
+             "queued=%d running=%d completed=%llu failed=%llu in=%llu out=%llu throughput=%.1fMB/s",
+             pool->count, pool->running, (unsigned long long)pool->completed, (unsigned long long)pool->failed,
+             (unsigned long long)pool->bytes_in, (unsigned long long)pool->bytes_out,
+             pool->bytes_in / (1024.0 * 1024.0) / (uptime > 0 ? uptime : 1));
+    pthread_mutex_unlock(&pool->lock);
+
+    qsort(latencies, n, sizeof(uint32_t), compare_u32);
+    size_t len = strlen(buffer);
+    snprintf(buffer + len, size - len, " p50=%uus p90=%uus p99=%uus",
+             n ? latencies[n * 50 / 100] : 0, n ? latencies[n * 90 / 100] : 0, n ? latencies[n * 99 / 100] : 0);
+}
+
+/* ========================================================================
+ * Compression Server
+ * ======================================================================== */
+
+/*
+ * Protocol: one request per line, fields separated by tabs.
+ *
+ *   compress <priority> <level> <alignment> <strategy> <decode-speed> <input> <output>
+ *   decompress <priority> <input> <output>
+ *   stats
+ *
+ * An <input> or <output> of "-" takes the next descriptor passed with
+ * SCM_RIGHTS on the connection (e.g. a memfd or an open file); the output
+ * descriptor must be opened read-write. Each request is answered with
+ *
+ *   ok <input bytes> <output bytes> <latency in us>
+ *   ok <metrics>                                       (stats)
+ *   error <message>
+ *
+ * A connection has at most one request in flight; clients open more
+ * connections for parallelism.
+ */
+
+#define SERVER_MAX_CLIENTS 256
+#define SERVER_LINE_MAX    8192
+#define SERVER_MAX_FDS     4
+
+typedef struct server server_t;
+
+typedef struct {
+    server_t* server;
+    int fd;                         /* Connection socket, -1 for a free slot */
+    int busy;                       /* Request in flight (guarded by the server lock) */
+    char buffer[SERVER_LINE_MAX];   /* Bytes received, not yet parsed */
+    size_t len;
+    char request[SERVER_LINE_MAX];  /* Request in flight; the job's paths point here */
+    int fds[SERVER_MAX_FDS];        /* Descriptors received, not yet used */
+    int num_fds;
+    pool_job_t job;
+} server_client_t;
+
+struct server {
+    pool_t pool;
+    pthread_mutex_t lock;
+    int wake[2];                    /* Self-pipe for completions and signals */
+    server_client_t clients[SERVER_MAX_CLIENTS];
+};
+
+/*
+ * Send a reply line, ignoring a client that has gone away.
+ */
+static void server_reply(int fd, const char* text)
+{
+    size_t len = strlen(text), sent = 0;
+    while (sent < len) {
+        ssize_t n = send(fd, text + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0 && errno != EINTR)
+            return;
+        if (n > 0)
+            sent += (size_t)n;
+    }
+}
+
+
+static void server_job_done(pool_job_t* job)
+{
+    server_client_t* client = (server_client_t*)job->owner;
+    server_t* server = client->server;
+    char reply[256];
+
+    if (job->error[0]) {
+        snprintf(reply, sizeof(reply), "error %s\n", job->error);
+    } else {
+        snprintf(reply, sizeof(reply), "ok %zu %zu %.0f\n", job->in_size, job->out_size, job->latency * 1e6);
+    }
+    server_reply(client->fd, reply);
+
+    pthread_mutex_lock(&server->lock);
+    client->busy = 0;
+    pthread_mutex_unlock(&server->lock);
+
+    if (write(server->wake[1], "j", 1) < 0) {
+        /* The pipe is full, so the main loop is already due to wake up */
+    }
+}
+
+/*
+ * Take the next received descriptor for a "-" path. Returns -1 if none.
+ */
+static int client_take_fd(server_client_t* client)
+{
+    if (client->num_fds == 0)
+        return -1;
+
+    int fd = client->fds[0];
+    memmove(client->fds, client->fds + 1, --client->num_fds * sizeof(int));
+    return fd;
+}
+
+static void client_close(server_client_t* client)
+{
+    while (client->num_fds > 0)
+        close(client_take_fd(client));
+    close(client->fd);
+    client->fd = -1;
+    client->len = 0;
+}
+
+/*
+ * Parse a request line and queue its job, or answer it directly.
+ */
+static void server_request(server_t* server, server_client_t* client, const char* line)
+{
+    char* fields[8];
+    int num_fields = 0;
+    char reply[512];
+
+    strcpy(client->request, line);
+    for (char* p = client->request; num_fields < 8; ) {
+        fields[num_fields++] = p;
+        p = strchr(p, '\t');
+        if (!p)
+            break;
+        *p++ = '\0';
+    }
+
+    if (num_fields == 1 && strcmp(fields[0], "stats") == 0) {
+        int clients = 0;
+        for (int i = 0; i < SERVER_MAX_CLIENTS; i++)
+            clients += server->clients[i].fd >= 0;
+        strcpy(reply, "ok ");
+        pool_metrics(&server->pool, reply + 3, sizeof(reply) - 4);
+        snprintf(reply + strlen(reply), sizeof(reply) - strlen(reply), " clients=%d\n", clients);
+        server_reply(client->fd, reply);
+        return;
+    }
+
+    pool_job_t* job = &client->job;
+    yaz0_params_init(&job->params);
+
+    if (num_fields == 8 && strcmp(fields[0], "compress") == 0) {
+        job->decompress = 0;
+        job->params.level = atoi(fields[2]);
+        job->params.alignment = atoi(fields[3]);
+        job->params.strategy = atoi(fields[4]);
+        job->params.decode_speed = atoi(fields[5]);
+    } else if (num_fields == 4 && strcmp(fields[0], "decompress") == 0) {
+        job->decompress = 1;
+    } else {
+        server_reply(client->fd, "error malformed request\n");
+        return;
+    }
+
+    job->priority = atoi(fields[1]);
+    job->in_path = fields[num_fields - 2];
+    job->out_path = fields[num_fields - 1];
+    job->in_fd = strcmp(job->in_path, "-") == 0 ? client_take_fd(client) : -1;
+    job->out_fd = strcmp(job->out_path, "-") == 0 ? client_take_fd(client) : -1;
+
+    if ((job->in_fd < 0 && strcmp(job->in_path, "-") == 0) || (job->out_fd < 0 && strcmp(job->out_path, "-") == 0)) {
+        if (job->in_fd >= 0)
+            close(job->in_fd);
+        server_reply(client->fd, "error missing descriptor for '-'\n");
+        return;
+    }
+    if (job->in_fd >= 0)
+        job->in_path = NULL;
+    if (job->out_fd >= 0)
+        job->out_path = NULL;
+
+    job->atomic = 0;
+    job->done = server_job_done;
+    job->owner = client;
+
+    pthread_mutex_lock(&server->lock);
+    client->busy = 1;
+    pthread_mutex_unlock(&server->lock);
+
+    /* The queue holds one job per connection, so it cannot be full */
+    pool_submit(&server->pool, job);
+}
+
+/*
+ * Handle the complete lines received on an idle connection, up to the
+ * first one that starts a job.
+ */
+static void client_process(server_t* server, server_client_t* client)
+{
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        int busy = client->busy;
+        pthread_mutex_unlock(&server->lock);
+
+        char* end = busy ? NULL : (char*)memchr(client->buffer, '\n', client->len);
+        if (!end)
+            return;
+
+        *end = '\0';
+        if (end > client->buffer && end[-1] == '\r')
+            end[-1] = '\0';
+        server_request(server, client, client->buffer);
+
+        client->len -= (size_t)(end + 1 - client->buffer);
+        memmove(client->buffer, end + 1, client->len);
+    }
+}
+
+/*
+ * Read from a connection, collecting passed descriptors. Returns -1 if
+ * the connection should be closed.
+ */
+static int client_read(server_client_t* client)
+{
+    char control[CMSG_SPACE(SERVER_MAX_FDS * sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+
+    if (client->len == sizeof(client->buffer)) {
+        server_reply(client->fd, "error request too long\n");
+        return -1;
+    }
+
+    iov.iov_base = client->buffer + client->len;
+    iov.iov_len = sizeof(client->buffer) - client->len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(client->fd, &msg, 0);
+    if (n < 0 && errno == EINTR)
+        return 0;
+
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        int count = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+            if (client->num_fds < SERVER_MAX_FDS) {
+                client->fds[client->num_fds++] = fd;
+            } else {
+                close(fd);
+            }
+        }
+    }
+
+    if (n <= 0)
+        return -1;
+    client->len += (size_t)n;
+    return 0;
+}
+
+/*
+ * Create the listening socket, replacing a stale socket file left by a
+ * server that is no longer running.
+ */
+static int server_listen(const char* path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "Error: A server is already listening on '%s'\n", path);
+        close(fd);
+        return -1;
+    }
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        fprintf(stderr, "Error: Cannot listen on '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Run the compression server on a Unix domain socket until SIGINT or
+ * SIGTERM. Queued jobs are finished before it exits.
+ */
+static int do_serve(const char* path, int threads)
+{
+    server_t* server = (server_t*)calloc(1, sizeof(server_t));
+    if (!server) {
+        fprintf(stderr, "Error: Failed to allocate server state\n");
+        return 1;
+    }
+
+    int listener = server_listen(path);
+    if (listener < 0) {
+        free(server);
+        return 1;
+    }
+
+    if (pipe(server->wake) != 0 || pool_start(&server->pool, threads, SERVER_MAX_CLIENTS) != 0) {
+        fprintf(stderr, "Error: Failed to start worker threads\n");
+        close(listener);
+        unlink(path);
+        free(server);
+        return 1;
+    }
+    fcntl(server->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(server->wake[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&server->lock, NULL);
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        server->clients[i].server = server;
+        server->clients[i].fd = -1;
+    }
+
+    handle_stop_signals(server->wake[1]);
+
+    printf("Serving on %s with %d worker threads\n", path, server->pool.num_threads);
+    fflush(stdout);
+
+    struct pollfd fds[SERVER_MAX_CLIENTS + 2];
+    int slots[SERVER_MAX_CLIENTS];
+
+    while (!stop_requested) {
+        int n = 0, free_slot = -1;
+
+        fds[n].fd = server->wake[0];
+        fds[n++].events = POLLIN;
+
+        pthread_mutex_lock(&server->lock);
+        for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+            server_client_t* client = &server->clients[i];
+            if (client->fd < 0) {
+                if (free_slot < 0)
+                    free_slot = i;
+            } else if (!client->busy) {
+                slots[n - 1] = i;
+                fds[n].fd = client->fd;
+                fds[n++].events = POLLIN;
+            }
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        /* Stop accepting while every slot is taken */
+        int clients_end = n;
+        if (free_slot >= 0) {
+            fds[n].fd = listener;
+            fds[n++].events = POLLIN;
+        }
+
+        if (poll(fds, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error: poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents) {
+            char drain[64];
+            while (read(server->wake[0], drain, sizeof(drain)) > 0) {
+            }
+
+            /* Requests that arrived while their connection was busy */
+            for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+                if (server->clients[i].fd >= 0)
+                    client_process(server, &server->clients[i]);
+            }
+        }
+
+        for (int k = 1; k < clients_end; k++) {
+            if (!fds[k].revents)
+                continue;
+            server_client_t* client = &server->clients[slots[k - 1]];
+            if (client_read(client) != 0) {
+                client_close(client);
+                continue;
+            }
+            client_process(server, client);
+        }
+
+        if (free_slot >= 0 && fds[n - 1].revents) {
+            int fd = accept(listener, NULL, NULL);
+            if (fd >= 0) {
+                server->clients[free_slot].fd = fd;
+                server->clients[free_slot].len = 0;
+                server->clients[free_slot].busy = 0;
+            }
+        }
+    }
+
+    close(listener);
+    unlink(path);
+    pool_stop(&server->pool);
+
+    char metrics[256];
+    pool_metrics(&server->pool, metrics, sizeof(metrics));
+    printf("Stopped: %s\n", metrics);
+    pool_free(&server->pool);
+
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (server->clients[i].fd >= 0)
+            client_close(&server->clients[i]);
+    }
+    pthread_mutex_destroy(&server->lock);
+    close(server->wake[0]);
+    close(server->wake[1]);
+    free(server);
+    return 0;
+}
+
+/* ========================================================================
+ * Server Client
+ * ======================================================================== */
+
+static int server_connect(const char* path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error: Cannot connect to server at '%s': %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Send a request with up to two descriptors and read the reply line.
+ * Returns 0 if the server answered "ok", with the rest of the reply in
+ * 'reply'.
+ */
+static int server_call(int sock, const char* request, const int* fds, int num_fds, char* reply, size_t size)
+{
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void*)request;
+    iov.iov_len = strlen(request);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (num_fds > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+        struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+        memcpy(CMSG_DATA(c), fds, num_fds * sizeof(int));
+    }
+
+    /* The request is short, so one call sends all of it */
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t)iov.iov_len) {
+        snprintf(reply, size, "cannot send request: %s", strerror(errno));
+        return -1;
+    }
+
+    size_t len = 0;
+    while (len + 1 < size) {
+        ssize_t n = recv(sock, reply + len, 1, 0);
+        if (n <= 0) {
+            snprintf(reply, size, "server closed the connection");
+            return -1;
+        }
+        if (reply[len] == '\n')
+            break;
+        len++;
+    }
+    reply[len] = '\0';
+
+    if (strncmp(reply, "ok ", 3) == 0) {
+        memmove(reply, reply + 3, len - 2);
+        return 0;
+    }
+    if (strncmp(reply, "error ", 6) == 0)
+        memmove(reply, reply + 6, len - 5);
+    return -1;
+}
+
+/*
+ * Compress or decompress a file on a running server. The files are opened
+ * here and passed as descriptors, so relative paths and permissions are
+ * the client's.
+ */
+static int do_remote(const char* socket_path, const char* input_file, const char* output_file, int decompress,
+                     const yaz0_params_t* params, int priority)
+{
+    char request[256], reply[512];
+    size_t in_size = 0, out_size = 0;
+    double latency = 0;
+
+    int sock = server_connect(socket_path);
+    if (sock < 0)
+        return 1;
+
+    int fds[2];
+    fds[0] = open(input_file, O_RDONLY);
+    if (fds[0] < 0) {
+        fprintf(stderr, "Error: Cannot open '%s' for reading\n", input_file);
+        close(sock);
+        return 1;
+    }
+    fds[1] = open(output_file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fds[1] < 0) {
+        fprintf(stderr, "Error: Cannot open '%s' for writing\n", output_file);
+        close(fds[0]);
+        close(sock);
+        return 1;
+    }
+
+    if (decompress) {
+        snprintf(request, sizeof(request), "decompress\t%d\t-\t-\n", priority);
+    } else {
+        snprintf(request, sizeof(request), "compress\t%d\t%d\t%d\t%d\t%d\t-\t-\n", priority, params->level,
+                 params->alignment, params->strategy, params->decode_speed);
+    }
+
+    int result = server_call(sock, request, fds, 2, reply, sizeof(reply));
+    close(fds[0]);
+    close(fds[1]);
+    close(sock);
+
+    if (result != 0 || sscanf(reply, "%zu %zu %lf", &in_size, &out_size, &latency) != 3) {
+        fprintf(stderr, "Error: %s\n", result != 0 ? reply : "malformed server reply");
+        unlink(output_file);
+        return 1;
+    }
+
+    printf("%s: %s -> %s\n", decompress ? "Decompressed" : "Compressed", input_file, output_file);
+    printf("  Input:      %zu bytes\n", in_size);
+    printf("  Output:     %zu bytes\n", out_size);
+    printf("  Latency:    %.3f ms (server)\n", latency / 1000.0);
+    return 0;
+}
+
+static int do_remote_stats(const char* socket_path)
+{
+    char reply[512];
+
+    int sock = server_connect(socket_path);
+    if (sock < 0)
+        return 1;
+
+    int result = server_call(sock, "stats\n", NULL, 0, reply, sizeof(reply));
+    close(sock);
+
+    if (result != 0) {
+        fprintf(stderr, "Error: %s\n", reply);
+        return 1;
+    }
+    printf("%s\n", reply);
+    return 0;
+}
+
+#endif /* HAVE_SERVER */
+
+#if defined(HAVE_WATCH)
+
+/* ========================================================================
+ * Watch Mode
+ * ======================================================================== */
+
+/* Quiet time after the last write to a file before it is compressed */
+#define WATCH_DEBOUNCE 0.1
+
+/* Pending compressions the pool holds; further files wait for a slot */
+#define WATCH_QUEUE 1024
+
+typedef enum {
+    WATCH_IDLE,      /* Output is up to date */
+    WATCH_PENDING,   /* Changed; compress once 'due' has passed */
+    WATCH_RUNNING    /* Queued or being compressed */
+} watch_state_t;
+
+typedef struct watch watch_t;
+
+/*
+ * A source file that has changed at least once.
+ */
+typedef struct {
+    watch_t* watch;
+    char* source;
+    char* output;
+    watch_state_t state;
+    int dirty;                  /* Changed again while running */
+    double due;
+    int heap_index;             /* Position in the pending heap, -1 if not pending */
+    pool_job_t job;
+} watch_file_t;
+
+typedef struct {
+    int wd;                     /* inotify watch descriptor, -1 once removed */
+    char* path;
+} watch_dir_t;
+
+struct watch {
+    pool_t pool;
+    pthread_mutex_t lock;       /* Guards the file states and stdout */
+    int inotify;
+    int wake[2];                /* Self-pipe for completions and signals */
+    const char* root;
+    const char* out_root;       /* NULL to write outputs next to their sources */
+    yaz0_params_t params;
+
+    watch_dir_t* dirs;
+    int num_dirs, cap_dirs;
+    watch_file_t** files;       /* Hash table keyed by source path, open addressing */
+    int num_files, cap_files;   /* cap_files is 0 or a power of two */
+    watch_file_t** pending;     /* Pending files, a min-heap on 'due' */
+    int num_pending, cap_pending;
+};
+
+/*
+ * Files that are compressed: everything except hidden files (including
+ * the temporary outputs), editor backups and compressed files.
+ */
+static int watch_is_source(const char* name)
+{
+    size_t len = strlen(name);
+
+    return name[0] != '.' && len > 0 && name[len - 1] != '~' &&
+           !str_ends_with_i(name, ".yaz0") && !str_ends_with_i(name, ".szs") && !str_ends_with_i(name, ".carc");
+}
+
+static char* path_join(const char* dir, const char* name)
+{
+    char* path = (char*)malloc(strlen(dir) + strlen(name) + 2);
+    if (path)
+        sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+static char* watch_output_path(const watch_t* watch, const char* source)
+{
+    const char* rel = source + strlen(watch->root) + 1;
+    char* output;
+
+    if (!watch->out_root) {
+        output = (char*)malloc(strlen(source) + 6);
+        if (output)
+            sprintf(output, "%s.yaz0", source);
+        return output;
+    }
+
+    output = (char*)malloc(strlen(watch->out_root) + strlen(rel) + 7);
+    if (output) {
+        sprintf(output, "%s/%s.yaz0", watch->out_root, rel);
+        make_parents(output);
+    }
+    return output;
+}
+
+/*
+ * Hash of a path (FNV-1a) for the file table.
+ */
+static uint32_t path_hash(const char* path)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*path)
+        hash = (hash ^ (uint8_t)*path++) * 16777619u;
+    return hash;
+}
+
+/*
+ * Slot of 'source' in the file table, or the empty slot where it belongs.
+ * The table must not be empty.
+ */
+static watch_file_t** watch_slot(const watch_t* watch, const char* source)
+{
+    uint32_t mask = (uint32_t)watch->cap_files - 1;
+
+    for (uint32_t i = path_hash(source) & mask; ; i = (i + 1) & mask) {
+        watch_file_t** slot = &watch->files[i];
+        if (!*slot || strcmp((*slot)->source, source) == 0)
+            return slot;
+    }
+}
+
+static watch_file_t* watch_find(const watch_t* watch, const char* source)
+{
+    return watch->cap_files ? *watch_slot(watch, source) : NULL;
+}
+
+/*
+ * Make room for one more file: the table stays at most half full, and the
+ * pending heap can hold every file, so that pushing onto it cannot fail.
+ */
+static int watch_reserve(watch_t* watch)
+{
+    if (watch->num_files == watch->cap_pending) {
+        int cap = watch->cap_pending ? watch->cap_pending * 2 : 64;
+        watch_file_t** pending = (watch_file_t**)realloc(watch->pending, cap * sizeof(watch_file_t*));
+        if (!pending)
+            return -1;
+        watch->pending = pending;
+        watch->cap_pending = cap;
+    }
+
+    if (2 * (watch->num_files + 1) > watch->cap_files) {
+        int cap = watch->cap_files ? watch->cap_files * 2 : 128;
+        watch_file_t** old = watch->files;
+        int old_cap = watch->cap_files;
+
+        watch->files = (watch_file_t**)calloc(cap, sizeof(watch_file_t*));
+        if (!watch->files) {
+            watch->files = old;
+            return -1;
+        }
+        watch->cap_files = cap;
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i])
+                *watch_slot(watch, old[i]->source) = old[i];
+        }
+        free(old);
+    }
+    return 0;
+}
+
+static void pending_place(watch_t* watch, int i, watch_file_t* file)
+{
+    watch->pending[i] = file;
+    file->heap_index = i;
+}
+
+/*
+ * Restore the heap order around position 'i' after its due time changed.
+ */
+static void pending_sift(watch_t* watch, int i)
+{
+    watch_file_t* file = watch->pending[i];
+
+    while (i > 0 && file->due < watch->pending[(i - 1) / 2]->due) {
+        pending_place(watch, i, watch->pending[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= watch->num_pending)
+            break;
+        if (child + 1 < watch->num_pending && watch->pending[child + 1]->due < watch->pending[child]->due)
+            child++;
+        if (!(watch->pending[child]->due < file->due))
+            break;
+        pending_place(watch, i, watch->pending[child]);
+        i = child;
+    }
+    pending_place(watch, i, file);
+}
+
+/* Capacity is reserved by watch_reserve() when the file is added */
+static void pending_push(watch_t* watch, watch_file_t* file)
+{
+    pending_place(watch, watch->num_pending++, file);
+    pending_sift(watch, file->heap_index);
+}
+
+static void pending_remove(watch_t* watch, watch_file_t* file)
+{
+    int i = file->heap_index;
+    watch_file_t* last = watch->pending[--watch->num_pending];
+
+    file->heap_index = -1;
+    if (last != file) {
+        pending_place(watch, i, last);
+        pending_sift(watch, i);
+    }
+}
+
+/*
+ * Mark a source file changed, compressing it 'delay' seconds from now
+ * unless it changes again first. Called with the lock held.
+ */
+static void watch_schedule(watch_t* watch, const char* source, double delay)
+{
+    watch_file_t* file = watch_find(watch, source);
+
+    if (!file) {
+        if (watch_reserve(watch) != 0)
+            return;
+
+        file = (watch_file_t*)calloc(1, sizeof(watch_file_t));
+        if (!file)
+            return;
+        file->watch = watch;
+        file->source = strdup(source);
+        file->output = watch_output_path(watch, source);
+        file->heap_index = -1;
+        if (!file->source || !file->output) {
+            free(file->source);
+            free(file->output);
+            free(file);
+            return;
+        }
+        *watch_slot(watch, source) = file;
+        watch->num_files++;
+    }
+
+    if (file->state == WATCH_RUNNING) {
+        file->dirty = 1;
+    } else {
+        file->state = WATCH_PENDING;
+        file->due = now_seconds() + delay;
+        if (file->heap_index < 0)
+            pending_push(watch, file);
+        else
+            pending_sift(watch, file->heap_index);
+    }
+}
+
+/*
+ * Forget a pending change of a source file that was deleted or moved
+ * away (e.g. an editor's temporary file). Called with the lock held.
+ */
+static void watch_cancel(watch_t* watch, const char* source)
+{
+    watch_file_t* file = watch_find(watch, source);
+
+    if (file) {
+        if (file->state == WATCH_PENDING) {
+            pending_remove(watch, file);
+            file->state = WATCH_IDLE;
+        }
+        file->dirty = 0;
+    }
+}
+
+/*
+ * Whether the output of 'source' is missing or older than the source.
+ */
+static int watch_is_stale(const watch_t* watch, const char* source)
+{
+    struct stat src, out;
+    char* output = watch_output_path(watch, source);
+    int stale = !output || stat(output, &out) != 0 ||
+                (stat(source, &src) == 0 && STAT_MTIME_NS(src) >= STAT_MTIME_NS(out));
+    free(output);
+    return stale;
+}
+
+/*
+ * Watch a directory and its subdirectories, scheduling source files whose
+ * output is stale. Called with the lock held.
+ */
+static void watch_add_dir(watch_t* watch, const char* path)
+{
+    if (watch->out_root && strcmp(path, watch->out_root) == 0)
+        return;
+
+    int wd = inotify_add_watch(watch->inotify, path,
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR);
+    if (wd < 0) {
+        fprintf(stderr, "Error: Cannot watch '%s': %s\n", path, strerror(errno));
+        return;
+    }
+
+    if (watch->num_dirs == watch->cap_dirs) {
+        int cap = watch->cap_dirs ? watch->cap_dirs * 2 : 16;
+        watch_dir_t* dirs = (watch_dir_t*)realloc(watch->dirs, cap * sizeof(watch_dir_t));
+        if (!dirs)
+            return;
+        watch->dirs = dirs;
+        watch->cap_dirs = cap;
+    }
+
+    /* inotify returns the same descriptor for a directory watched twice */
+    int known = 0;
+    for (int i = 0; i < watch->num_dirs; i++)
+        known |= watch->dirs[i].wd == wd;
+    if (!known) {
+        watch->dirs[watch->num_dirs].wd = wd;
+        watch->dirs[watch->num_dirs].path = strdup(path);
+        watch->num_dirs++;
+    }
+
+    DIR* dir = opendir(path);
+    if (!dir)
+        return;
+
+    for (struct dirent* entry; (entry = readdir(dir)) != NULL; ) {
+        struct stat st;
+        if (entry->d_name[0] == '.')
+            continue;
+
+        char* child = path_join(path, entry->d_name);
+        if (!child || stat(child, &st) != 0) {
+            free(child);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            watch_add_dir(watch, child);
+        } else if (S_ISREG(st.st_mode) && watch_is_source(entry->d_name) && watch_is_stale(watch, child)) {
+            watch_schedule(watch, child, 0);
+        }
+        free(child);
+    }
+    closedir(dir);
+}
+
+static void watch_job_done(pool_job_t* job)
+{
+    watch_file_t* file = (watch_file_t*)job->owner;
+    watch_t* watch = file->watch;
+
+    pthread_mutex_lock(&watch->lock);
+    if (job->error[0]) {
+        fprintf(stderr, "Error: %s: %s\n", file->source, job->error);
+    } else {
+        printf("Compressed: %s -> %s (%zu -> %zu bytes, %.1f ms)\n",
+               file->source, file->output, job->in_size, job->out_size, job->latency * 1000.0);
+        fflush(stdout);
+    }
+
+    if (file->dirty) {
+        file->dirty = 0;
+        file->state = WATCH_PENDING;
+        file->due = now_seconds() + WATCH_DEBOUNCE;
+        pending_push(watch, file);
+    } else {
+        file->state = WATCH_IDLE;
+    }
+    pthread_mutex_unlock(&watch->lock);
+
+    if (write(watch->wake[1], "j", 1) < 0) {
+        /* The pipe is full, so the main loop is already due to wake up */
+    }
+}
+
+/*
+ * Queue the files whose quiet time has passed. Returns the poll() timeout
+ * until the next one is due, or -1 if none is pending.
+ */
+static int watch_dispatch(watch_t* watch)
+{
+    double now = now_seconds(), next = -1;
+
+    pthread_mutex_lock(&watch->lock);
+    while (watch->num_pending > 0 && watch->pending[0]->due <= now) {
+        watch_file_t* file = watch->pending[0];
+        pool_job_t* job = &file->job;
+
+        pending_remove(watch, file);
+        memset(job, 0, sizeof(*job));
+        job->params = watch->params;
+        job->in_fd = job->out_fd = -1;
+        job->in_path = file->source;
+        job->out_path = file->output;
+        job->atomic = 1;
+        job->done = watch_job_done;
+        job->owner = file;
+
+        file->state = WATCH_RUNNING;
+        if (pool_submit(&watch->pool, job) == 0)
+            continue;
+
+        /* Queue full; try again after another quiet period */
+        file->state = WATCH_PENDING;
+        file->due = now + WATCH_DEBOUNCE;
+        pending_push(watch, file);
+    }
+    if (watch->num_pending > 0)
+        next = watch->pending[0]->due;
+    pthread_mutex_unlock(&watch->lock);
+
+    return next < 0 ? -1 : (int)((next - now) * 1000.0) + 1;
+}
+
+/*
+ * Handle the pending inotify events.
+ */
+static void watch_read_events(watch_t* watch)
+{
+    char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(watch->inotify, buffer, sizeof(buffer));
+        if (len <= 0)
+            return;
+
+        pthread_mutex_lock(&watch->lock);
+        for (char* p = buffer; p < buffer + len; ) {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                /* Events were lost: rescan everything for stale outputs */
+                watch_add_dir(watch, watch->root);
+                continue;
+            }
+
+            watch_dir_t* dir = NULL;
+            for (int i = 0; i < watch->num_dirs && !dir; i++) {
+                if (watch->dirs[i].wd == event->wd)
+                    dir = &watch->dirs[i];
+            }
+            if (!dir)
+                continue;
+
+            if (event->mask & IN_IGNORED) {
+                dir->wd = -1;
+                continue;
+            }
+            if (!event->len || event->name[0] == '.')
+                continue;
+
+            char* path = path_join(dir->path, event->name);
+            if (!path)
+                continue;
+
+            if (event->mask & IN_ISDIR) {
+                /* New or moved-in directory: watch it and compress its contents */
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    watch_add_dir(watch, path);
+            } else if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && watch_is_source(event->name)) {
+                watch_schedule(watch, path, WATCH_DEBOUNCE);
+            } else if (event->mask & (IN_MOVED_FROM | IN_DELETE)) {
+                watch_cancel(watch, path);
+            }
+            free(path);
+        }
+        pthread_mutex_unlock(&watch->lock);
+    }
+}
+
+/*
+ * Compress the source files under 'root' whenever they change, until
+ * SIGINT or SIGTERM. Outputs (<file>.yaz0, next to the source or mirrored
+ * under 'out_root') are replaced atomically.
+ */
+static int do_watch(const char* root, const char* out_root, const yaz0_params_t* params, int threads)
+{
+    watch_t* watch = (watch_t*)calloc(1, sizeof(watch_t));
+    char* real_root = realpath(root, NULL);
+    char* real_out = NULL;
+    int result = 1;
+
+    if (!watch || !real_root) {
+        fprintf(stderr, "Error: Cannot watch '%s'\n", root);
+        free(watch);
+        free(real_root);
+        return 1;
+    }
+    if (out_root) {
+        mkdir(out_root, 0777);
+        real_out = realpath(out_root, NULL);
+        if (!real_out) {
+            fprintf(stderr, "Error: Cannot create output directory '%s'\n", out_root);
+            goto done;
+        }
+    }
+
+    watch->root = real_root;
+    watch->out_root = real_out;
+    watch->params = *params;
+    watch->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->inotify < 0 || pipe(watch->wake) != 0 || pool_start(&watch->pool, threads, WATCH_QUEUE) != 0) {
+        fprintf(stderr, "Error: Failed to start watching: %s\n", strerror(errno));
+        goto done;
+    }
+    fcntl(watch->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(watch->wake[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&watch->lock, NULL);
+    handle_stop_signals(watch->wake[1]);
+
+    pthread_mutex_lock(&watch->lock);
+    watch_add_dir(watch, real_root);
+    printf("Watching %s (%d directories) with %d worker threads\n", real_root, watch->num_dirs,
+           watch->pool.num_threads);
+    fflush(stdout);
+    pthread_mutex_unlock(&watch->lock);
+
+    while (!stop_requested) {
+        struct pollfd fds[2];
+        fds[0].fd = watch->inotify;
+        fds[0].events = POLLIN;
+        fds[1].fd = watch->wake[0];
+        fds[1].events = POLLIN;
+
+        if (poll(fds, 2, watch_dispatch(watch)) < 0 && errno != EINTR) {
+            fprintf(stderr, "Error: poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents) {
+            char drain[64];
+            while (read(watch->wake[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+        if (fds[0].revents)
+            watch_read_events(watch);
+    }
+
+    pool_stop(&watch->pool);
+    pool_free(&watch->pool);
+    pthread_mutex_destroy(&watch->lock);
+    result = 0;
+
+done:
+    if (watch->inotify > 0)
+        close(watch->inotify);
+    if (watch->wake[0] > 0) {
+        close(watch->wake[0]);
+        close(watch->wake[1]);
+    }
+    for (int i = 0; i < watch->cap_files; i++) {
+        if (watch->files[i]) {
+            free(watch->files[i]->source);
+            free(watch->files[i]->output);
+            free(watch->files[i]);
+        }
+    }
+    for (int i = 0; i < watch->num_dirs; i++)
+        free(watch->dirs[i].path);
+    free(watch->files);
+    free(watch->pending);
+    free(watch->dirs);
+    free(watch);
+    free(real_root);
+    free(real_out);
+    return result;
+}
+
+#endif /* HAVE_WATCH */
+
+/* ========================================================================
+ * Usage and Main
+ * ======================================================================== */
+
+static void print_usage(void)
+{
+    printf("FastYZ v%s - Fast Yaz0 compression\n", PROGRAM_VERSION);
+    printf("\n");
+    printf("Usage: %s [options] <input>\n", PROGRAM_NAME);
+    printf("       %s --train -o <dict> <samples...>\n", PROGRAM_NAME);
+    printf("       %s --recompress [options] <files...>\n", PROGRAM_NAME);
+    printf("       %s --serve <socket> [-j <n>]\n", PROGRAM_NAME);
+    printf("       %s --watch <dir> [-o <outdir>] [options]\n", PROGRAM_NAME);
+    printf("       %s --connect <socket> [options] <input> | --stats\n", PROGRAM_NAME);
+    printf("\n");
+    printf("Options:\n");
+    printf("  -c          Force compression mode\n");
+    printf("  -d          Force decompression mode\n");
+    printf("  -o <file>   Specify output filename\n");
+    printf("  -a <n>      Match search alignment for record data (1, 2, 4, 8, 16\n");
+    printf("              or 'auto'; default 1)\n");
+    printf("  --pipeline  Compress with separate match search and encoder threads\n");
+    printf("  --budget <ms>\n");
+    printf("              Compress as well as possible within a time budget\n");
+    printf("  --fit <n>   Use the lowest level (from -l) whose output fits in n bytes\n");
+    printf("  --adaptive  Pick the match search per 64 KiB region of mixed data\n");
+    printf("  --decode-speed <n>\n");
+    printf("              Favor faster decoding over ratio (0-9; default 0)\n");
+    printf("  -l <n>      Compression level (0 = fastest, 1-9 = hash chain parser;\n");
+    printf("              default 0, or 9 with --recompress)\n");
+    printf("  -D <dict>   Compress or decompress with a preset dictionary\n");
+    printf("  --train     Train a dictionary from the sample files (requires -o)\n");
+    printf("  --recompress\n");
+    printf("              Re-encode Yaz0 files in place, keeping any that do not shrink\n");
+    printf("  -j <n>      Threads for --recompress (default: one per processor)\n");
+    printf("  --cache <dir>\n");
+    printf("              Reuse outputs of -c and --recompress stored in dir, and\n");
+    printf("              store new ones\n");
+    printf("  --cache-size <MiB>\n");
+    printf("              Size limit of the cache; least recently used outputs are\n");
+    printf("              deleted first (default 1024)\n");
+    printf("  --progress  Show progress on stderr while compressing or decompressing\n");
+    printf("  --serve <socket>\n");
+    printf("              Run a compression server on a Unix domain socket (-j workers)\n");
+    printf("  --connect <socket>\n");
+    printf("              Compress or decompress on a running server\n");
+    printf("  --priority <n>\n");
+    printf("              Priority of --connect requests (higher runs first; default 0)\n");
+    printf("  --stats     With --connect: print the server's queue, throughput and latency\n");
+    printf("  --watch <dir>\n");
+    printf("              Compress files under dir to <file>.yaz0 (or into -o <outdir>)\n");
+    printf("              whenever they change\n");
+    printf("  -h, --help  Show this help message\n");
+    printf("  -v          Show version information\n");
+    printf("\n");
+    printf("If no mode is specified, the operation is auto-detected:\n");
+    printf("  - Files with .yaz0, .szs, or .carc extension are decompressed\n");
+    printf("  - Files starting with 'Yaz0' magic are decompressed\n");
+    printf("  - All other files are compressed\n");
+    printf("\n");
+    printf("Examples:\n");
+    printf("  %s file.bin                 Compress to file.bin.yaz0\n", PROGRAM_NAME);
+    printf("  %s -c file.bin -o out.szs   Compress to out.szs\n", PROGRAM_NAME);
+    printf("  %s file.yaz0                Decompress to file\n", PROGRAM_NAME);
+    printf("  %s -d data.szs -o raw.bin   Decompress to raw.bin\n", PROGRAM_NAME);
+    printf("  %s --train -o msg.dict *.msg\n", PROGRAM_NAME);
+    printf("                              Train a dictionary for small files\n");
+    printf("  %s -D msg.dict a.msg        Compress a.msg using msg.dict\n", PROGRAM_NAME);
+    printf("  %s --recompress *.szs       Re-encode archives at level 9\n", PROGRAM_NAME);
+}
+
+static void print_version(void)
+{
+    printf("FastYZ v%s\n", PROGRAM_VERSION);
+    printf("Fast Yaz0 compression based on FastLZ\n");
+    printf("https://github.com/your-username/fastyz\n");
+}
+
+int main(int argc, char* argv[])
+{
+    operation_mode_t mode = MODE_AUTO;
+    const char* input_file = NULL;
+    const char* output_file = NULL;
+    const char* dict_file = NULL;
+    const char** sample_files = NULL;
+    int num_samples = 0;
+    int level = -1;
+    int threads = 0;
+    char* generated_output = NULL;
+    yaz0_params_t params;
+    int pipelined = 0;
+    double budget = 0;
+    long fit = 0;
+    const char* serve_path = NULL;
+    const char* connect_path = NULL;
+    const char* watch_path = NULL;
+    const char* cache_path = NULL;
+    long cache_mb = 0;
+    int priority = 0;
+    int stats = 0;
+
+    yaz0_params_init(&params);
+
+    /* Parse command-line arguments */
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            mode = MODE_COMPRESS;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            mode = MODE_DECOMPRESS;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -o requires an argument\n");
+                return 1;
+            }
+            output_file = argv[++i];
+        } else if (strcmp(argv[i], "-a") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -a requires an argument\n");
+                return 1;
+            }
+            ++i;
+            params.alignment = strcmp(argv[i], "auto") == 0 ? 0 : atoi(argv[i]);
+            if (params.alignment != 0 && params.alignment != 1 && params.alignment != 2 &&
+                params.alignment != 4 && params.alignment != 8 && params.alignment != 16) {
+                fprintf(stderr, "Error: Invalid alignment '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-D") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -D requires an argument\n");
+                return 1;
+            }
+            dict_file = argv[++i];
+        } else if (strcmp(argv[i], "--train") == 0) {
+            mode = MODE_TRAIN;
+        } else if (strcmp(argv[i], "--recompress") == 0) {
+            mode = MODE_RECOMPRESS;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -l requires an argument\n");
+                return 1;
+            }
+            level = atoi(argv[++i]);
+            if (level < 0 || level > 9) {
+                fprintf(stderr, "Error: Invalid level '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -j requires an argument\n");
+                return 1;
+            }
+            threads = atoi(argv[++i]);
+            if (threads < 1) {
+                fprintf(stderr, "Error: Invalid thread count '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            pipelined = 1;
+        } else if (strcmp(argv[i], "--budget") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --budget requires an argument\n");
+                return 1;
+            }
+            budget = atof(argv[++i]) / 1000.0;
+            if (budget <= 0) {
+                fprintf(stderr, "Error: Invalid time budget '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--fit") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --fit requires an argument\n");
+                return 1;
+            }
+            fit = atol(argv[++i]);
+            if (fit < YAZ0_HEADER_SIZE) {
+                fprintf(stderr, "Error: Invalid target size '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--serve") == 0 || strcmp(argv[i], "--connect") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                return 1;
+            }
+            if (argv[i][2] == 's') {
+                serve_path = argv[++i];
+            } else {
+                connect_path = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --watch requires an argument\n");
+                return 1;
+            }
+            watch_path = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --cache requires an argument\n");
+                return 1;
+            }
+            cache_path = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --cache-size requires an argument\n");
+                return 1;
+            }
+            cache_mb = atol(argv[++i]);
+            if (cache_mb < 1) {
+                fprintf(stderr, "Error: Invalid cache size '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--priority") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --priority requires an argument\n");
+                return 1;
+            }
+            priority = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "--progress") == 0) {
+            show_progress = 1;
+        } else if (strcmp(argv[i], "--adaptive") == 0) {
+            params.strategy = YAZ0_STRATEGY_ADAPTIVE;
+        } else if (strcmp(argv[i], "--decode-speed") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --decode-speed requires an argument\n");
+                return 1;
+            }
+            params.decode_speed = atoi(argv[++i]);
+            if (params.decode_speed < 0 || params.decode_speed > 9) {
+                fprintf(stderr, "Error: Invalid decode speed '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage();
+            return 0;
+        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--version") == 0) {
+            print_version();
+            return 0;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+            return 1;
+        } else {
+            if (!sample_files) {
+                sample_files = (const char**)malloc(argc * sizeof(const char*));
+                if (!sample_files) {
+                    fprintf(stderr, "Error: Failed to allocate input list\n");
+                    return 1;
+                }
+            }
+            sample_files[num_samples++] = argv[i];
+            input_file = sample_files[0];
+        }
+    }
+
+    if (cache_path) {
+#if defined(HAVE_CACHE)
+        cache_dir = cache_path;
+        if (cache_mb > 0)
+            cache_limit = cache_mb * 1024LL * 1024;
+#else
+        fprintf(stderr, "Error: --cache is not supported on this platform\n");
+        free(sample_files);
+        return 1;
+#endif
+    }
+
+    if (watch_path) {
+        free(sample_files);
+#if defined(HAVE_WATCH)
+        if (level >= 0)
+            params.level = level;
+        return do_watch(watch_path, output_file, &params, threads);
+#else
+        fprintf(stderr, "Error: --watch is not supported on this platform\n");
+        return 1;
+#endif
+    }
+
+    if (serve_path || connect_path) {
+#if defined(HAVE_SERVER)
+        if (serve_path) {
+            free(sample_files);
+            return do_serve(serve_path, threads);
+        }
+        if (stats) {
+            free(sample_files);
+            return do_remote_stats(connect_path);
+        }
+        if (dict_file || fit > 0 || budget > 0 || pipelined || mode == MODE_TRAIN || mode == MODE_RECOMPRESS) {
+            fprintf(stderr, "Error: --connect does not support -D, --fit, --budget, --pipeline, --train or --recompress\n");
+            free(sample_files);
+            return 1;
+        }
+#else
+        (void)priority;
+        (void)stats;
+        fprintf(stderr, "Error: --serve and --connect are not supported on this platform\n");
+        free(sample_files);
+        return 1;
+#endif
+    }
+
+    if (mode == MODE_TRAIN) {
+        if (!output_file || num_samples == 0) {
+            fprintf(stderr, "Error: --train requires -o <dict> and at least one sample file\n");
+            free(sample_files);
+            return 1;
+        }
+        int result = do_train(sample_files, num_samples, output_file);
+        free(sample_files);
+        return result;
+    }
+
+    if (mode == MODE_RECOMPRESS) {
+        if (num_samples == 0 || (output_file && num_samples > 1)) {
+            fprintf(stderr, "Error: --recompress requires input files (and -o only with one file)\n");
+            free(sample_files);
+            return 1;
+        }
+        params.level = level < 0 ? 9 : level;
+        int result = do_recompress(sample_files, num_samples, output_file, &params, threads);
+        free(sample_files);
+        return result;
+    }
+
+    if (level >= 0)
+        params.level = level;
+
+    free(sample_files);
+    if (num_samples > 1) {
+        fprintf(stderr, "Error: Multiple input files specified\n");
+        return 1;
+    }
+
+    /* Validate arguments */
+    if (!input_file) {
+        fprintf(stderr, "Error: No input file specified\n");
         fprintf(stderr, "Use '%s --help' for usage information\n", PROGRAM_NAME);
         return 1;
     }
@@ -410,14 +2941,34 @@ int main(int argc, char* argv[])
         output_file = generated_output;
     }
 
+    /* Load preset dictionary */
+    uint8_t* dict = NULL;
+    size_t dict_size = 0;
+    if (dict_file) {
+        dict = read_file(dict_file, &dict_size);
+        if (!dict) {
+            free(generated_output);
+            return 1;
+        }
+    }
+
     /* Perform operation */
     int result;
+#if defined(HAVE_SERVER)
+    if (connect_path) {
+        result = do_remote(connect_path, input_file, output_file, mode == MODE_DECOMPRESS, &params, priority);
+        free(dict);
+        free(generated_output);
+        return result;
+    }
+#endif
     if (mode == MODE_COMPRESS) {
-        result = do_compress(input_file, output_file);
+        result = do_compress(input_file, output_file, &params, pipelined, budget, fit, dict, dict_size);
     } else {
-        result = do_decompress(input_file, output_file);
+        result = do_decompress(input_file, output_file, dict, dict_size);
     }
 
+    free(dict);
     free(generated_output);
     return result;
 }
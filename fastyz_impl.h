@@ -0,0 +1,51 @@
+/*
+  FastYZ - Fast Yaz0 compression library
+  Single translation unit build
+
+  Including this header declares the API exactly like fastyz.h. In the
+  translation unit that defines FASTYZ_IMPLEMENTATION first, it also
+  compiles the library itself, so the codec can be built as part of an
+  integrator's own source file (and optimized together with it, e.g. with
+  LTO) instead of being linked from a separately compiled fastyz.c:
+
+      #define FASTYZ_IMPLEMENTATION
+      #include "fastyz_impl.h"
+
+  Defining FASTYZ_STATIC as well (before any FastYZ header) makes every
+  library function static inline, private to that translation unit. The
+  compiler can then inline calls such as yaz0_decompress() into their
+  callers and propagate constant arguments, which removes the call
+  overhead for small buffers. Each translation unit that does this gets
+  its own copy of the code.
+
+  fastyz.h and fastyz.c must be reachable on the include path. The
+  implementation is C99; include this header from C sources. For best
+  results include it before other system headers, since the library
+  requests POSIX declarations (_POSIX_C_SOURCE) on non-Windows systems.
+  It still builds when a system header comes first under strict ISO C
+  (-std=c99), but the time budgets and pipeline timings are then measured
+  in processor time instead of wall-clock time.
+
+  This software is released under the MIT License.
+  See LICENSE file for details.
+*/
+
+#ifndef FASTYZ_IMPL_H
+#define FASTYZ_IMPL_H
+
+#if defined(FASTYZ_STATIC) && !defined(FASTYZ_IMPLEMENTATION)
+#error "FASTYZ_STATIC requires FASTYZ_IMPLEMENTATION in the same translation unit"
+#endif
+
+/* Same feature request as fastyz.c, ahead of the system headers fastyz.h pulls in */
+#if defined(FASTYZ_IMPLEMENTATION) && !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "fastyz.h"
+
+#if defined(FASTYZ_IMPLEMENTATION)
+#include "fastyz.c"
+#endif
+
+#endif /* FASTYZ_IMPL_H */
@@ -1,38 +1,47 @@
 -- Premake5 script for FastYZ
--- Generates project files for building the FastYZ CLI tool.
+-- Generates project files for building the FastYZ CLI tool and libraries.
+--
+-- Projects:
+--   fastyz         Command-line tool
+--   fastyz-static  Static library (lib/<config>/<platform>/static)
+--   fastyz-shared  Shared library (lib/<config>/<platform>/shared); users
+--                  define FASTYZ_SHARED when including fastyz.h
+--   fastyz-tests   Regression tests (bin/<config>/<platform>/fastyz-tests)
+--
+-- To compile the codec into your own translation unit instead, include
+-- fastyz_impl.h (see the comment at its top).
+--
+-- Release builds of the CLI should use profile-guided optimization:
+--   premake5 pgo              (GCC)
+--   premake5 pgo --cc=clang   (Clang; needs llvm-profdata)
+-- This builds the ProfileGen configuration, trains it on a generated corpus
+-- and rebuilds as ProfileUse: bin/ProfileUse/<platform>/fastyz.
+
+-- Profiles of the training run (absolute: compilers run from build/)
+local PGO_DIR = path.getabsolute("build/pgo")
 
 workspace "FastYZ"
-    configurations { "Debug", "Release" }
+    configurations { "Debug", "Release", "ProfileGen", "ProfileUse" }
     platforms { "x64", "x86" }
     location "build"
     startproject "fastyz"
 
+    language "C"
+    cdialect "C99"
+    includedirs { "." }
+
     filter "platforms:x64"
         architecture "x86_64"
     filter "platforms:x86"
         architecture "x86"
-    filter {}
-
-project "fastyz"
-    kind "ConsoleApp"
-    language "C"
-    cdialect "C99"
-
-    targetdir ("bin/%{cfg.buildcfg}/%{cfg.platform}")
-    objdir ("obj/%{cfg.buildcfg}/%{cfg.platform}")
-
-    files {
-        "fastyz_cli.c",
-        "fastyz.c",
-        "fastyz.h"
-    }
-
-    includedirs { "." }
 
     filter "system:windows"
         systemversion "latest"
         defines { "_CRT_SECURE_NO_WARNINGS" }
 
+    filter "system:not windows"
+        links { "pthread" }
+
     filter "action:vs*"
         -- MSVC warns on unknown pragmas (e.g., GCC diagnostic pragmas)
         disablewarnings { "4068" }
@@ -42,9 +51,187 @@ project "fastyz"
         optimize "Off"
         defines { "DEBUG" }
 
-    filter "configurations:Release"
+    filter "configurations:Release or ProfileGen or ProfileUse"
         symbols "Off"
         optimize "Speed"
         defines { "NDEBUG" }
 
+    -- Instrumented build; counters are updated atomically since the
+    -- pipelined and batch modes run several threads
+    filter { "configurations:ProfileGen", "toolset:gcc or clang" }
+        buildoptions { "-fprofile-generate=" .. PGO_DIR, "-fprofile-update=atomic" }
+        linkoptions { "-fprofile-generate=" .. PGO_DIR }
+
+    filter { "configurations:ProfileUse", "toolset:gcc" }
+        buildoptions { "-fprofile-use=" .. PGO_DIR, "-fprofile-correction", "-Wno-missing-profile" }
+
+    filter { "configurations:ProfileUse", "toolset:clang" }
+        buildoptions { "-fprofile-use=" .. PGO_DIR .. "/fastyz.profdata", "-Wno-profile-instr-unprofiled" }
+        linkoptions { "-fprofile-use=" .. PGO_DIR .. "/fastyz.profdata" }
+
     filter {}
+
+project "fastyz"
+    kind "ConsoleApp"
+
+    targetdir ("bin/%{cfg.buildcfg}/%{cfg.platform}")
+    objdir ("obj/%{cfg.buildcfg}/%{cfg.platform}")
+
+    -- Both profile configurations share object paths, which GCC uses to
+    -- name the profile files
+    filter "configurations:ProfileGen or ProfileUse"
+        objdir ("obj/Profile/%{cfg.platform}")
+    filter {}
+
+    files {
+        "fastyz_cli.c",
+        "fastyz.c",
+        "fastyz.h",
+        "fastyz.hpp"
+    }
+
+project "fastyz-static"
+    kind "StaticLib"
+    targetname "fastyz"
+
+    targetdir ("lib/%{cfg.buildcfg}/%{cfg.platform}/static")
+    objdir ("obj/%{cfg.buildcfg}/%{cfg.platform}/static")
+
+    files {
+        "fastyz.c",
+        "fastyz.h",
+        "fastyz.hpp",
+        "fastyz_impl.h"
+    }
+
+project "fastyz-shared"
+    kind "SharedLib"
+    targetname "fastyz"
+    pic "On"
+    visibility "Hidden"
+    defines { "FASTYZ_SHARED", "FASTYZ_BUILD" }
+
+    targetdir ("lib/%{cfg.buildcfg}/%{cfg.platform}/shared")
+    objdir ("obj/%{cfg.buildcfg}/%{cfg.platform}/shared")
+
+    files {
+        "fastyz.c",
+        "fastyz.h",
+        "fastyz.hpp",
+        "fastyz_impl.h"
+    }
+
+project "fastyz-tests"
+    kind "ConsoleApp"
+
+    targetdir ("bin/%{cfg.buildcfg}/%{cfg.platform}")
+    objdir ("obj/%{cfg.buildcfg}/%{cfg.platform}/tests")
+
+    files {
+        "tests/fastyz_test.c",
+        "fastyz.c",
+        "fastyz.h"
+    }
+
+-- ========================================================================
+-- Profile-Guided Optimization
+-- ========================================================================
+
+local function run(command)
+    print(command)
+    if not os.execute(command) then
+        error("command failed: " .. command, 0)
+    end
+end
+
+local function write_file(name, data)
+    local f = assert(io.open(name, "wb"))
+    f:write(data)
+    f:close()
+end
+
+-- Representative training inputs: text, fixed-size records, long runs,
+-- incompressible bytes and the project's own sources. Deterministic, so
+-- profiles are reproducible.
+local function write_corpus(dir)
+    math.randomseed(1)
+
+    local words = { "the", "yaz0", "stream", "archive", "model", "texture", "0x1000",
+                    "{", "}", "return", "level", "flag", "=", "int", "buffer", "match" }
+    local text = {}
+    for i = 1, 300000 do
+        text[#text + 1] = words[math.random(#words)]
+        text[#text + 1] = (i % 12 == 0) and "\n" or " "
+    end
+    write_file(dir .. "/text.txt", table.concat(text))
+
+    local records = {}
+    for i = 1, 100000 do
+        records[#records + 1] = string.pack("<I4I4I2I2f", i, math.random(0, 1000), i % 7, 0, i * 0.25)
+    end
+    write_file(dir .. "/records.bin", table.concat(records))
+
+    local runs = {}
+    for i = 1, 20000 do
+        runs[#runs + 1] = string.rep(string.char(math.random(0, 3)), math.random(1, 200))
+    end
+    write_file(dir .. "/runs.bin", table.concat(runs))
+
+    local noise = {}
+    for i = 1, 1000000 do
+        noise[#noise + 1] = string.char(math.random(0, 255))
+    end
+    write_file(dir .. "/noise.bin", table.concat(noise))
+
+    local sources = {}
+    for _, name in ipairs({ "fastyz.c", "fastyz.h", "fastyz_cli.c", "README.md" }) do
+        local f = assert(io.open(path.join(_MAIN_SCRIPT_DIR, name), "rb"))
+        sources[#sources + 1] = f:read("a")
+        f:close()
+    end
+    write_file(dir .. "/sources.txt", table.concat(sources))
+
+    return { "text.txt", "records.bin", "runs.bin", "noise.bin", "sources.txt" }
+end
+
+newaction {
+    trigger = "pgo",
+    description = "Build the CLI with profile-guided optimization (GCC, or Clang with --cc=clang)",
+
+    execute = function()
+        local cc = _OPTIONS["cc"] or "gcc"
+        local platform = "x64"
+        local make = "make -C " .. path.join(_MAIN_SCRIPT_DIR, "build") .. " fastyz config="
+
+        run(string.format('"%s" --file="%s" --cc=%s gmake2', _PREMAKE_COMMAND, _MAIN_SCRIPT, cc))
+
+        -- The profile configurations share objects; always rebuild them
+        local objects = path.join(_MAIN_SCRIPT_DIR, "obj/Profile")
+
+        -- Instrumented build, starting from an empty profile
+        os.rmdir(PGO_DIR)
+        os.mkdir(PGO_DIR .. "/corpus")
+        os.rmdir(objects)
+        run(make .. "profilegen_" .. platform)
+
+        -- Training run: every match search and the decoder
+        local exe = path.join(_MAIN_SCRIPT_DIR, "bin/ProfileGen/" .. platform .. "/fastyz")
+        local modes = { "-l 0", "-l 1", "-l 6", "-l 9", "-a auto", "--adaptive", "--decode-speed 5", "--pipeline" }
+        for _, name in ipairs(write_corpus(PGO_DIR .. "/corpus")) do
+            local input = PGO_DIR .. "/corpus/" .. name
+            for _, mode in ipairs(modes) do
+                run(string.format('"%s" -c %s "%s" -o "%s.yaz0"', exe, mode, input, input))
+                run(string.format('"%s" -d "%s.yaz0" -o "%s.out"', exe, input, input))
+            end
+        end
+
+        if cc == "clang" then
+            run(string.format('llvm-profdata merge -output="%s/fastyz.profdata" "%s"/*.profraw', PGO_DIR, PGO_DIR))
+        end
+
+        -- Optimized build with the profile
+        os.rmdir(objects)
+        run(make .. "profileuse_" .. platform)
+        print("Built " .. path.join(_MAIN_SCRIPT_DIR, "bin/ProfileUse/" .. platform .. "/fastyz"))
+    end
+}
@@ -0,0 +1,468 @@
+/*
+  FastYZ Python Bindings
+
+  CPython extension module wrapping the FastYZ library. Inputs may be any
+  object supporting the buffer protocol (bytes, bytearray, memoryview,
+  mmap, array, NumPy arrays, ...) and are used in place; the *_into()
+  functions write into a preallocated writable buffer. The GIL is released
+  while compressing or decompressing, so thread pools scale across cores.
+
+  This software is released under the MIT License.
+  See LICENSE file for details.
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <limits.h>
+#include <stdlib.h>
+
+#include "fastyz.h"
+
+/* Raised when a stream is malformed or does not fit the output buffer */
+static PyObject* fastyz_error;
+
+/* ========================================================================
+ * Helpers
+ * ======================================================================== */
+
+/*
+ * Fill 'params' from the keyword arguments shared by the compressors.
+ * Returns 0 and sets an exception if they are invalid.
+ */
+static int make_params(yaz0_params_t* params, int level, int alignment, int decode_speed, int adaptive)
+{
+    yaz0_params_init(params);
+    params->level = level;
+    params->alignment = alignment;
+    params->decode_speed = decode_speed;
+    params->strategy = adaptive ? YAZ0_STRATEGY_ADAPTIVE : YAZ0_STRATEGY_FIXED;
+
+    if (level < 0 || level > 9 || decode_speed < 0 || decode_speed > 9 || alignment < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid compression parameters");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Check that an input fits the Yaz0 size field.
+ * Returns 0 and sets an exception otherwise.
+ */
+static int check_input_size(const Py_buffer* view)
+{
+    if ((size_t)view->len > YAZ0_MAX_INPUT_SIZE || FASTYZ_BOUND((size_t)view->len) > (size_t)PY_SSIZE_T_MAX)
+    {
+        PyErr_SetString(PyExc_OverflowError, "input exceeds the 4 GiB Yaz0 limit");
+        return 0;
+    }
+    return 1;
+}
+
+/* ========================================================================
+ * Compression
+ * ======================================================================== */
+
+static char* compress_keywords[] = { "data", "level", "alignment", "decode_speed", "adaptive", NULL };
+static char* compress_into_keywords[] = { "data", "output", "level", "alignment", "decode_speed", "adaptive", NULL };
+
+PyDoc_STRVAR(compress_doc,
+"compress(data, level=0, alignment=1, decode_speed=0, adaptive=False) -> bytes\n"
+"\n"
+"Compress a bytes-like object to a Yaz0 stream.");
+
+static PyObject* py_compress(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    Py_buffer input;
+    int level = 0, alignment = 1, decode_speed = 0, adaptive = 0;
+    yaz0_params_t params;
+    (void)self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|$iiip", compress_keywords,
+                                     &input, &level, &alignment, &decode_speed, &adaptive))
+        return NULL;
+
+    if (!make_params(&params, level, alignment, decode_speed, adaptive) || !check_input_size(&input))
+    {
+        PyBuffer_Release(&input);
+        return NULL;
+    }
+
+    PyObject* result = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)FASTYZ_BOUND((size_t)input.len));
+    if (!result)
+    {
+        PyBuffer_Release(&input);
+        return NULL;
+    }
+
+    size_t size;
+    Py_BEGIN_ALLOW_THREADS
+    size = yaz0_compress_ex64(input.buf, (size_t)input.len, PyBytes_AS_STRING(result), &params);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&input);
+
+    if (size == 0)
+    {
+        Py_DECREF(result);
+        PyErr_SetString(PyExc_ValueError, "invalid compression parameters");
+        return NULL;
+    }
+
+    if (_PyBytes_Resize(&result, (Py_ssize_t)size) < 0)
+        return NULL;
+    return result;
+}
+
+PyDoc_STRVAR(compress_into_doc,
+"compress_into(data, output, level=0, alignment=1, decode_speed=0, adaptive=False) -> int\n"
+"\n"
+"Compress a bytes-like object into a writable buffer (e.g. a bytearray or\n"
+"memoryview) of at least compress_bound(len(data)) bytes. Returns the size\n"
+"of the compressed stream.");
+
+static PyObject* py_compress_into(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    Py_buffer input, output;
+    int level = 0, alignment = 1, decode_speed = 0, adaptive = 0;
+    yaz0_params_t params;
+    (void)self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*w*|$iiip", compress_into_keywords,
+                                     &input, &output, &level, &alignment, &decode_speed, &adaptive))
+        return NULL;
+
+    PyObject* result = NULL;
+
+    if (!make_params(&params, level, alignment, decode_speed, adaptive) || !check_input_size(&input))
+        goto done;
+
+    if ((size_t)output.len < FASTYZ_BOUND((size_t)input.len))
+    {
+        PyErr_SetString(PyExc_ValueError, "output buffer is smaller than compress_bound(len(data))");
+        goto done;
+    }
+
+    size_t size;
+    Py_BEGIN_ALLOW_THREADS
+    size = yaz0_compress_ex64(input.buf, (size_t)input.len, output.buf, &params);
+    Py_END_ALLOW_THREADS
+
+    if (size == 0)
+        PyErr_SetString(PyExc_ValueError, "invalid compression parameters");
+    else
+        result = PyLong_FromSize_t(size);
+
+done:
+    PyBuffer_Release(&input);
+    PyBuffer_Release(&output);
+    return result;
+}
+
+PyDoc_STRVAR(compress_bound_doc,
+"compress_bound(length) -> int\n"
+"\n"
+"Worst-case compressed size of 'length' input bytes.");
+
+static PyObject* py_compress_bound(PyObject* self, PyObject* arg)
+{
+    (void)self;
+
+    size_t length = PyLong_AsSize_t(arg);
+    if (length == (size_t)-1 && PyErr_Occurred())
+        return NULL;
+
+    return PyLong_FromSize_t(FASTYZ_BOUND(length));
+}
+
+/* ========================================================================
+ * Decompression
+ * ======================================================================== */
+
+PyDoc_STRVAR(decompressed_size_doc,
+"decompressed_size(data) -> int\n"
+"\n"
+"Decompressed size recorded in a Yaz0 header.");
+
+static PyObject* py_decompressed_size(PyObject* self, PyObject* arg)
+{
+    Py_buffer input;
+    (void)self;
+
+    if (PyObject_GetBuffer(arg, &input, PyBUF_SIMPLE) < 0)
+        return NULL;
+
+    int valid = input.len >= YAZ0_HEADER_SIZE && yaz0_is_valid(input.buf);
+    uint32_t size = valid ? yaz0_get_decompressed_size(input.buf) : 0;
+    PyBuffer_Release(&input);
+
+    if (!valid)
+    {
+        PyErr_SetString(fastyz_error, "not a Yaz0 stream");
+        return NULL;
+    }
+    return PyLong_FromUnsignedLong(size);
+}
+
+PyDoc_STRVAR(decompress_doc,
+"decompress(data) -> bytes\n"
+"\n"
+"Decompress a Yaz0 stream.");
+
+static PyObject* py_decompress(PyObject* self, PyObject* arg)
+{
+    Py_buffer input;
+    (void)self;
+
+    if (PyObject_GetBuffer(arg, &input, PyBUF_SIMPLE) < 0)
+        return NULL;
+
+    if (input.len < YAZ0_HEADER_SIZE || !yaz0_is_valid(input.buf))
+    {
+        PyBuffer_Release(&input);
+        PyErr_SetString(fastyz_error, "not a Yaz0 stream");
+        return NULL;
+    }
+
+    /* An empty stream is just a header; there is nothing to decode. */
+    uint32_t expected = yaz0_get_decompressed_size(input.buf);
+    if (expected == 0)
+    {
+        PyBuffer_Release(&input);
+        return PyBytes_FromStringAndSize(NULL, 0);
+    }
+
+    PyObject* result = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)expected);
+    if (!result)
+    {
+        PyBuffer_Release(&input);
+        return NULL;
+    }
+
+    size_t size;
+    Py_BEGIN_ALLOW_THREADS
+    size = yaz0_decompress64(input.buf, (size_t)input.len, PyBytes_AS_STRING(result), expected);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&input);
+
+    if (size != expected)
+    {
+        Py_DECREF(result);
+        PyErr_SetString(fastyz_error, "malformed Yaz0 stream");
+        return NULL;
+    }
+    return result;
+}
+
+static char* decompress_into_keywords[] = { "data", "output", NULL };
+
+PyDoc_STRVAR(decompress_into_doc,
+"decompress_into(data, output) -> int\n"
+"\n"
+"Decompress a Yaz0 stream into a writable buffer of at least\n"
+"decompressed_size(data) bytes. Returns the number of bytes written.");
+
+static PyObject* py_decompress_into(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    Py_buffer input, output;
+    (void)self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*w*", decompress_into_keywords, &input, &output))
+        return NULL;
+
+    /* yaz0_decompress64() reports errors as 0, so an empty stream is
+     * recognised from its header before decoding. */
+    if (input.len >= YAZ0_HEADER_SIZE && yaz0_is_valid(input.buf) && yaz0_get_decompressed_size(input.buf) == 0)
+    {
+        PyBuffer_Release(&input);
+        PyBuffer_Release(&output);
+        return PyLong_FromSize_t(0);
+    }
+
+    size_t size;
+    Py_BEGIN_ALLOW_THREADS
+    size = yaz0_decompress64(input.buf, (size_t)input.len, output.buf, (size_t)output.len);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&input);
+    PyBuffer_Release(&output);
+
+    if (size == 0)
+    {
+        PyErr_SetString(fastyz_error, "malformed Yaz0 stream or output buffer too small");
+        return NULL;
+    }
+    return PyLong_FromSize_t(size);
+}
+
+/* ========================================================================
+ * Recompression
+ * ======================================================================== */
+
+static char* recompress_batch_keywords[] = { "streams", "level", "threads", NULL };
+
+PyDoc_STRVAR(recompress_batch_doc,
+"recompress_batch(streams, level=9, threads=0) -> list\n"
+"\n"
+"Re-encode a sequence of Yaz0 streams in parallel (threads=0 uses one\n"
+"thread per processor). Returns a list of bytes, each no larger than its\n"
+"input; streams with no smaller encoding are returned unchanged.");
+
+static PyObject* py_recompress_batch(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* streams;
+    int level = 9, threads = 0;
+    yaz0_params_t params;
+    (void)self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$ii", recompress_batch_keywords, &streams, &level, &threads))
+        return NULL;
+    if (!make_params(&params, level, 1, 0, 0))
+        return NULL;
+
+    PyObject* seq = PySequence_Fast(streams, "streams must be a sequence of bytes-like objects");
+    if (!seq)
+        return NULL;
+
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+    if (count > INT_MAX)
+    {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_OverflowError, "too many streams");
+        return NULL;
+    }
+
+    Py_buffer* views = (Py_buffer*)PyMem_Calloc(count ? (size_t)count : 1, sizeof(Py_buffer));
+    yaz0_recompress_job_t* jobs = (yaz0_recompress_job_t*)PyMem_Calloc(count ? (size_t)count : 1, sizeof(yaz0_recompress_job_t));
+    PyObject* result = NULL;
+    Py_ssize_t acquired = 0;
+
+    if (!views || !jobs)
+    {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    for (; acquired < count; ++acquired)
+    {
+        if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(seq, acquired), &views[acquired], PyBUF_SIMPLE) < 0)
+            goto done;
+        if (views[acquired].len > INT_MAX)
+        {
+            ++acquired;
+            PyErr_SetString(PyExc_OverflowError, "stream exceeds 2 GiB");
+            goto done;
+        }
+
+        jobs[acquired].input = views[acquired].buf;
+        jobs[acquired].length = (int)views[acquired].len;
+        jobs[acquired].output = PyMem_RawMalloc(views[acquired].len ? (size_t)views[acquired].len : 1);
+        if (!jobs[acquired].output)
+        {
+            ++acquired;
+            PyErr_NoMemory();
+            goto done;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    yaz0_recompress_batch(jobs, (int)count, &params, threads);
+    Py_END_ALLOW_THREADS
+
+    result = PyList_New(count);
+    if (!result)
+        goto done;
+
+    for (Py_ssize_t i = 0; i < count; ++i)
+    {
+        if (jobs[i].result <= 0)
+        {
+            Py_CLEAR(result);
+            PyErr_Format(fastyz_error, "stream %zd is not a valid Yaz0 stream", i);
+            goto done;
+        }
+
+        PyObject* item = PyBytes_FromStringAndSize((const char*)jobs[i].output, jobs[i].result);
+        if (!item)
+        {
+            Py_CLEAR(result);
+            goto done;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+
+done:
+    for (Py_ssize_t i = 0; i < acquired; ++i)
+    {
+        PyMem_RawFree(jobs[i].output);
+        PyBuffer_Release(&views[i]);
+    }
+    PyMem_Free(views);
+    PyMem_Free(jobs);
+    Py_DECREF(seq);
+    return result;
+}
+
+/* ========================================================================
+ * Module Definition
+ * ======================================================================== */
+
+static PyMethodDef fastyz_methods[] = {
+    { "compress", (PyCFunction)(void (*)(void))py_compress, METH_VARARGS | METH_KEYWORDS, compress_doc },
+    { "compress_into", (PyCFunction)(void (*)(void))py_compress_into, METH_VARARGS | METH_KEYWORDS, compress_into_doc },
+    { "compress_bound", py_compress_bound, METH_O, compress_bound_doc },
+    { "decompress", py_decompress, METH_O, decompress_doc },
+    { "decompress_into", (PyCFunction)(void (*)(void))py_decompress_into, METH_VARARGS | METH_KEYWORDS, decompress_into_doc },
+    { "decompressed_size", py_decompressed_size, METH_O, decompressed_size_doc },
+    { "recompress_batch", (PyCFunction)(void (*)(void))py_recompress_batch, METH_VARARGS | METH_KEYWORDS, recompress_batch_doc },
+    { NULL, NULL, 0, NULL }
+};
+
+PyDoc_STRVAR(module_doc,
+"Fast Yaz0 compression.\n"
+"\n"
+"All functions accept any bytes-like object without copying it and release\n"
+"the GIL while working.");
+
+static struct PyModuleDef fastyz_module = {
+    PyModuleDef_HEAD_INIT,
+    "fastyz",
+    module_doc,
+    -1,
+    fastyz_methods,
+    NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit_fastyz(void)
+{
+    PyObject* module = PyModule_Create(&fastyz_module);
+    if (!module)
+        return NULL;
+
+    fastyz_error = PyErr_NewException("fastyz.error", NULL, NULL);
+    if (!fastyz_error || PyModule_AddObject(module, "error", fastyz_error) < 0)
+    {
+        Py_XDECREF(fastyz_error);
+        Py_DECREF(module);
+        return NULL;
+    }
+    Py_INCREF(fastyz_error);
+
+    PyObject* max_input = PyLong_FromUnsignedLong(YAZ0_MAX_INPUT_SIZE);
+    if (!max_input || PyModule_AddObject(module, "MAX_INPUT_SIZE", max_input) < 0)
+    {
+        Py_XDECREF(max_input);
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    if (PyModule_AddStringConstant(module, "__version__", FASTYZ_VERSION_STRING) < 0)
+    {
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    return module;
+}
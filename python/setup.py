@@ -0,0 +1,28 @@
+# Build the FastYZ Python extension (no network access needed):
+#
+#   python setup.py build_ext --inplace
+#
+# The library is compiled into the extension from the parent directory.
+
+import os
+import sys
+
+from setuptools import Extension, setup
+
+ROOT = os.path.relpath(os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+
+setup(
+    name="fastyz",
+    version="1.0.0",
+    description="Fast Yaz0 compression",
+    license="MIT",
+    ext_modules=[
+        Extension(
+            "fastyz",
+            sources=["fastyzmodule.c", os.path.join(ROOT, "fastyz.c")],
+            include_dirs=[ROOT],
+            define_macros=[("NDEBUG", None)],
+            libraries=[] if sys.platform == "win32" else ["pthread"],
+        )
+    ],
+)
@@ -0,0 +1,407 @@
+/*
+  FastYZ regression tests
+
+  Runs each test and reports failures; exits nonzero if any failed.
+  Build with fastyz.c (premake project "fastyz-tests"), preferably with
+  -fsanitize=address so that out-of-bounds writes are caught as well.
+
+  This software is released under the MIT License.
+  See LICENSE file for details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "fastyz.h"
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/* Bytes after the capacity of an output buffer that must stay untouched */
+#define GUARD_SIZE 64
+#define GUARD_BYTE 0xA5
+
+/* ========================================================================
+ * Inputs
+ * ======================================================================== */
+
+/* 8 MiB of zeros: one long run */
+#define ZEROS_SIZE (8 << 20)
+
+/* A 3-byte pattern repeated over 2 MiB */
+#define PATTERN_SIZE (2 << 20)
+
+static uint8_t* make_zeros(void)
+{
+    return (uint8_t*)calloc(ZEROS_SIZE, 1);
+}
+
+static uint8_t* make_pattern(void)
+{
+    uint8_t* data = (uint8_t*)malloc(PATTERN_SIZE);
+    if (data) {
+        for (int i = 0; i < PATTERN_SIZE; i++)
+            data[i] = (uint8_t)"abc"[i % 3];
+    }
+    return data;
+}
+
+/* ========================================================================
+ * Helpers
+ * ======================================================================== */
+
+/*
+ * Output buffer of 'cap' bytes followed by a guard region.
+ */
+static uint8_t* guarded_alloc(size_t cap)
+{
+    uint8_t* buffer = (uint8_t*)malloc(cap + GUARD_SIZE);
+    if (buffer)
+        memset(buffer + cap, GUARD_BYTE, GUARD_SIZE);
+    return buffer;
+}
+
+static int guard_intact(const uint8_t* buffer, size_t cap)
+{
+    for (size_t i = 0; i < GUARD_SIZE; i++) {
+        if (buffer[cap + i] != GUARD_BYTE)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Whether 'stream' decompresses to the first 'length' bytes of 'input'.
+ */
+static int decodes_to(const uint8_t* stream, int size, const uint8_t* input, int length)
+{
+    uint8_t* out = (uint8_t*)malloc(length > 0 ? (size_t)length : 1);
+    int ok = out && yaz0_decompress(stream, size, out, length) == length && memcmp(out, input, length) == 0;
+    free(out);
+    return ok;
+}
+
+/* ========================================================================
+ * Fixed-Capacity Compression
+ * ======================================================================== */
+
+static void check_destsize(const char* name, const uint8_t* input, int length)
+{
+    static const int caps[] = { YAZ0_HEADER_SIZE, 100, 4096, 30000, 100000, 1 << 20 };
+
+    for (size_t i = 0; i < sizeof(caps) / sizeof(caps[0]); i++) {
+        int cap = caps[i];
+        int in_len = length;
+        uint8_t* out = guarded_alloc((size_t)cap);
+        if (!out) {
+            CHECK(out != NULL);
+            return;
+        }
+
+        int size = yaz0_compress_destsize(input, &in_len, out, cap);
+        if (!guard_intact(out, (size_t)cap) || size > cap || !decodes_to(out, size, input, in_len)) {
+            fprintf(stderr, "  yaz0_compress_destsize on %s, out_cap %d\n", name, cap);
+            failures++;
+        }
+        free(out);
+    }
+}
+
+/*
+ * yaz0_compress_safe() must stay within 'maxout', and a retry with the
+ * size it asks for must succeed with exactly that size.
+ */
+static void check_safe(const char* name, const uint8_t* input, int length)
+{
+    static const int caps[] = { 0, 100, 4096, 30000, 100000, 1 << 20 };
+
+    for (size_t i = 0; i < sizeof(caps) / sizeof(caps[0]); i++) {
+        int cap = caps[i];
+        uint8_t* out = guarded_alloc((size_t)cap);
+        if (!out) {
+            CHECK(out != NULL);
+            return;
+        }
+
+        int size = yaz0_compress_safe(input, length, out, cap);
+        int ok = guard_intact(out, (size_t)cap) && size != 0 && size <= cap;
+
+        if (ok && size > 0) {
+            ok = decodes_to(out, size, input, length);
+        } else if (size < 0) {
+            int needed = -size;
+            uint8_t* retry = guarded_alloc((size_t)needed);
+            ok = guard_intact(out, (size_t)cap) && retry &&
+                 yaz0_compress_safe(input, length, retry, needed) == needed &&
+                 guard_intact(retry, (size_t)needed) && decodes_to(retry, needed, input, length);
+            free(retry);
+        }
+
+        if (!ok) {
+            fprintf(stderr, "  yaz0_compress_safe on %s, maxout %d\n", name, cap);
+            failures++;
+        }
+        free(out);
+    }
+}
+
+static void test_destsize_long_runs(void)
+{
+    uint8_t* zeros = make_zeros();
+    uint8_t* pattern = make_pattern();
+
+    CHECK(zeros && pattern);
+    if (zeros && pattern) {
+        check_destsize("zeros", zeros, ZEROS_SIZE);
+        check_destsize("pattern", pattern, PATTERN_SIZE);
+    }
+
+    free(zeros);
+    free(pattern);
+}
+
+static void test_safe_long_runs(void)
+{
+    uint8_t* zeros = make_zeros();
+    uint8_t* pattern = make_pattern();
+
+    CHECK(zeros && pattern);
+    if (zeros && pattern) {
+        check_safe("zeros", zeros, ZEROS_SIZE);
+        check_safe("pattern", pattern, PATTERN_SIZE);
+    }
+
+    free(zeros);
+    free(pattern);
+}
+
+/* ========================================================================
+ * Size Estimation
+ * ======================================================================== */
+
+/*
+ * Inputs this small are counted exactly, one chunk at a time through a
+ * small scratch buffer. A run reaching far past the chunk must not make
+ * a chunk emit more than that buffer holds.
+ */
+static void test_estimate_long_runs(void)
+{
+    const int length = 190000;
+    uint8_t* data = (uint8_t*)calloc((size_t)length, 1);
+    uint32_t seed = 1;
+
+    CHECK(data != NULL);
+    if (!data)
+        return;
+
+    /* Incompressible bytes, then zeros to the end */
+    for (int i = 0; i < 8100; i++) {
+        seed = seed * 1103515245u + 12345u;
+        data[i] = (uint8_t)(seed >> 16);
+    }
+
+    for (int level = 0; level <= 9; level += 3) {
+        yaz0_estimate_t e;
+        int size = yaz0_estimate_size(data, length, level, &e);
+        CHECK(size == e.size && e.size > 8100 && e.size <= (int)FASTYZ_BOUND(length));
+        CHECK(e.low == e.size && e.high == e.size);
+    }
+    free(data);
+}
+
+/* ========================================================================
+ * Alignment Detection
+ * ======================================================================== */
+
+/*
+ * Inputs shorter than the 4 KiB sample window are searched whole; the
+ * phase trial must not read past their end.
+ */
+static void test_detect_alignment_short(void)
+{
+    for (int length = 4 * 16; length <= 4096; length += length < 128 ? 1 : 61) {
+        uint8_t* data = (uint8_t*)malloc((size_t)length);
+        int phase = -1;
+
+        CHECK(data != NULL);
+        if (!data)
+            return;
+
+        /* 8-byte records with a counter field, so that alignment 8 is detected */
+        for (int i = 0; i < length; i++)
+            data[i] = (uint8_t)(i % 8 < 4 ? "rec:"[i % 8] : i / 8);
+
+        int align = yaz0_detect_alignment(data, length, &phase);
+        CHECK(align >= 1 && align <= 16 && phase >= 0 && phase < align);
+        free(data);
+    }
+}
+
+/* ========================================================================
+ * Size Targets
+ * ======================================================================== */
+
+/* Random letters from a small alphabet: short matches at almost every position */
+#define LETTERS_SIZE (1 << 20)
+
+static uint8_t* make_letters(void)
+{
+    uint8_t* data = (uint8_t*)malloc(LETTERS_SIZE);
+    uint32_t seed = 12345;
+
+    if (data) {
+        for (int i = 0; i < LETTERS_SIZE; i++) {
+            seed = seed * 1103515245u + 12345u;
+            data[i] = (uint8_t)"acgt"[(seed >> 16) & 3];
+        }
+    }
+    return data;
+}
+
+/*
+ * yaz0_compress_fit() compresses in chunks so that it can give up early;
+ * with a decode policy the result must still match yaz0_compress_ex() at
+ * the level it reports.
+ */
+static void test_fit_matches_level(void)
+{
+    uint8_t* letters = make_letters();
+    uint8_t* fit = (uint8_t*)malloc(FASTYZ_BOUND(LETTERS_SIZE));
+    uint8_t* ref = (uint8_t*)malloc(FASTYZ_BOUND(LETTERS_SIZE));
+
+    CHECK(letters && fit && ref);
+    for (int ds = 0; letters && fit && ref && ds <= 9; ds++) {
+        yaz0_params_t params;
+        int level = -1;
+
+        yaz0_params_init(&params);
+        params.decode_speed = ds;
+        params.level = 2;
+        int target = yaz0_compress_ex(letters, LETTERS_SIZE, ref, &params);
+
+        params.level = 0;
+        int size = yaz0_compress_fit(letters, LETTERS_SIZE, fit, target, &params, &level);
+        CHECK(size > 0 && size <= target && level >= 0);
+        if (size <= 0)
+            continue;
+
+        params.level = level;
+        int expect = yaz0_compress_ex(letters, LETTERS_SIZE, ref, &params);
+        if (size != expect || memcmp(fit, ref, (size_t)size) != 0) {
+            fprintf(stderr, "  yaz0_compress_fit at level %d, decode_speed %d: %d bytes, expected %d\n",
+                    level, ds, size, expect);
+            failures++;
+        }
+    }
+
+    free(letters);
+    free(fit);
+    free(ref);
+}
+
+/* ========================================================================
+ * Allocators
+ * ======================================================================== */
+
+typedef struct {
+    int allocs;
+    int frees;
+} alloc_counts_t;
+
+static void* counting_alloc(void* user, size_t size)
+{
+    ((alloc_counts_t*)user)->allocs++;
+    return malloc(size);
+}
+
+static void counting_free(void* user, void* ptr)
+{
+    ((alloc_counts_t*)user)->frees++;
+    free(ptr);
+}
+
+/*
+ * The _cctx variants take their per-call buffers from the context's
+ * allocator, release all of them, and produce the same output as the
+ * plain functions.
+ */
+static void test_cctx_allocator(void)
+{
+    alloc_counts_t counts = { 0, 0 };
+    yaz0_allocator_t allocator = { counting_alloc, counting_free, &counts };
+    yaz0_cctx_t* cctx = yaz0_cctx_create(&allocator);
+    uint8_t* pattern = make_pattern();
+    uint8_t* stream = (uint8_t*)malloc(FASTYZ_BOUND(PATTERN_SIZE));
+    uint8_t* a = (uint8_t*)malloc(FASTYZ_BOUND(PATTERN_SIZE));
+    uint8_t* b = (uint8_t*)malloc(FASTYZ_BOUND(PATTERN_SIZE));
+
+    CHECK(cctx && pattern && stream && a && b);
+    if (cctx && pattern && stream && a && b) {
+        yaz0_params_t params;
+        yaz0_params_init(&params);
+        int length = yaz0_compress(pattern, PATTERN_SIZE, stream);
+
+        int base = counts.allocs;
+        int size = yaz0_recompress_cctx(cctx, stream, length, a, length, &params);
+        CHECK(size > 0 && size == yaz0_recompress(stream, length, b, length, &params) && memcmp(a, b, (size_t)size) == 0);
+        CHECK(counts.allocs > base);
+
+        struct iovec iov[3] = {
+            { pattern, 1000 }, { pattern + 1000, 0 }, { pattern + 1000, PATTERN_SIZE - 1000 }
+        };
+        base = counts.allocs;
+        size = yaz0_compressv_cctx(cctx, iov, 3, a);
+        CHECK(size > 0 && size == yaz0_compressv(iov, 3, b) && memcmp(a, b, (size_t)size) == 0);
+        CHECK(counts.allocs > base);
+
+        int sizes[4] = { 4096, 4096, 4096, 4096 };
+        base = counts.allocs;
+        size = yaz0_train_dict_cctx(cctx, a, 4096, pattern, sizes, 4);
+        CHECK(size == yaz0_train_dict(b, 4096, pattern, sizes, 4) && memcmp(a, b, (size_t)size) == 0);
+        CHECK(counts.allocs > base);
+
+        /* Two identical jobs: keyed once, re-encoded once */
+        yaz0_recompress_job_t jobs[2] = { { stream, length, a, 0 }, { stream, length, b, 0 } };
+        base = counts.allocs;
+        yaz0_recompress_batch_cached(jobs, 2, &params, 2, NULL, NULL, &allocator);
+        CHECK(jobs[0].result > 0 && jobs[1].result == jobs[0].result);
+        CHECK(counts.allocs > base);
+    }
+
+    yaz0_cctx_free(cctx);
+    CHECK(counts.allocs == counts.frees);
+    free(pattern);
+    free(stream);
+    free(a);
+    free(b);
+}
+
+/* ========================================================================
+ * Main
+ * ======================================================================== */
+
+int main(void)
+{
+    test_destsize_long_runs();
+    test_safe_long_runs();
+    test_estimate_long_runs();
+    test_detect_alignment_short();
+    test_fit_matches_level();
+    test_cctx_allocator();
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}